@@ -0,0 +1,327 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Latency of messages going through mavlink-routerd, between two clients of
+ * a ShmEndpoint and between two clients of a UdpEndpoint in Server mode on
+ * the loopback interface. The router must be configured with both, e.g.:
+ *
+ * [ShmEndpoint bench]
+ * Path = @mavlink-bench
+ *
+ * [UdpEndpoint bench]
+ * Mode = Server
+ * Address = 127.0.0.1
+ * Port = 14600
+ *
+ * and run with: shm-latency @mavlink-bench 14600
+ *
+ * One PING is in flight at a time, its time_usec holding when it was sent.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <common/mavlink.h>
+#include <mavlink-shm/mavlink_shm.h>
+
+#define SENDER_SYSID 1
+#define RECEIVER_SYSID 2
+
+#define DEFAULT_COUNT 2000
+#define DEFAULT_RATE_HZ 200
+
+#define RECV_TIMEOUT_MSEC 1000
+
+static uint64_t now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int sleep_until(uint64_t usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    return clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+static uint16_t pack_ping(uint8_t *buf, uint8_t sysid, uint32_t seq)
+{
+    mavlink_message_t msg;
+
+    mavlink_msg_ping_pack(sysid, MAV_COMP_ID_ALL, &msg, now_usec(), seq, 0, 0);
+    return mavlink_msg_to_send_buffer(buf, &msg);
+}
+
+static uint16_t pack_heartbeat(uint8_t *buf, uint8_t sysid)
+{
+    mavlink_message_t msg;
+
+    mavlink_msg_heartbeat_pack(sysid, MAV_COMP_ID_ALL, &msg, MAV_TYPE_ONBOARD_CONTROLLER,
+                               MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+    return mavlink_msg_to_send_buffer(buf, &msg);
+}
+
+/*
+ * Parse @len bytes received on @chan, return the latency of PING @seq if
+ * it's in there, 0 otherwise
+ */
+static uint64_t find_ping(mavlink_channel_t chan, const uint8_t *data, size_t len, uint32_t seq)
+{
+    mavlink_message_t msg;
+    mavlink_status_t status;
+    uint64_t latency = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (!mavlink_parse_char(chan, data[i], &msg, &status))
+            continue;
+        if (msg.msgid != MAVLINK_MSG_ID_PING || msg.sysid != SENDER_SYSID
+            || mavlink_msg_ping_get_seq(&msg) != seq)
+            continue;
+
+        latency = now_usec() - mavlink_msg_ping_get_time_usec(&msg);
+    }
+
+    return latency;
+}
+
+class Path {
+public:
+    virtual ~Path() { }
+
+    virtual const char *name() = 0;
+    virtual int send(const uint8_t *data, size_t len) = 0;
+    /* Latency of PING @seq, 0 if it didn't arrive in time */
+    virtual uint64_t recv_ping(uint32_t seq) = 0;
+};
+
+class ShmPath : public Path {
+public:
+    ~ShmPath()
+    {
+        mavlink_shm_close(_sender);
+        mavlink_shm_close(_receiver);
+    }
+
+    int open(const char *path)
+    {
+        _sender = mavlink_shm_connect(path);
+        _receiver = mavlink_shm_connect(path);
+        if (!_sender || !_receiver) {
+            fprintf(stderr, "Could not connect to %s: %m\n", path);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    const char *name() override { return "shm"; }
+
+    int send(const uint8_t *data, size_t len) override
+    {
+        return mavlink_shm_send(_sender, data, len);
+    }
+
+    uint64_t recv_ping(uint32_t seq) override
+    {
+        const uint64_t deadline = now_usec() + RECV_TIMEOUT_MSEC * 1000;
+        const uint8_t *data;
+        size_t len;
+        int r;
+
+        do {
+            while ((r = mavlink_shm_peek(_receiver, &data, &len)) > 0) {
+                uint64_t latency = find_ping(MAVLINK_COMM_0, data, len, seq);
+
+                mavlink_shm_consume(_receiver);
+                if (latency)
+                    return latency;
+            }
+            if (r < 0)
+                return 0;
+
+            r = mavlink_shm_wait(_receiver, RECV_TIMEOUT_MSEC);
+        } while (r >= 0 && now_usec() < deadline);
+
+        return 0;
+    }
+
+private:
+    struct mavlink_shm *_sender = nullptr;
+    struct mavlink_shm *_receiver = nullptr;
+};
+
+class UdpPath : public Path {
+public:
+    ~UdpPath()
+    {
+        if (_sender > -1)
+            close(_sender);
+        if (_receiver > -1)
+            close(_receiver);
+    }
+
+    int open(unsigned long port)
+    {
+        struct sockaddr_in addr = {};
+        uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        _sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        _receiver = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (_sender < 0 || _receiver < 0
+            || connect(_sender, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || connect(_receiver, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Could not connect to port %lu: %m\n", port);
+            return -1;
+        }
+
+        /* The router only writes to peers it heard from */
+        if (::send(_receiver, buf, pack_heartbeat(buf, RECEIVER_SYSID), 0) < 0
+            || ::send(_sender, buf, pack_heartbeat(buf, SENDER_SYSID), 0) < 0) {
+            fprintf(stderr, "Could not send to port %lu: %m\n", port);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    const char *name() override { return "udp"; }
+
+    int send(const uint8_t *data, size_t len) override
+    {
+        return ::send(_sender, data, len, 0) < 0 ? -errno : 0;
+    }
+
+    uint64_t recv_ping(uint32_t seq) override
+    {
+        const uint64_t deadline = now_usec() + RECV_TIMEOUT_MSEC * 1000;
+        struct pollfd pfd = {_receiver, POLLIN, 0};
+        uint8_t buf[2048];
+
+        while (now_usec() < deadline && poll(&pfd, 1, RECV_TIMEOUT_MSEC) > 0) {
+            ssize_t r = ::recv(_receiver, buf, sizeof(buf), 0);
+            if (r < 0)
+                return 0;
+
+            uint64_t latency = find_ping(MAVLINK_COMM_1, buf, r, seq);
+            if (latency)
+                return latency;
+        }
+
+        return 0;
+    }
+
+private:
+    int _sender = -1;
+    int _receiver = -1;
+};
+
+static void run(Path &path, unsigned count, unsigned rate_hz)
+{
+    const uint64_t period_usec = 1000000 / rate_hz;
+    std::vector<uint64_t> latencies;
+    uint64_t next = now_usec();
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    unsigned lost = 0;
+
+    latencies.reserve(count);
+
+    for (unsigned seq = 0; seq < count; seq++) {
+        if (path.send(buf, pack_ping(buf, SENDER_SYSID, seq)) < 0) {
+            lost++;
+        } else {
+            uint64_t latency = path.recv_ping(seq);
+            if (latency)
+                latencies.push_back(latency);
+            else
+                lost++;
+        }
+
+        next += period_usec;
+        sleep_until(next);
+    }
+
+    if (latencies.empty()) {
+        printf("%s: all %u messages lost\n", path.name(), count);
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%s: %zu messages, %u lost, latency usec min %" PRIu64 " p50 %" PRIu64
+           " p99 %" PRIu64 " max %" PRIu64 "\n",
+           path.name(), latencies.size(), lost, latencies.front(),
+           latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100],
+           latencies.back());
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long port, count = DEFAULT_COUNT, rate_hz = DEFAULT_RATE_HZ;
+
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: %s <shm socket path> <udp port> [count [rate Hz]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    port = strtoul(argv[2], nullptr, 10);
+    if (argc > 3)
+        count = strtoul(argv[3], nullptr, 10);
+    if (argc > 4)
+        rate_hz = strtoul(argv[4], nullptr, 10);
+    if (port == 0 || port > 65535 || count == 0 || rate_hz == 0 || rate_hz > 1000000) {
+        fprintf(stderr, "Invalid port, count or rate\n");
+        return EXIT_FAILURE;
+    }
+
+    /* One after the other, so that a path doesn't get the other one's broadcasts */
+    {
+        ShmPath shm;
+        if (shm.open(argv[1]) < 0)
+            return EXIT_FAILURE;
+        run(shm, count, rate_hz);
+    }
+
+    {
+        UdpPath udp;
+        if (udp.open(port) < 0)
+            return EXIT_FAILURE;
+        run(udp, count, rate_hz);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "crc.h"
+
+/* Reflected 0x1021 polynomial */
+#define CRC16_MCRF4XX_POLY 0x8408
+
+/*
+ * _crc_table[k][b] is the CRC contribution of byte b followed by k zero
+ * bytes, which allows to fold 8 bytes at a time ("slicing-by-8")
+ */
+static uint16_t _crc_table[8][256];
+
+__attribute__((constructor)) static void crc16_mcrf4xx_init_tables(void)
+{
+    unsigned int i, k;
+
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i;
+
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC16_MCRF4XX_POLY : 0);
+
+        _crc_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            uint16_t prev = _crc_table[k - 1][i];
+            _crc_table[k][i] = (prev >> 8) ^ _crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+uint16_t crc16_mcrf4xx(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        crc ^= p[0] | (p[1] << 8);
+        crc = _crc_table[7][crc & 0xff] ^ _crc_table[6][crc >> 8]
+            ^ _crc_table[5][p[2]] ^ _crc_table[4][p[3]]
+            ^ _crc_table[3][p[4]] ^ _crc_table[2][p[5]]
+            ^ _crc_table[1][p[6]] ^ _crc_table[0][p[7]];
+    }
+
+    for (; len > 0; p++, len--)
+        crc = (crc >> 8) ^ _crc_table[0][(crc ^ *p) & 0xff];
+
+    return crc;
+}
@@ -0,0 +1,39 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CRC16_MCRF4XX_INIT 0xffff
+
+/*
+ * Accumulate @len bytes of @data on @crc, using the CRC-16/MCRF4XX algorithm
+ * MAVLink calls X.25. Same result as crc_accumulate() on each byte, but
+ * processing 8 bytes per step using lookup tables.
+ */
+uint16_t crc16_mcrf4xx(uint16_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
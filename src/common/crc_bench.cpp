@@ -0,0 +1,109 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput of crc16_mcrf4xx() compared to crc_calculate() plus
+ * crc_accumulate() from the generated MAVLink headers, on what
+ * _check_crc() checksums: the header and payload of a message, for a few
+ * message sizes.
+ *
+ * Run with: crc_bench [iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include <common/mavlink.h>
+
+#include "crc.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define N_BUFFERS 64
+
+/* Header without the magic byte, as checksummed by MAVLink 2 */
+#define HEADER_LEN 9
+
+static uint64_t now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+template<typename Func>
+static double ns_per_msg(const std::vector<uint8_t> &data, size_t len, unsigned iterations, Func crc)
+{
+    uint16_t sum = 0;
+    const uint64_t start = now_nsec();
+
+    for (unsigned i = 0; i < iterations; i++)
+        sum ^= crc(&data[(i % N_BUFFERS) * MAVLINK_MAX_PACKET_LEN], len);
+
+    const uint64_t elapsed = now_nsec() - start;
+
+    /* Keep the calls from being optimized out */
+    if (sum == 0x5a5a)
+        printf("\n");
+
+    return (double)elapsed / iterations;
+}
+
+static uint16_t reference_crc(const uint8_t *buf, size_t len)
+{
+    const uint8_t crc_extra = 50;
+    uint16_t crc = crc_calculate(buf, len);
+
+    crc_accumulate(crc_extra, &crc);
+    return crc;
+}
+
+static uint16_t table_crc(const uint8_t *buf, size_t len)
+{
+    const uint8_t crc_extra = 50;
+    uint16_t crc = crc16_mcrf4xx(CRC16_MCRF4XX_INIT, buf, len);
+
+    return crc16_mcrf4xx(crc, &crc_extra, 1);
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    /* HEARTBEAT, ATTITUDE, COMMAND_LONG, GPS_RAW_INT and a full payload */
+    const size_t payload_lens[] = {9, 28, 33, 52, 255};
+    std::vector<uint8_t> data(N_BUFFERS * MAVLINK_MAX_PACKET_LEN);
+
+    srand(1);
+    for (auto &b : data)
+        b = rand();
+
+    printf("payload  table ns/msg  bytewise ns/msg  speedup\n");
+
+    for (auto payload_len : payload_lens) {
+        const size_t len = HEADER_LEN + payload_len;
+        const double table_ns = ns_per_msg(data, len, iterations, table_crc);
+        const double bytewise_ns = ns_per_msg(data, len, iterations, reference_crc);
+
+        printf("%7zu  %12.1f  %15.1f  %6.1fx\n", payload_len, table_ns, bytewise_ns, bytewise_ns / table_ns);
+    }
+
+    return 0;
+}
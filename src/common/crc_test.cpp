@@ -0,0 +1,34 @@
+#include "crc.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+#include <common/mavlink.h>
+
+TEST(CrcTest, check_value) {
+    // Standard check value for CRC-16/MCRF4XX
+    EXPECT_EQ(0x6f91, crc16_mcrf4xx(CRC16_MCRF4XX_INIT, "123456789", 9));
+    EXPECT_EQ(CRC16_MCRF4XX_INIT, crc16_mcrf4xx(CRC16_MCRF4XX_INIT, "", 0));
+}
+
+TEST(CrcTest, same_as_mavlink) {
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+
+    srand(42);
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = rand();
+
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t len = 0; len + offset <= sizeof(buf); len++) {
+            uint16_t expected = crc_calculate(buf + offset, len);
+            crc_accumulate(len & 0xff, &expected);
+
+            uint16_t crc = crc16_mcrf4xx(CRC16_MCRF4XX_INIT, buf + offset, len);
+            uint8_t extra = len & 0xff;
+            crc = crc16_mcrf4xx(crc, &extra, 1);
+
+            ASSERT_EQ(expected, crc) << "offset " << offset << " len " << len;
+        }
+    }
+}
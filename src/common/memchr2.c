@@ -0,0 +1,101 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "memchr2.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+typedef const void *(*memchr2_func_t)(const void *s, int c1, int c2, size_t n);
+
+const void *memchr2_scalar(const void *s, int c1, int c2, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)s;
+    const uint8_t *end = p + n;
+
+    for (; p < end; p++) {
+        if (*p == (uint8_t)c1 || *p == (uint8_t)c2)
+            return p;
+    }
+
+    return NULL;
+}
+
+#if defined(__SSE2__)
+static const void *memchr2_sse2(const void *s, int c1, int c2, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)s;
+    const __m128i v1 = _mm_set1_epi8((char)c1);
+    const __m128i v2 = _mm_set1_epi8((char)c2);
+
+    for (; n >= 16; p += 16, n -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)));
+
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return memchr2_scalar(p, c1, c2, n);
+}
+
+__attribute__((target("avx2"))) static const void *memchr2_avx2(const void *s, int c1, int c2,
+                                                                 size_t n)
+{
+    const uint8_t *p = (const uint8_t *)s;
+    const __m256i v1 = _mm256_set1_epi8((char)c1);
+    const __m256i v2 = _mm256_set1_epi8((char)c2);
+
+    for (; n >= 32; p += 32, n -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, v1), _mm256_cmpeq_epi8(v, v2)));
+
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return memchr2_sse2(p, c1, c2, n);
+}
+#endif
+
+/* Scalar until resolved, in case another constructor runs before ours */
+static memchr2_func_t memchr2_impl = memchr2_scalar;
+
+/*
+ * Pick the best implementation when the program is loaded, before any
+ * thread may call memchr2(). This is not done with an ifunc since it's not
+ * supported by all libc implementations we build with.
+ */
+__attribute__((constructor)) static void memchr2_resolve(void)
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        memchr2_impl = memchr2_avx2;
+    else
+        memchr2_impl = memchr2_sse2;
+#endif
+}
+
+const void *memchr2(const void *s, int c1, int c2, size_t n)
+{
+    return memchr2_impl(s, c1, c2, n);
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Like memchr(), but look for the first occurrence of either @c1 or @c2 in
+ * the first @n bytes of @s. Uses SSE2 or AVX2 when the CPU supports them.
+ */
+const void *memchr2(const void *s, int c1, int c2, size_t n);
+
+/* Portable implementation, exported so it can be compared to the others */
+const void *memchr2_scalar(const void *s, int c1, int c2, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,44 @@
+#include "memchr2.h"
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+TEST(Memchr2Test, not_found) {
+    uint8_t buf[100] = {};
+
+    EXPECT_EQ(nullptr, memchr2(buf, 0xfd, 0xfe, sizeof(buf)));
+    EXPECT_EQ(nullptr, memchr2(buf, 0xfd, 0xfe, 0));
+}
+
+TEST(Memchr2Test, same_as_scalar) {
+    uint8_t buf[300];
+
+    srand(42);
+
+    for (int round = 0; round < 2000; round++) {
+        size_t offset = rand() % 40;
+        size_t len = rand() % (sizeof(buf) - offset);
+
+        // Sparse markers so they're found at every possible position
+        for (size_t i = 0; i < sizeof(buf); i++) {
+            int r = rand() % 256;
+            buf[i] = r == 0 ? 0xfd : r == 1 ? 0xfe : r % 0xfd;
+        }
+
+        EXPECT_EQ(memchr2_scalar(buf + offset, 0xfd, 0xfe, len),
+                  memchr2(buf + offset, 0xfd, 0xfe, len))
+            << "offset " << offset << " len " << len;
+    }
+}
+
+TEST(Memchr2Test, first_of_either) {
+    uint8_t buf[64] = {};
+
+    buf[40] = 0xfe;
+    buf[50] = 0xfd;
+    EXPECT_EQ(buf + 40, memchr2(buf, 0xfd, 0xfe, sizeof(buf)));
+    EXPECT_EQ(buf + 50, memchr2(buf + 41, 0xfd, 0xfe, sizeof(buf) - 41));
+    EXPECT_EQ(nullptr, memchr2(buf, 0xfd, 0xfe, 40));
+}
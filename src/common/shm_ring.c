@@ -0,0 +1,180 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Length of the record that tells the rest of the ring is unused */
+#define SHM_RECORD_WRAP UINT32_MAX
+
+#define SHM_RECORD_HDR_LEN ((uint32_t)sizeof(uint32_t))
+
+static uint32_t record_size(uint32_t len)
+{
+    return SHM_RECORD_HDR_LEN + ((len + 3) & ~3U);
+}
+
+static uint32_t load_record_len(const uint8_t *p)
+{
+    uint32_t len;
+
+    memcpy(&len, p, sizeof(len));
+    return len;
+}
+
+static void store_record_len(uint8_t *p, uint32_t len)
+{
+    memcpy(p, &len, sizeof(len));
+}
+
+bool shm_ring_size_valid(uint32_t ring_size)
+{
+    return ring_size >= SHM_RING_MIN_SIZE && ring_size <= SHM_RING_MAX_SIZE
+        && (ring_size & (ring_size - 1)) == 0;
+}
+
+size_t shm_region_size(uint32_t ring_size)
+{
+    return sizeof(struct shm_header) + 2 * (sizeof(struct shm_ring_ctrl) + ring_size);
+}
+
+void shm_region_init(void *region, uint32_t ring_size)
+{
+    struct shm_header *hdr = (struct shm_header *)region;
+
+    memset(region, 0, shm_region_size(ring_size));
+    hdr->magic = SHM_MAGIC;
+    hdr->version = SHM_VERSION;
+    hdr->ring_size = ring_size;
+}
+
+void shm_ring_attach(struct shm_ring *ring, void *region, uint32_t ring_size,
+                     enum shm_ring_dir dir, bool producer)
+{
+    uint8_t *p = (uint8_t *)region + sizeof(struct shm_header)
+        + dir * (sizeof(struct shm_ring_ctrl) + ring_size);
+
+    ring->ctrl = (struct shm_ring_ctrl *)p;
+    ring->data = p + sizeof(struct shm_ring_ctrl);
+    ring->size = ring_size;
+    ring->pending = 0;
+
+    if (producer)
+        ring->pos = __atomic_load_n(&ring->ctrl->tail, __ATOMIC_RELAXED);
+    else
+        ring->pos = __atomic_load_n(&ring->ctrl->head, __ATOMIC_RELAXED);
+}
+
+int shm_ring_push(struct shm_ring *ring, const void *data, size_t len)
+{
+    const uint32_t head = __atomic_load_n(&ring->ctrl->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->pos;
+    uint32_t used = tail - head;
+    uint32_t off = tail & (ring->size - 1);
+    uint32_t need, wrap = 0;
+
+    if (len > SHM_RECORD_MAX)
+        return -EMSGSIZE;
+    if (used > ring->size)
+        return -EBADMSG;
+
+    /* Records are contiguous: skip the end of the ring if it's too short */
+    need = record_size(len);
+    if (ring->size - off < need)
+        wrap = ring->size - off;
+
+    if (ring->size - used < need + wrap)
+        return -ENOBUFS;
+
+    if (wrap) {
+        store_record_len(ring->data + off, SHM_RECORD_WRAP);
+        tail += wrap;
+        off = 0;
+    }
+
+    memcpy(ring->data + off + SHM_RECORD_HDR_LEN, data, len);
+    store_record_len(ring->data + off, len);
+    tail += need;
+
+    ring->pos = tail;
+    __atomic_store_n(&ring->ctrl->tail, tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+bool shm_ring_needs_wakeup(struct shm_ring *ring)
+{
+    /* Pairs with the one in shm_ring_arm(): either we see the flag or it sees our tail */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->ctrl->need_wakeup, __ATOMIC_RELAXED);
+}
+
+int shm_ring_peek(struct shm_ring *ring, const uint8_t **data, size_t *len)
+{
+    const uint32_t tail = __atomic_load_n(&ring->ctrl->tail, __ATOMIC_ACQUIRE);
+    uint32_t used = tail - ring->pos;
+    uint32_t off = ring->pos & (ring->size - 1);
+    uint32_t skip = 0, rec_len;
+
+    if (used == 0)
+        return 0;
+    if (used > ring->size)
+        return -EBADMSG;
+
+    rec_len = load_record_len(ring->data + off);
+    if (rec_len == SHM_RECORD_WRAP) {
+        skip = ring->size - off;
+        if (skip >= used)
+            return -EBADMSG;
+        used -= skip;
+        off = 0;
+        rec_len = load_record_len(ring->data);
+    }
+
+    /* Read once: the producer may still change it */
+    if (rec_len > SHM_RECORD_MAX || record_size(rec_len) > used
+        || record_size(rec_len) > ring->size - off)
+        return -EBADMSG;
+
+    *data = ring->data + off + SHM_RECORD_HDR_LEN;
+    *len = rec_len;
+    ring->pending = skip + record_size(rec_len);
+
+    return 1;
+}
+
+void shm_ring_consume(struct shm_ring *ring)
+{
+    ring->pos += ring->pending;
+    ring->pending = 0;
+    __atomic_store_n(&ring->ctrl->head, ring->pos, __ATOMIC_RELEASE);
+}
+
+bool shm_ring_arm(struct shm_ring *ring)
+{
+    __atomic_store_n(&ring->ctrl->need_wakeup, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&ring->ctrl->tail, __ATOMIC_RELAXED) == ring->pos;
+}
+
+void shm_ring_disarm(struct shm_ring *ring)
+{
+    __atomic_store_n(&ring->ctrl->need_wakeup, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Shared memory between the router and a client of a ShmEndpoint: a header
+ * followed by two single-producer single-consumer rings of records, one per
+ * direction. Each record holds one or more whole MAVLink messages.
+ *
+ * Rings carry no syscall by themselves: a consumer about to sleep sets
+ * need_wakeup and the producer then rings the consumer's doorbell (an
+ * eventfd) after pushing. While both sides keep up, no doorbell rings.
+ *
+ * Neither side trusts the indexes written by the other one, which may be
+ * garbage: each keeps its own and checks the other's before using it.
+ */
+
+#define SHM_MAGIC 0x4d4c4b53 /* MLKS */
+#define SHM_VERSION 1
+
+#define SHM_CACHELINE 64
+
+/* Largest record */
+#define SHM_RECORD_MAX 4096
+
+/* Ring sizes are powers of 2, the smallest one holding at least 4 of the largest records */
+#define SHM_RING_MIN_SIZE (32 * 1024)
+#define SHM_RING_DEFAULT_SIZE (64 * 1024)
+#define SHM_RING_MAX_SIZE (16 * 1024 * 1024)
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint8_t _pad[SHM_CACHELINE - 3 * sizeof(uint32_t)];
+};
+
+/* Control block of a ring, followed by its ring_size bytes of records */
+struct shm_ring_ctrl {
+    /* Written by the consumer */
+    uint32_t head;
+    uint32_t need_wakeup;
+    uint8_t _pad0[SHM_CACHELINE - 2 * sizeof(uint32_t)];
+    /* Written by the producer */
+    uint32_t tail;
+    uint8_t _pad1[SHM_CACHELINE - sizeof(uint32_t)];
+};
+
+enum shm_ring_dir {
+    SHM_TO_CLIENT,
+    SHM_TO_ROUTER,
+};
+
+/* One side's view of a ring */
+struct shm_ring {
+    struct shm_ring_ctrl *ctrl;
+    uint8_t *data;
+    uint32_t size;
+    /* Our own copy of tail if producer, of head if consumer */
+    uint32_t pos;
+    /* Bytes that shm_ring_consume() moves head by */
+    uint32_t pending;
+};
+
+/* Size of the region for rings of @ring_size bytes, a power of 2 */
+size_t shm_region_size(uint32_t ring_size);
+bool shm_ring_size_valid(uint32_t ring_size);
+
+void shm_region_init(void *region, uint32_t ring_size);
+
+/*
+ * Set up @ring to access the ring of @region going in @dir. @ring_size must
+ * be the one the region was created with, not the one in its header.
+ */
+void shm_ring_attach(struct shm_ring *ring, void *region, uint32_t ring_size,
+                     enum shm_ring_dir dir, bool producer);
+
+/*
+ * Producer side. Returns 0, -EMSGSIZE if @len is over SHM_RECORD_MAX,
+ * -ENOBUFS if the ring is full or -EBADMSG if the consumer's index is bogus.
+ */
+int shm_ring_push(struct shm_ring *ring, const void *data, size_t len);
+
+/* Producer side, after pushing: whether the consumer's doorbell must ring */
+bool shm_ring_needs_wakeup(struct shm_ring *ring);
+
+/*
+ * Consumer side. Point @data to the oldest record, left in place until
+ * shm_ring_consume(). Returns 1, 0 if the ring is empty or -EBADMSG if the
+ * producer wrote garbage.
+ */
+int shm_ring_peek(struct shm_ring *ring, const uint8_t **data, size_t *len);
+void shm_ring_consume(struct shm_ring *ring);
+
+/*
+ * Consumer side, before sleeping: ask for doorbells. Returns false if the
+ * ring isn't empty anymore, in which case there's no need to sleep.
+ */
+bool shm_ring_arm(struct shm_ring *ring);
+
+/* Consumer side: no doorbell needed while reading anyway */
+void shm_ring_disarm(struct shm_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
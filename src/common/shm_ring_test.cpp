@@ -0,0 +1,142 @@
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+struct Region {
+    explicit Region(uint32_t ring_size)
+        : mem(shm_region_size(ring_size))
+    {
+        shm_region_init(mem.data(), ring_size);
+        shm_ring_attach(&producer, mem.data(), ring_size, SHM_TO_ROUTER, true);
+        shm_ring_attach(&consumer, mem.data(), ring_size, SHM_TO_ROUTER, false);
+    }
+
+    std::vector<uint64_t> mem;
+    struct shm_ring producer;
+    struct shm_ring consumer;
+};
+
+TEST(ShmRingTest, order_and_full) {
+    Region region{SHM_RING_MIN_SIZE};
+    uint8_t buf[SHM_RECORD_MAX] = {};
+    const uint8_t *data;
+    size_t len;
+    unsigned n = 0;
+
+    EXPECT_EQ(shm_ring_peek(&region.consumer, &data, &len), 0);
+
+    // 279 bytes take 284 in the ring, with the length
+    for (; shm_ring_push(&region.producer, buf, 279) == 0; n++)
+        buf[0]++;
+    EXPECT_EQ(n, SHM_RING_MIN_SIZE / 284);
+    EXPECT_EQ(shm_ring_push(&region.producer, buf, 279), -ENOBUFS);
+    EXPECT_EQ(shm_ring_push(&region.producer, buf, SHM_RECORD_MAX + 1), -EMSGSIZE);
+
+    for (unsigned i = 0; i < n; i++) {
+        ASSERT_EQ(shm_ring_peek(&region.consumer, &data, &len), 1);
+        EXPECT_EQ(len, 279U);
+        EXPECT_EQ(data[0], (uint8_t)i);
+        shm_ring_consume(&region.consumer);
+    }
+    EXPECT_EQ(shm_ring_peek(&region.consumer, &data, &len), 0);
+}
+
+TEST(ShmRingTest, wrap) {
+    Region region{SHM_RING_MIN_SIZE};
+    uint8_t buf[SHM_RECORD_MAX];
+    const uint8_t *data;
+    size_t len;
+
+    // Records never span the end of the ring
+    for (unsigned i = 0; i < 100; i++) {
+        const size_t n = 1 + (i * 997) % SHM_RECORD_MAX;
+
+        memset(buf, i, n);
+        ASSERT_EQ(shm_ring_push(&region.producer, buf, n), 0);
+        ASSERT_EQ(shm_ring_peek(&region.consumer, &data, &len), 1);
+        ASSERT_EQ(len, n);
+        ASSERT_LE(data + len, region.consumer.data + SHM_RING_MIN_SIZE);
+        EXPECT_EQ(data[0], (uint8_t)i);
+        EXPECT_EQ(data[n - 1], (uint8_t)i);
+        shm_ring_consume(&region.consumer);
+    }
+}
+
+TEST(ShmRingTest, wakeup) {
+    Region region{SHM_RING_MIN_SIZE};
+    const uint8_t *data;
+    size_t len;
+
+    ASSERT_EQ(shm_ring_push(&region.producer, "a", 1), 0);
+    EXPECT_FALSE(shm_ring_needs_wakeup(&region.producer));
+
+    // Not empty: no need to sleep
+    EXPECT_FALSE(shm_ring_arm(&region.consumer));
+    ASSERT_EQ(shm_ring_peek(&region.consumer, &data, &len), 1);
+    shm_ring_consume(&region.consumer);
+
+    EXPECT_TRUE(shm_ring_arm(&region.consumer));
+    ASSERT_EQ(shm_ring_push(&region.producer, "b", 1), 0);
+    EXPECT_TRUE(shm_ring_needs_wakeup(&region.producer));
+
+    shm_ring_disarm(&region.consumer);
+    EXPECT_FALSE(shm_ring_needs_wakeup(&region.producer));
+}
+
+TEST(ShmRingTest, bogus_indexes) {
+    Region region{SHM_RING_MIN_SIZE};
+    const uint8_t *data;
+    size_t len;
+
+    region.consumer.ctrl->tail = SHM_RING_MIN_SIZE + 4;
+    EXPECT_EQ(shm_ring_peek(&region.consumer, &data, &len), -EBADMSG);
+
+    // Record longer than what was pushed
+    region.consumer.ctrl->tail = 8;
+    region.consumer.data[0] = 100;
+    EXPECT_EQ(shm_ring_peek(&region.consumer, &data, &len), -EBADMSG);
+
+    region.producer.ctrl->head = 100;
+    EXPECT_EQ(shm_ring_push(&region.producer, "a", 1), -EBADMSG);
+}
+
+TEST(ShmRingTest, threads) {
+    Region region{SHM_RING_MIN_SIZE};
+    const uint32_t n = 200000;
+
+    std::thread producer([&] {
+        for (uint32_t i = 0; i < n;) {
+            uint32_t rec[8];
+
+            for (unsigned j = 0; j < 8; j++)
+                rec[j] = i;
+
+            if (shm_ring_push(&region.producer, rec, 4 * (1 + i % 8)) == 0)
+                i++;
+        }
+    });
+
+    for (uint32_t i = 0; i < n;) {
+        const uint8_t *data;
+        size_t len;
+        uint32_t v;
+
+        int r = shm_ring_peek(&region.consumer, &data, &len);
+        ASSERT_GE(r, 0);
+        if (r == 0)
+            continue;
+
+        ASSERT_EQ(len, 4 * (1 + i % 8));
+        memcpy(&v, data + len - 4, sizeof(v));
+        ASSERT_EQ(v, i);
+        shm_ring_consume(&region.consumer);
+        i++;
+    }
+
+    producer.join();
+}
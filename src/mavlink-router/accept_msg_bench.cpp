@@ -0,0 +1,203 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Cost of Endpoint::accept_msg() with 1, 50 and 250 known components,
+ * compared to the linear scan of a vector of sys_comp_ids it replaced.
+ *
+ * Run with: accept_msg_bench [iterations]
+ */
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "endpoint.h"
+
+#define DEFAULT_ITERATIONS 200
+#define N_MSGS 4096
+
+struct Msg {
+    int target_sysid;
+    int target_compid;
+    uint8_t src_sysid;
+    uint8_t src_compid;
+};
+
+class BenchEndpoint : public Endpoint {
+public:
+    BenchEndpoint()
+        : Endpoint{"Bench"}
+    {
+    }
+
+    int write_msg(const struct buffer *pbuf) override { return 0; }
+    int flush_pending_msgs() override { return 0; }
+
+    void add_sys_comp_id(uint16_t sys_comp_id) { _add_sys_comp_id(sys_comp_id); }
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
+};
+
+/* What has_sys_comp_id() and has_sys_id() used to do */
+class VectorSysCompIds {
+public:
+    void add(uint16_t sys_comp_id)
+    {
+        if (!has_sys_comp_id(sys_comp_id))
+            _ids.push_back(sys_comp_id);
+    }
+
+    bool has_sys_id(unsigned sysid) const
+    {
+        for (auto id : _ids) {
+            if ((id >> 8) == (sysid & 0xff))
+                return true;
+        }
+        return false;
+    }
+
+    bool has_sys_comp_id(unsigned sys_comp_id) const
+    {
+        return std::find(_ids.begin(), _ids.end(), sys_comp_id) != _ids.end();
+    }
+
+    /* Not inlined, as Endpoint::accept_msg() isn't either */
+    __attribute__((noinline)) bool accept_msg(int target_sysid, int target_compid, uint8_t src_sysid,
+                                              uint8_t src_compid) const
+    {
+        if (has_sys_comp_id(src_sysid << 8 | src_compid))
+            return false;
+        if (target_sysid == 0 || target_sysid == -1)
+            return true;
+        if (target_compid > 0 && has_sys_comp_id((target_sysid & 0xff) << 8 | (target_compid & 0xff)))
+            return true;
+        if ((target_compid == 0 || target_compid == -1) && has_sys_id(target_sysid))
+            return true;
+        return false;
+    }
+
+private:
+    std::vector<uint16_t> _ids;
+};
+
+static uint64_t now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Components are spread over sysids 10 at a time, as a GCS plus a few
+ * vehicles with onboard components would be.
+ */
+static uint16_t component(unsigned i)
+{
+    return (uint16_t)((1 + i / 10) << 8 | (1 + i % 10));
+}
+
+/*
+ * Messages come from components the endpoint doesn't know (it is not their
+ * source) and are a mix of broadcasts, messages to a known component, to
+ * a known sysid and to a component that is elsewhere.
+ */
+static std::vector<Msg> make_msgs(unsigned n_components)
+{
+    std::vector<Msg> msgs;
+
+    srand(1);
+    for (unsigned i = 0; i < N_MSGS; i++) {
+        const uint16_t known = component(rand() % n_components);
+        Msg m = {0, 0, 200, (uint8_t)(1 + rand() % 10)};
+
+        switch (rand() % 4) {
+        case 0:
+            break;
+        case 1:
+            m.target_sysid = known >> 8;
+            m.target_compid = known & 0xff;
+            break;
+        case 2:
+            m.target_sysid = known >> 8;
+            break;
+        default:
+            m.target_sysid = 150;
+            m.target_compid = 1;
+            break;
+        }
+        msgs.push_back(m);
+    }
+
+    return msgs;
+}
+
+template<typename Func>
+static double run(const std::vector<Msg> &msgs, unsigned iterations, Func accept)
+{
+    unsigned accepted = 0;
+    const uint64_t start = now_nsec();
+
+    for (unsigned i = 0; i < iterations; i++) {
+        for (const auto &m : msgs)
+            accepted += accept(m);
+    }
+
+    const uint64_t elapsed = now_nsec() - start;
+
+    /* Keep the calls from being optimized out */
+    if (accepted == UINT32_MAX)
+        printf("\n");
+
+    return (double)elapsed / ((double)iterations * msgs.size());
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    const unsigned n_components[] = {1, 50, 250};
+
+    printf("components  bitmap ns/msg  vector ns/msg\n");
+
+    for (auto n : n_components) {
+        BenchEndpoint endpoint;
+        VectorSysCompIds vector;
+
+        for (unsigned i = 0; i < n; i++) {
+            endpoint.add_sys_comp_id(component(i));
+            vector.add(component(i));
+        }
+
+        const auto msgs = make_msgs(n);
+        const double bitmap_ns = run(msgs, iterations, [&](const Msg &m) {
+            return endpoint.accept_msg(m.target_sysid, m.target_compid, m.src_sysid, m.src_compid, 0);
+        });
+        const double vector_ns = run(msgs, iterations, [&](const Msg &m) {
+            return vector.accept_msg(m.target_sysid, m.target_compid, m.src_sysid, m.src_compid);
+        });
+
+        printf("%10u  %13.1f  %13.1f\n", n, bitmap_ns, vector_ns);
+    }
+
+    return 0;
+}
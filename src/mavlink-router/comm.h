@@ -24,7 +24,11 @@
 
 #include <common/macro.h>
 
+class Packet;
+
 struct buffer {
     unsigned int len;
     uint8_t *data;
+    /* Copy of data kept by endpoints that queued it, see Packet::get() */
+    mutable Packet *pkt;
 };
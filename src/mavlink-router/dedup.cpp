@@ -0,0 +1,80 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "dedup.h"
+
+#include <common/mavlink.h>
+
+/* Never part of a key, so empty slots don't match anything */
+#define KEY_VALID (1ULL << 63)
+
+/* Sequence number, message id and checksum of @frame, in 48 bits */
+static uint64_t fingerprint(const struct buffer *frame, uint32_t msg_id)
+{
+    const bool mavlink2 = frame->data[0] == MAVLINK_STX;
+    /* Checksum follows the header and payload */
+    const unsigned crc_offset = (mavlink2 ? 10 : 6) + frame->data[1];
+    const uint8_t seq = frame->data[mavlink2 ? 4 : 2];
+    const uint16_t crc = frame->data[crc_offset] | frame->data[crc_offset + 1] << 8;
+
+    return (uint64_t)seq << 40 | (uint64_t)(msg_id & 0xffffff) << 16 | crc;
+}
+
+bool DedupGroup::seen(const struct buffer *frame, uint8_t sysid, uint8_t compid, uint32_t msg_id)
+{
+    const uint64_t key = KEY_VALID | fingerprint(frame, msg_id);
+    Window &window = _senders[sysid << 8 | compid];
+
+    for (uint64_t k : window.keys) {
+        if (k == key)
+            return true;
+    }
+
+    window.keys[window.next] = key;
+    window.next = (window.next + 1) % DEDUP_WINDOW;
+
+    return false;
+}
+
+bool LoopCache::seen(const struct buffer *frame, uint8_t sysid, uint8_t compid, uint32_t msg_id,
+                     usec_t now)
+{
+    const uint64_t key = (uint64_t)(sysid << 8 | compid) << 48 | fingerprint(frame, msg_id);
+
+    if (_threaded) {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _check(key, now);
+    }
+
+    return _check(key, now);
+}
+
+bool LoopCache::_check(uint64_t key, usec_t now)
+{
+    /* Copies don't extend the window: it starts when the first one is routed */
+    while (!_expiry.empty() && _expiry.front().second + _window_usec <= now) {
+        _seen.erase(_expiry.front().first);
+        _expiry.pop_front();
+    }
+
+    if (!_seen.insert(key).second)
+        return true;
+
+    _expiry.emplace_back(key, now);
+
+    return false;
+}
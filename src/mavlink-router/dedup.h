@@ -0,0 +1,105 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <common/util.h>
+
+#include <stdint.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "comm.h"
+
+/* Messages remembered per sender */
+#define DEDUP_WINDOW 32
+
+/*
+ * Endpoints receiving the same messages over redundant links, like several
+ * radios to the same vehicle: only the first copy of each message is routed.
+ *
+ * A message is identified by its sender (sysid/compid), sequence number,
+ * message id and checksum. The last DEDUP_WINDOW messages of each sender are
+ * remembered, which is plenty for copies arriving a bit later on a slower
+ * link while staying far from the sequence number wrapping around.
+ */
+class DedupGroup {
+public:
+    DedupGroup(const char *name)
+        : _name{name}
+    {
+    }
+
+    const char *name() const { return _name.c_str(); }
+
+    /*
+     * Return true if @frame, a complete message, was already seen from any
+     * endpoint of the group, otherwise remember it
+     */
+    bool seen(const struct buffer *frame, uint8_t sysid, uint8_t compid, uint32_t msg_id);
+
+private:
+    struct Window {
+        uint64_t keys[DEDUP_WINDOW] = {};
+        unsigned next = 0;
+    };
+
+    std::string _name;
+    /* By sysid << 8 | compid */
+    std::unordered_map<uint16_t, Window> _senders;
+};
+
+/*
+ * Messages routed recently by any endpoint, to drop those coming back through
+ * a loop of routers connected to each other.
+ *
+ * Messages are identified like in DedupGroup and remembered for a given time
+ * rather than a given count, as loops take longer than redundant links. The
+ * cache is shared by all threads and only locked once set_threaded() is
+ * called.
+ */
+class LoopCache {
+public:
+    LoopCache(usec_t window_usec)
+        : _window_usec{window_usec}
+    {
+    }
+
+    /*
+     * Return true if @frame, a complete message, was seen less than the
+     * window ago, otherwise remember it
+     */
+    bool seen(const struct buffer *frame, uint8_t sysid, uint8_t compid, uint32_t msg_id,
+              usec_t now);
+
+    void set_threaded(bool threaded) { _threaded = threaded; }
+
+private:
+    bool _check(uint64_t key, usec_t now);
+
+    usec_t _window_usec;
+    bool _threaded = false;
+    std::mutex _lock;
+    std::unordered_set<uint64_t> _seen;
+    /* Same messages, in the order they were seen */
+    std::deque<std::pair<uint64_t, usec_t>> _expiry;
+};
@@ -0,0 +1,69 @@
+#include "dedup.h"
+
+#include <common/mavlink.h>
+#include <gtest/gtest.h>
+
+/* Whether a MAVLink 2 HEARTBEAT from @sysid/1 with @seq and @crc was seen */
+static bool seen(DedupGroup &group, uint8_t seq, uint16_t crc = 0x1234, uint8_t sysid = 1)
+{
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX, 9};
+    struct buffer buf = {21, data, nullptr};
+
+    data[4] = seq;
+    data[5] = sysid;
+    data[6] = 1;
+    data[19] = crc & 0xff;
+    data[20] = crc >> 8;
+
+    return group.seen(&buf, sysid, 1, 0);
+}
+
+TEST(DedupGroupTest, first_copy) {
+    DedupGroup group{"radios"};
+
+    EXPECT_STREQ(group.name(), "radios");
+
+    EXPECT_FALSE(seen(group, 10));
+    EXPECT_TRUE(seen(group, 10));
+    EXPECT_TRUE(seen(group, 10));
+    EXPECT_FALSE(seen(group, 11));
+
+    // Same sequence number, different content
+    EXPECT_FALSE(seen(group, 10, 0x4321));
+
+    // Other sender
+    EXPECT_FALSE(seen(group, 10, 0x1234, 2));
+    EXPECT_TRUE(seen(group, 10, 0x1234, 2));
+}
+
+TEST(DedupGroupTest, window) {
+    DedupGroup group{"radios"};
+
+    for (unsigned seq = 0; seq < DEDUP_WINDOW; seq++)
+        EXPECT_FALSE(seen(group, seq));
+    EXPECT_TRUE(seen(group, 0));
+
+    // Sequence numbers wrapping around are new messages once out of the window
+    EXPECT_FALSE(seen(group, DEDUP_WINDOW));
+    EXPECT_FALSE(seen(group, 0));
+}
+
+TEST(LoopCacheTest, window) {
+    LoopCache cache{500 * USEC_PER_MSEC};
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX, 9};
+    struct buffer buf = {21, data, nullptr};
+    const usec_t t0 = 100 * USEC_PER_SEC;
+
+    data[4] = 10;
+    EXPECT_FALSE(cache.seen(&buf, 1, 1, 0, t0));
+    EXPECT_TRUE(cache.seen(&buf, 1, 1, 0, t0 + 100 * USEC_PER_MSEC));
+    EXPECT_FALSE(cache.seen(&buf, 2, 1, 0, t0 + 100 * USEC_PER_MSEC));
+
+    // Copies don't extend the window
+    EXPECT_TRUE(cache.seen(&buf, 1, 1, 0, t0 + 499 * USEC_PER_MSEC));
+    EXPECT_FALSE(cache.seen(&buf, 1, 1, 0, t0 + 500 * USEC_PER_MSEC));
+    EXPECT_TRUE(cache.seen(&buf, 2, 1, 0, t0 + 500 * USEC_PER_MSEC));
+
+    data[4] = 11;
+    EXPECT_FALSE(cache.seen(&buf, 1, 1, 0, t0 + 500 * USEC_PER_MSEC));
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "egress.h"
+
+#include <algorithm>
+
+#define RANK_LEVEL_SHIFT 62
+#define RANK_TAG_MASK ((UINT64_C(1) << RANK_LEVEL_SHIFT) - 1)
+/* Level shared by the weighted classes */
+#define RANK_LEVEL_WEIGHTED UINT64_C(2)
+
+/* Virtual time a byte takes with a weight of 1 */
+#define VTIME_PER_BYTE 1024
+
+void EgressScheduler::set_class(uint32_t msg_id, enum egress_class egress_class)
+{
+    auto it = std::lower_bound(_classes.begin(), _classes.end(),
+                               std::make_pair(msg_id, EgressControl));
+
+    if (it != _classes.end() && it->first == msg_id)
+        it->second = egress_class;
+    else
+        _classes.insert(it, {msg_id, egress_class});
+}
+
+void EgressScheduler::set_coalesced(uint32_t msg_id)
+{
+    auto it = std::lower_bound(_coalesced.begin(), _coalesced.end(), msg_id);
+
+    if (it == _coalesced.end() || *it != msg_id)
+        _coalesced.insert(it, msg_id);
+}
+
+enum egress_class EgressScheduler::classify(uint32_t msg_id) const
+{
+    auto it = std::lower_bound(_classes.begin(), _classes.end(),
+                               std::make_pair(msg_id, EgressControl));
+
+    if (it != _classes.end() && it->first == msg_id)
+        return it->second;
+
+    return EgressTelemetry;
+}
+
+uint64_t EgressScheduler::rank(const Packet *pkt, const TxQueue &queue)
+{
+    const enum egress_class egress_class = classify(pkt->msg_id());
+    uint64_t start;
+
+    if (queue.empty()) {
+        /* Nothing is owed to anyone anymore: start over */
+        _seq = 0;
+        _vtime = 0;
+        std::fill(std::begin(_finish), std::end(_finish), 0);
+    } else if (queue.front_rank() >> RANK_LEVEL_SHIFT == RANK_LEVEL_WEIGHTED) {
+        _vtime = std::max(_vtime, queue.front_rank() & RANK_TAG_MASK);
+    }
+
+    if (egress_class < EgressTelemetry)
+        return (uint64_t)egress_class << RANK_LEVEL_SHIFT | ++_seq;
+
+    start = std::max(_vtime, _finish[egress_class]);
+    _finish[egress_class] = start + (uint64_t)pkt->len * VTIME_PER_BYTE / _weights[egress_class];
+
+    return RANK_LEVEL_WEIGHTED << RANK_LEVEL_SHIFT | _finish[egress_class];
+}
@@ -0,0 +1,99 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "packet.h"
+#include "txqueue.h"
+
+/*
+ * Egress classes, from the most urgent. Control and heartbeat messages have
+ * strict priority over everything else, while telemetry and bulk messages
+ * share what's left of the link according to their weights.
+ */
+enum egress_class {
+    EgressControl,
+    EgressHeartbeat,
+    EgressTelemetry,
+    EgressBulk,
+    EGRESS_CLASS_MAX,
+};
+
+#define EGRESS_DEFAULT_TELEMETRY_WEIGHT 4
+#define EGRESS_DEFAULT_BULK_WEIGHT 1
+
+/*
+ * Order in which an endpoint's queued messages are written when the link is
+ * saturated.
+ *
+ * Each message gets a rank and the transmit queue is kept sorted by it (see
+ * TxQueue::push()). The priority level is in the 2 most significant bits:
+ * control, heartbeat, then both weighted classes. Below that, strict classes
+ * use an increasing sequence number, so they stay in order, and weighted
+ * classes use self-clocked fair queueing: a message is tagged with the
+ * virtual time at which its class would be done sending it if it had its
+ * share of the link, starting from the tag of the message being sent.
+ *
+ * Messages not assigned to a class are telemetry. An endpoint without any
+ * assigned class keeps its messages in arrival order.
+ *
+ * Messages that only carry the latest state of something can also be
+ * coalesced: a new one replaces the one from the same sender still waiting
+ * in the queue, which then never holds stale samples.
+ */
+class EgressScheduler {
+public:
+    void set_class(uint32_t msg_id, enum egress_class egress_class);
+    void set_weight(enum egress_class egress_class, unsigned weight)
+    {
+        _weights[egress_class] = weight;
+    }
+
+    bool enabled() const { return !_classes.empty(); }
+
+    enum egress_class classify(uint32_t msg_id) const;
+
+    void set_coalesced(uint32_t msg_id);
+    bool coalescing() const { return !_coalesced.empty(); }
+    bool is_coalesced(uint32_t msg_id) const
+    {
+        return std::binary_search(_coalesced.begin(), _coalesced.end(), msg_id);
+    }
+
+    /*
+     * Rank of @pkt, about to be added to @queue
+     */
+    uint64_t rank(const Packet *pkt, const TxQueue &queue);
+
+private:
+    /* Sorted by message id */
+    std::vector<std::pair<uint32_t, enum egress_class>> _classes;
+    /* Sorted */
+    std::vector<uint32_t> _coalesced;
+    unsigned _weights[EGRESS_CLASS_MAX] = {0, 0, EGRESS_DEFAULT_TELEMETRY_WEIGHT,
+                                           EGRESS_DEFAULT_BULK_WEIGHT};
+
+    uint64_t _seq = 0;
+    uint64_t _vtime = 0;
+    uint64_t _finish[EGRESS_CLASS_MAX] = {};
+};
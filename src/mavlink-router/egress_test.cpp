@@ -0,0 +1,176 @@
+#include "egress.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+/* Queue a MAVLink 2 message of @len bytes, tagged with @tag in its payload */
+static bool push(TxQueue &q, EgressScheduler &egress, uint32_t msg_id, char tag,
+                 unsigned len = 20, unsigned offset = 0)
+{
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX};
+    struct buffer buf = {len, data, nullptr};
+
+    data[7] = msg_id & 0xff;
+    data[8] = (msg_id >> 8) & 0xff;
+    data[9] = (msg_id >> 16) & 0xff;
+    data[10] = tag;
+
+    Packet *pkt = Packet::get(&buf);
+    bool r = q.push(pkt, offset, egress.rank(pkt, q));
+
+    Packet::release(&buf);
+
+    return r;
+}
+
+/* Tags of the messages in the order they would be written */
+static std::string order(TxQueue &q)
+{
+    std::string s;
+
+    while (!q.empty()) {
+        struct iovec iov;
+
+        s += (char)q.front()->data[10];
+        q.fill_iovec(&iov, 1);
+        q.consume(iov.iov_len);
+    }
+
+    return s;
+}
+
+TEST(EgressSchedulerTest, classify) {
+    EgressScheduler egress;
+
+    EXPECT_FALSE(egress.enabled());
+    EXPECT_EQ(egress.classify(0), EgressTelemetry);
+
+    egress.set_class(76, EgressControl);
+    egress.set_class(0, EgressHeartbeat);
+    egress.set_class(22, EgressBulk);
+    egress.set_class(12920, EgressBulk);
+    egress.set_class(22, EgressControl);
+
+    EXPECT_TRUE(egress.enabled());
+    EXPECT_EQ(egress.classify(76), EgressControl);
+    EXPECT_EQ(egress.classify(0), EgressHeartbeat);
+    EXPECT_EQ(egress.classify(22), EgressControl);
+    EXPECT_EQ(egress.classify(12920), EgressBulk);
+    EXPECT_EQ(egress.classify(30), EgressTelemetry);
+}
+
+TEST(EgressSchedulerTest, strict_priority) {
+    EgressScheduler egress;
+    TxQueue q{16, 4096};
+
+    egress.set_class(76, EgressControl);
+    egress.set_class(0, EgressHeartbeat);
+    egress.set_class(22, EgressBulk);
+
+    EXPECT_TRUE(push(q, egress, 30, 't'));
+    EXPECT_TRUE(push(q, egress, 22, 'b'));
+    EXPECT_TRUE(push(q, egress, 0, 'h'));
+    EXPECT_TRUE(push(q, egress, 76, 'c'));
+    EXPECT_TRUE(push(q, egress, 0, 'H'));
+    EXPECT_TRUE(push(q, egress, 76, 'C'));
+
+    EXPECT_EQ(order(q), "cChHtb");
+
+    // A partially written message stays first
+    EXPECT_TRUE(push(q, egress, 22, 'b', 20, 5));
+    EXPECT_TRUE(push(q, egress, 76, 'c'));
+    EXPECT_EQ(q.bytes(), 35U);
+    EXPECT_EQ(order(q), "bc");
+}
+
+TEST(EgressSchedulerTest, weighted) {
+    EgressScheduler egress;
+    TxQueue q{64, 4096};
+    std::string s;
+
+    egress.set_class(22, EgressBulk);
+    egress.set_weight(EgressTelemetry, 3);
+    egress.set_weight(EgressBulk, 1);
+
+    // Bulk messages were there first, telemetry still gets 3/4 of the link
+    // once the one being written is done
+    for (int i = 0; i < 20; i++)
+        EXPECT_TRUE(push(q, egress, 22, 'b'));
+    for (int i = 0; i < 20; i++)
+        EXPECT_TRUE(push(q, egress, 30, 't'));
+
+    s = order(q);
+    EXPECT_EQ(s.substr(0, 16), "btttbtttbtttbttt");
+
+    // Shares are in bytes: 3 times longer messages alternate
+    for (int i = 0; i < 8; i++)
+        EXPECT_TRUE(push(q, egress, 22, 'b', 20));
+    for (int i = 0; i < 8; i++)
+        EXPECT_TRUE(push(q, egress, 30, 't', 60));
+
+    s = order(q);
+    EXPECT_EQ(s.substr(0, 8), "bbtbtbtb");
+}
+
+TEST(EgressSchedulerTest, drop_after) {
+    EgressScheduler egress;
+    TxQueue q{4, 4096};
+
+    egress.set_class(76, EgressControl);
+    egress.set_class(22, EgressBulk);
+
+    EXPECT_TRUE(push(q, egress, 22, 'b', 20, 3));
+    EXPECT_TRUE(push(q, egress, 30, 't'));
+    EXPECT_TRUE(push(q, egress, 76, 'c'));
+
+    // Only the last message goes, if it ranks after the new one
+    EXPECT_FALSE(q.drop_after(TxQueue::RANK_LAST));
+    EXPECT_TRUE(q.drop_after(0));
+    EXPECT_EQ(q.count(), 2U);
+    EXPECT_TRUE(q.drop_after(0));
+
+    // Partially written
+    EXPECT_FALSE(q.drop_after(0));
+    EXPECT_EQ(order(q), "b");
+}
+
+TEST(EgressSchedulerTest, coalesce) {
+    EgressScheduler egress;
+    TxQueue q{8, 4096};
+
+    EXPECT_FALSE(egress.coalescing());
+    egress.set_coalesced(33);
+    egress.set_coalesced(30);
+    EXPECT_TRUE(egress.coalescing());
+    EXPECT_TRUE(egress.is_coalesced(30));
+    EXPECT_FALSE(egress.is_coalesced(76));
+
+    EXPECT_TRUE(push(q, egress, 33, 'a', 20, 5));
+    EXPECT_TRUE(push(q, egress, 30, 'b'));
+    EXPECT_TRUE(push(q, egress, 76, 'c'));
+
+    uint8_t data[MAVLINK_MAX_PACKET_LEN] = {MAVLINK_STX};
+    struct buffer buf = {30, data, nullptr};
+
+    // Newer samples take the place of the queued ones, partially written ones excepted
+    data[7] = 30;
+    data[10] = 'B';
+    EXPECT_TRUE(q.replace(Packet::get(&buf)));
+    Packet::release(&buf);
+
+    data[7] = 33;
+    data[10] = 'A';
+    EXPECT_FALSE(q.replace(Packet::get(&buf)));
+    Packet::release(&buf);
+
+    // Not from the same sender
+    data[5] = 1;
+    data[7] = 30;
+    EXPECT_FALSE(q.replace(Packet::get(&buf)));
+    Packet::release(&buf);
+
+    EXPECT_EQ(q.count(), 3U);
+    EXPECT_EQ(q.bytes(), 65U);
+    EXPECT_EQ(order(q), "aBc");
+}
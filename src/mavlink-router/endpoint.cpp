@@ -26,214 +26,570 @@
 #include <netinet/tcp.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <random>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <common/crc.h>
 #include <common/log.h>
+#include <common/memchr2.h>
 #include <common/util.h>
 #include <common/xtermios.h>
 
 #include <linux/serial.h>
 
 #include "mainloop.h"
+#include "routing.h"
 
-#define RX_BUF_MAX_SIZE (MAVLINK_MAX_PACKET_LEN * 4)
-#define TX_BUF_MAX_SIZE (8U * 1024U)
+#define RX_BUF_MAX_SIZE (MAVLINK_MAX_PACKET_LEN * 16)
+#define TX_QUEUE_MAX_MSGS 256U
+#define TX_IOV_MAX UDP_BATCH_MAX
+
+/* Smallest room for a datagram when receiving them in batches */
+#define UDP_RX_SLOT_SIZE (MAVLINK_MAX_PACKET_LEN * 2)
 
 #define UART_BAUD_RETRY_SEC 5
 
-Endpoint::Endpoint(const char *name)
+/* Clients accepted at once by a UnixEndpoint, so that routing isn't starved */
+#define UNIX_ACCEPT_MAX 16
+
+/* Records of a ShmClient routed per doorbell, the rest waits for the next one */
+#define SHM_RX_MAX 256
+
+/*
+ * Bytes left in the kernel's UART output buffer when scheduling egress. The
+ * tty layer reports it writable again once less than 256 bytes are left.
+ */
+#define UART_TX_KERNEL_MAX_BYTES 512
+#define UART_TX_KERNEL_WAKEUP_BYTES 256
+
+Pool Endpoint::rx_buf_pool{"RX buffer", RX_BUF_MAX_SIZE, 4};
+Pool Endpoint::tx_ring_pool{"TX queue", TxQueue::ring_size(TX_QUEUE_MAX_MSGS), 4};
+Pool TcpEndpoint::pool{"TCP endpoint", sizeof(TcpEndpoint), 4};
+
+Endpoint::Endpoint(const char *name, bool lazy_rx_buf)
     : _name{name}
+    , _tx_queue{TX_QUEUE_MAX_MSGS, TX_QUEUE_DEFAULT_MAX_BYTES, &tx_ring_pool}
 {
-    rx_buf.data = (uint8_t *) malloc(RX_BUF_MAX_SIZE);
+    rx_buf.data = nullptr;
     rx_buf.len = 0;
-    tx_buf.data = (uint8_t *) malloc(TX_BUF_MAX_SIZE);
-    tx_buf.len = 0;
 
-    assert(rx_buf.data);
-    assert(tx_buf.data);
+    if (lazy_rx_buf)
+        return;
+
+    rx_buf.data = (uint8_t *)rx_buf_pool.alloc();
+    if (!rx_buf.data)
+        log_error("Could not allocate RX buffer for %s endpoint", name);
 }
 
 Endpoint::~Endpoint()
 {
-    free(rx_buf.data);
-    free(tx_buf.data);
+    if (_routing_table)
+        _routing_table->remove_endpoint(this);
+
+    rx_buf_pool.free(rx_buf.data);
 }
 
 bool Endpoint::handle_canwrite()
 {
     int r = flush_pending_msgs();
-    return r == -EAGAIN;
+
+    if (r == -EAGAIN)
+        return true;
+
+    _tx_blocked = false;
+    return false;
 }
 
-int Endpoint::handle_read()
+int Endpoint::write_msg(const struct buffer *pbuf)
 {
-    int target_sysid, target_compid, r;
-    uint8_t src_sysid, src_compid;
-    uint32_t msg_id;
-    struct buffer buf{};
+    struct iovec iov = {pbuf->data, pbuf->len};
+    ssize_t r;
 
-    while ((r = read_msg(&buf, &target_sysid, &target_compid, &src_sysid, &src_compid, &msg_id)) > 0)
-        Mainloop::get_instance().route_msg(&buf, target_sysid, target_compid, src_sysid,
-                                           src_compid, msg_id);
+    if (fd < 0) {
+        log_error("Trying to write invalid fd");
+        return -EINVAL;
+    }
+
+    /* Keep messages in order: wait for whatever is already pending */
+    if (_tx_blocked)
+        return _queue_msg(pbuf, 0) ? 0 : -ENOBUFS;
+
+    if (_batch_size > 1)
+        return _batch_msg(pbuf);
+
+    r = _write_msg(&iov, 1);
+    if (r == -EAGAIN)
+        r = 0;
+    else if (r < 0)
+        return r;
+
+    /* A blocked write sent nothing */
+    if (r > 0)
+        _stat.write.writes++;
+    _stat.write.bytes += r;
+
+    if (r == (ssize_t)pbuf->len) {
+        _stat.write.total++;
+        return r;
+    }
+
+    /*
+     * Blocked or partially written: queue the rest so the stream isn't
+     * corrupted, it will be written when the endpoint is writable again
+     */
+    if (!_queue_msg(pbuf, r))
+        return -ENOBUFS;
+
+    _tx_blocked = true;
+    return -EAGAIN;
+}
+
+int Endpoint::_batch_msg(const struct buffer *pbuf)
+{
+    /*
+     * A batch of large messages may not fit in the queue: write it now
+     * rather than dropping messages of an endpoint that isn't blocked
+     */
+    if (!_tx_queue.fits(pbuf->len) && flush_batch() == -EAGAIN) {
+        /* Dropped if it still doesn't fit, but the caller must wait for EPOLLOUT anyway */
+        _queue_msg(pbuf, 0);
+        return -EAGAIN;
+    }
+
+    if (!_queue_msg(pbuf, 0))
+        return -ENOBUFS;
+
+    if (_batch_max_latency_usec > 0 && _tx_queue.count() == 1)
+        _batch_start_usec = now_usec();
+
+    if (_tx_queue.count() < _batch_size
+        && (_batch_max_latency_usec == 0
+            || now_usec() - _batch_start_usec < _batch_max_latency_usec))
+        return 0;
+
+    return flush_batch();
+}
+
+int Endpoint::flush_batch()
+{
+    int r;
+
+    if (_tx_blocked || _tx_queue.empty())
+        return 0;
+
+    r = flush_pending_msgs();
+    if (r == -EAGAIN)
+        _tx_blocked = true;
 
     return r;
 }
 
-int Endpoint::read_msg(struct buffer *pbuf, int *target_sysid, int *target_compid,
-                       uint8_t *src_sysid, uint8_t *src_compid, uint32_t *msg_id)
+int Endpoint::flush_pending_msgs()
 {
-    bool should_read_more = true;
-    const mavlink_msg_entry_t *msg_entry;
-    uint8_t *payload, seq, payload_len;
+    struct iovec iov[TX_IOV_MAX];
+    ssize_t r;
+    int n;
+
+    while (!_tx_queue.empty()) {
+        n = _tx_queue.fill_iovec(iov, TX_IOV_MAX);
+
+        if (_datagram) {
+            r = _write_datagrams(iov, n);
+            if (r == -EAGAIN)
+                return -EAGAIN;
+
+            if (r < 0) {
+                /* Only this datagram is lost, try the next ones */
+                _tx_queue.consume(iov[0].iov_len);
+                _stat.write.dropped++;
+                _dropped_msgs++;
+                continue;
+            }
 
-    if (fd < 0) {
-        log_error("Trying to read invalid fd");
-        return -EINVAL;
-    }
+            _stat.write.writes++;
+            for (int i = 0; i < r; i++) {
+                _stat.write.bytes += iov[i].iov_len;
+                _stat.write.total += _tx_queue.consume(iov[i].iov_len);
+            }
+            continue;
+        }
 
-    if (_last_packet_len != 0) {
-        /*
-         * read_msg() should be called in a loop after writting to each
-         * output. However we don't want to keep busy looping on a single
-         * endpoint reading more data. If we left data behind, move them
-         * to the beginning and check we have a complete packet, but don't
-         * read more data right now - it will be handled on next
-         * iteration when more data is available
-         */
-        should_read_more = false;
+        r = _write_msg(iov, n);
+        if (r == -EAGAIN) {
+            _tx_lag_usec();
+            return -EAGAIN;
+        }
 
-        /* see TODO below about using bigger buffers: we could just walk on
-         * the buffer rather than moving bytes */
-        rx_buf.len -= _last_packet_len;
-        if (rx_buf.len > 0) {
-            memmove(rx_buf.data, rx_buf.data + _last_packet_len, rx_buf.len);
+        if (r < 0) {
+            /* What's left of the stream can't be written anymore */
+            _stat.write.dropped += _tx_queue.count();
+            _dropped_msgs += _tx_queue.count();
+            _tx_queue.clear();
+            return r;
         }
 
-        _last_packet_len = 0;
+        _stat.write.writes++;
+        _stat.write.bytes += r;
+        _stat.write.total += _tx_queue.consume(r);
     }
 
-    if (should_read_more) {
-        ssize_t r = _read_msg(rx_buf.data + rx_buf.len, RX_BUF_MAX_SIZE - rx_buf.len);
-        if (r <= 0)
-            return r;
+    return 0;
+}
+
+/*
+ * Messages kept by DropLowPriority: link status, commands, parameters and
+ * missions. Sorted, for binary search.
+ */
+static const uint32_t high_priority_msg_ids[] = {
+    MAVLINK_MSG_ID_HEARTBEAT,
+    MAVLINK_MSG_ID_SET_MODE,
+    MAVLINK_MSG_ID_PARAM_REQUEST_READ,
+    MAVLINK_MSG_ID_PARAM_REQUEST_LIST,
+    MAVLINK_MSG_ID_PARAM_VALUE,
+    MAVLINK_MSG_ID_PARAM_SET,
+    MAVLINK_MSG_ID_MISSION_ITEM,
+    MAVLINK_MSG_ID_MISSION_REQUEST,
+    MAVLINK_MSG_ID_MISSION_SET_CURRENT,
+    MAVLINK_MSG_ID_MISSION_CURRENT,
+    MAVLINK_MSG_ID_MISSION_REQUEST_LIST,
+    MAVLINK_MSG_ID_MISSION_COUNT,
+    MAVLINK_MSG_ID_MISSION_CLEAR_ALL,
+    MAVLINK_MSG_ID_MISSION_ITEM_REACHED,
+    MAVLINK_MSG_ID_MISSION_ACK,
+    MAVLINK_MSG_ID_MISSION_REQUEST_INT,
+    MAVLINK_MSG_ID_MISSION_ITEM_INT,
+    MAVLINK_MSG_ID_COMMAND_INT,
+    MAVLINK_MSG_ID_COMMAND_LONG,
+    MAVLINK_MSG_ID_COMMAND_ACK,
+    MAVLINK_MSG_ID_STATUSTEXT,
+};
+
+static bool is_low_priority(const Packet *pkt)
+{
+    return !std::binary_search(std::begin(high_priority_msg_ids), std::end(high_priority_msg_ids),
+                               pkt->msg_id());
+}
+
+bool Endpoint::_queue_msg(const struct buffer *pbuf, unsigned offset)
+{
+    Packet *pkt = Packet::get(pbuf);
+    uint64_t rank = TxQueue::RANK_LAST;
+
+    if (!pkt)
+        goto drop;
+
+    if (_egress.coalescing() && _egress.is_coalesced(pkt->msg_id()) && _tx_queue.replace(pkt)) {
+        _stat.write.coalesced++;
+        return true;
+    }
+
+    if (_egress.enabled())
+        rank = _egress.rank(pkt, _tx_queue);
+
+    while (!_tx_queue.push(pkt, offset, rank)) {
+        if (!_make_room(rank))
+            goto drop;
+    }
+
+    _stat.write.queued++;
+    _stat.write.queue_peak_bytes = std::max(_stat.write.queue_peak_bytes, _tx_queue.bytes());
+
+    return true;
 
-        log_debug("%s [%d] got %zd bytes", _name, fd, r);
-        rx_buf.len += r;
+drop:
+    _stat.write.dropped++;
+    _dropped_msgs++;
+    return false;
+}
+
+/*
+ * Make room in the full transmit queue for a message of @rank. With an egress
+ * scheduler the message to be written last is evicted if it ranks after the
+ * new one, otherwise the slow consumer policy applies. Returns false if the
+ * new message should be dropped instead.
+ */
+bool Endpoint::_make_room(uint64_t rank)
+{
+    bool dropped;
+
+    if (_egress.enabled()) {
+        dropped = _tx_queue.drop_after(rank);
+    } else if (_slow_consumer.action == DropOldest) {
+        dropped = _tx_queue.drop();
+    } else if (_slow_consumer.action == DropLowPriority) {
+        dropped = _tx_queue.drop(is_low_priority);
+    } else {
+        return false;
     }
 
-    bool mavlink2 = rx_buf.data[0] == MAVLINK_STX;
-    bool mavlink1 = rx_buf.data[0] == MAVLINK_STX_MAVLINK1;
+    if (!dropped)
+        return false;
+
+    _stat.write.dropped++;
+    _stat.write.evicted++;
+    _dropped_msgs++;
+
+    return true;
+}
+
+usec_t Endpoint::_tx_lag_usec()
+{
+    if (_tx_queue.empty())
+        return 0;
+
+    usec_t lag = now_usec() - _tx_queue.front()->queued_usec;
+    _stat.write.lag_max_usec = std::max(_stat.write.lag_max_usec, lag);
+
+    return lag;
+}
+
+int Endpoint::handle_read()
+{
+    int r;
+
+    if (fd < 0) {
+        log_error("Trying to read invalid fd");
+        return -EINVAL;
+    }
 
     /*
-     * Find magic byte as the start byte:
-     *
-     * we either enter here due to new bytes being written to the
-     * beginning of the buffer or due to _last_packet_len not being 0
-     * above, which means we moved some bytes we read previously
+     * Read once and route every complete message we got: anything left in
+     * rx_buf afterwards is an incomplete message that will be completed on
+     * the next read. We don't keep reading from the same endpoint so others
+     * get a chance to be handled too - being level-triggered, epoll will
+     * tell us again if there's more data.
      */
-    if (!mavlink1 && !mavlink2) {
-        unsigned int stx_pos = 0;
+    r = _fill_rx_buf();
+    if (r <= 0)
+        return r;
 
-        for (unsigned int i = 1; i < (unsigned int) rx_buf.len; i++) {
-            if (rx_buf.data[i] == MAVLINK_STX)
-                mavlink2 = true;
-            else if (rx_buf.data[i] == MAVLINK_STX_MAVLINK1)
-                mavlink1 = true;
+    return _route_msgs();
+}
 
-            if (mavlink1 || mavlink2) {
-                stx_pos = i;
-                break;
+int Endpoint::_route_msgs()
+{
+    int target_sysid, target_compid, r;
+    uint8_t src_sysid, src_compid;
+    uint32_t msg_id;
+    struct buffer buf{};
+
+    while ((r = read_msg(&buf, &target_sysid, &target_compid, &src_sysid, &src_compid, &msg_id)) > 0) {
+        if (_dedup_group) {
+            if (_dedup_group->seen(&buf, src_sysid, src_compid, msg_id)) {
+                _stat.read.dedup_duplicate++;
+                continue;
             }
+            _stat.read.dedup_first++;
         }
 
-        /* Discarding data since we don't have a marker */
-        if (stx_pos == 0) {
-            rx_buf.len = 0;
-            return 0;
+        if (Mainloop::get_instance().seen_recently(&buf, src_sysid, src_compid, msg_id)) {
+            _stat.read.loops++;
+            continue;
         }
 
+        Mainloop::get_instance().route_msg(&buf, target_sysid, target_compid, src_sysid,
+                                           src_compid, msg_id);
+    }
+
+    return r;
+}
+
+int Endpoint::_fill_rx_buf()
+{
+    if (!rx_buf.data) {
+        rx_buf.data = (uint8_t *)rx_buf_pool.alloc();
+        if (!rx_buf.data)
+            return -ENOMEM;
+        rx_buf.len = 0;
+        _rx_offset = 0;
+    }
+
+    if (_rx_offset == rx_buf.len) {
+        _rx_offset = 0;
+        rx_buf.len = 0;
+    } else if (RX_BUF_MAX_SIZE - rx_buf.len < MAVLINK_MAX_PACKET_LEN) {
         /*
-         * TODO: a larger buffer would allow to avoid the memmove in case a
-         * new message would still fit in our buffer
+         * Only an incomplete message is left and it's close to the end of
+         * the buffer: move it to the beginning so it can be completed
          */
-        rx_buf.len -= stx_pos;
-        memmove(rx_buf.data, rx_buf.data + stx_pos, rx_buf.len);
+        rx_buf.len -= _rx_offset;
+        memmove(rx_buf.data, rx_buf.data + _rx_offset, rx_buf.len);
+        _rx_offset = 0;
     }
 
+    ssize_t r = _read_msg(rx_buf.data + rx_buf.len, RX_BUF_MAX_SIZE - rx_buf.len);
+    if (r <= 0)
+        return r;
+
+    log_debug("%s [%d] got %zd bytes", _name, fd, r);
+    rx_buf.len += r;
+    _stat.read.reads++;
+
+    return r;
+}
+
+void Endpoint::_release_rx_buf()
+{
+    if (!rx_buf.data || _rx_offset != rx_buf.len)
+        return;
+
+    rx_buf_pool.free(rx_buf.data);
+    rx_buf.data = nullptr;
+    rx_buf.len = 0;
+    _rx_offset = 0;
+}
+
+int Endpoint::read_msg(struct buffer *pbuf, int *target_sysid, int *target_compid,
+                       uint8_t *src_sysid, uint8_t *src_compid, uint32_t *msg_id)
+{
     const uint8_t checksum_len = 2;
+    const mavlink_msg_entry_t *msg_entry;
+    uint8_t *payload, seq, payload_len;
+    struct buffer frame;
     size_t expected_size;
 
-    if (mavlink2) {
-        struct mavlink_router_mavlink2_header *hdr =
-                (struct mavlink_router_mavlink2_header *)rx_buf.data;
+    /*
+     * Walk rx_buf from where we stopped on previous call, skipping messages
+     * with wrong CRC, until we find a message to return or reach an
+     * incomplete one
+     */
+    while (true) {
+        frame.data = rx_buf.data + _rx_offset;
+        frame.len = rx_buf.len - _rx_offset;
 
-        if (rx_buf.len < sizeof(*hdr))
+        if (frame.len == 0)
             return 0;
 
-        *msg_id = hdr->msgid;
-        payload = rx_buf.data + sizeof(*hdr);
-        seq = hdr->seq;
-        *src_sysid = hdr->sysid;
-        *src_compid = hdr->compid;
-        payload_len = hdr->payload_len;
-
-        expected_size = sizeof(*hdr);
-        expected_size += hdr->payload_len;
-        expected_size += checksum_len;
-        if (hdr->incompat_flags & MAVLINK_IFLAG_SIGNED)
-            expected_size += MAVLINK_SIGNATURE_BLOCK_LEN;
-    } else {
-        struct mavlink_router_mavlink1_header *hdr =
-                (struct mavlink_router_mavlink1_header *)rx_buf.data;
+        bool mavlink2 = frame.data[0] == MAVLINK_STX;
+        bool mavlink1 = frame.data[0] == MAVLINK_STX_MAVLINK1;
+
+        /* Find magic byte as the start byte */
+        if (!mavlink1 && !mavlink2) {
+            const uint8_t *stx = (const uint8_t *)memchr2(frame.data + 1, MAVLINK_STX,
+                                                          MAVLINK_STX_MAVLINK1, frame.len - 1);
+
+            /* Discarding data since we don't have a marker */
+            if (!stx) {
+                if (_rx_resyncing)
+                    _stat.read.crc_error_bytes += frame.len;
+                _rx_offset = rx_buf.len;
+                _rx_lost_sync = true;
+                return 0;
+            }
 
-        if (rx_buf.len < sizeof(*hdr))
-            return 0;
+            if (_rx_resyncing)
+                _stat.read.crc_error_bytes += stx - frame.data;
+            _rx_offset += stx - frame.data;
+            _rx_lost_sync = true;
+            continue;
+        }
 
-        *msg_id = hdr->msgid;
-        payload = rx_buf.data + sizeof(*hdr);
-        seq = hdr->seq;
-        *src_sysid = hdr->sysid;
-        *src_compid = hdr->compid;
-        payload_len = hdr->payload_len;
+        if (mavlink2) {
+            struct mavlink_router_mavlink2_header *hdr =
+                    (struct mavlink_router_mavlink2_header *)frame.data;
+
+            if (frame.len < sizeof(*hdr))
+                return 0;
+
+            *msg_id = hdr->msgid;
+            payload = frame.data + sizeof(*hdr);
+            seq = hdr->seq;
+            *src_sysid = hdr->sysid;
+            *src_compid = hdr->compid;
+            payload_len = hdr->payload_len;
+
+            expected_size = sizeof(*hdr);
+            expected_size += hdr->payload_len;
+            expected_size += checksum_len;
+            if (hdr->incompat_flags & MAVLINK_IFLAG_SIGNED)
+                expected_size += MAVLINK_SIGNATURE_BLOCK_LEN;
+        } else {
+            struct mavlink_router_mavlink1_header *hdr =
+                    (struct mavlink_router_mavlink1_header *)frame.data;
+
+            if (frame.len < sizeof(*hdr))
+                return 0;
+
+            *msg_id = hdr->msgid;
+            payload = frame.data + sizeof(*hdr);
+            seq = hdr->seq;
+            *src_sysid = hdr->sysid;
+            *src_compid = hdr->compid;
+            payload_len = hdr->payload_len;
+
+            expected_size = sizeof(*hdr);
+            expected_size += hdr->payload_len;
+            expected_size += checksum_len;
+        }
 
-        expected_size = sizeof(*hdr);
-        expected_size += hdr->payload_len;
-        expected_size += checksum_len;
-    }
+        /* check if we have a valid mavlink packet */
+        if (frame.len < expected_size)
+            return 0;
 
-    /* check if we have a valid mavlink packet */
-    if (rx_buf.len < expected_size)
-        return 0;
+        frame.len = expected_size;
 
-    /* We always want to transmit one packet at a time; record the number
-     * of bytes read in addition to the expected size and leave them for
-     * the next iteration */
-    _last_packet_len = expected_size;
-    _stat.read.total++;
+        msg_entry = mavlink_get_msg_entry(*msg_id);
 
-    msg_entry = mavlink_get_msg_entry(*msg_id);
-    if (msg_entry) {
         /*
          * It is accepting and forwarding unknown messages ids because
          * it can be a new MAVLink message implemented only in
          * Ground Station and Flight Stack. Although it can also be a
          * corrupted message is better forward than silent drop it.
          */
-        if (!_check_crc(msg_entry)) {
-            _stat.read.crc_error++;
-            _stat.read.crc_error_bytes += expected_size;
-            return 0;
+        if (msg_entry && !_check_msg(msg_entry, &frame)) {
+            /* One error for all the bytes skipped until the next valid message */
+            if (!_rx_resyncing) {
+                _stat.read.total++;
+                _stat.read.crc_error++;
+                _rx_resyncing = true;
+            }
+            _rx_lost_sync = true;
+
+            /*
+             * The magic byte may have been garbage or the length may be
+             * corrupted: resync from the next magic byte rather than
+             * dropping what may contain valid messages
+             */
+            _stat.read.crc_error_bytes++;
+            _rx_offset++;
+            continue;
         }
-        _add_sys_comp_id(((uint16_t)*src_sysid << 8) | *src_compid);
+
+        /*
+         * Out of sync, a magic byte followed by an unknown message id is
+         * most likely part of garbage or of a corrupted message: trusting
+         * its length would drop the valid messages it overlaps. Only take
+         * it if the next message starts right after it.
+         */
+        if (!msg_entry && _rx_lost_sync && frame.len < rx_buf.len - _rx_offset
+            && frame.data[frame.len] != MAVLINK_STX && frame.data[frame.len] != MAVLINK_STX_MAVLINK1) {
+            if (_rx_resyncing)
+                _stat.read.crc_error_bytes++;
+            _rx_offset++;
+            continue;
+        }
+
+        _stat.read.total++;
+        _rx_resyncing = false;
+        _rx_lost_sync = false;
+        _rx_offset += expected_size;
+        break;
     }
 
+    if (msg_entry)
+        _add_sys_comp_id(((uint16_t)*src_sysid << 8) | *src_compid);
+
     _stat.read.handled++;
     _stat.read.handled_bytes += expected_size;
 
@@ -279,37 +635,58 @@ int Endpoint::read_msg(struct buffer *pbuf, int *target_sysid, int *target_compi
     }
     _stat.read.expected_seq++;
 
-    pbuf->data = rx_buf.data;
-    pbuf->len = expected_size;
+    pbuf->data = frame.data;
+    pbuf->len = frame.len;
 
     return msg_entry != nullptr ? ReadOk : ReadUnkownMsg;
 }
 
-void Endpoint::_add_sys_comp_id(uint16_t sys_comp_id)
+bool SysCompIdSet::add(uint8_t sysid, uint8_t compid)
 {
-    if (has_sys_comp_id(sys_comp_id))
-        return;
+    if (!has(sysid)) {
+        _compids.insert(_compids.begin() + _rank(sysid), std::array<uint64_t, 4>{});
+        _sysids[sysid / 64] |= 1ULL << (sysid % 64);
+    }
+
+    auto &compids = _compids[_rank(sysid)];
+    const uint64_t bit = 1ULL << (compid % 64);
+
+    if (compids[compid / 64] & bit)
+        return false;
 
-    _sys_comp_ids.push_back(sys_comp_id);
+    compids[compid / 64] |= bit;
+    return true;
 }
 
-bool Endpoint::has_sys_id(unsigned sysid)
+unsigned SysCompIdSet::_rank(uint8_t sysid) const
 {
-    for (auto it = _sys_comp_ids.begin(); it != _sys_comp_ids.end(); it++) {
-        if (((*it >> 8) | (sysid & 0xff)) == sysid)
-            return true;
-    }
-    return false;
+    const unsigned word = sysid / 64;
+    unsigned rank = __builtin_popcountll(_sysids[word] & ((1ULL << (sysid % 64)) - 1));
+
+    for (unsigned i = 0; i < word; i++)
+        rank += __builtin_popcountll(_sysids[i]);
+
+    return rank;
 }
 
-bool Endpoint::has_sys_comp_id(unsigned sys_comp_id)
+void Endpoint::_inherit_settings(const Endpoint &e)
 {
-    for (auto it = _sys_comp_ids.begin(); it != _sys_comp_ids.end(); it++) {
-        if (sys_comp_id == *it)
-            return true;
-    }
+    _message_filter = e._message_filter;
+    _trusted_source = e._trusted_source;
+    _slow_consumer = e._slow_consumer;
+    _tx_queue.set_max_bytes(e._tx_queue.max_bytes());
+    _egress = e._egress;
+    _rate_limiter = e._rate_limiter;
+    _dedup_group = e._dedup_group;
+}
 
-    return false;
+void Endpoint::_add_sys_comp_id(uint16_t sys_comp_id)
+{
+    if (!_sys_comp_ids.add(sys_comp_id >> 8, sys_comp_id & 0xff))
+        return;
+
+    if (_routing_table)
+        _routing_table->add_sys_comp_id(this, sys_comp_id);
 }
 
 bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid,
@@ -319,9 +696,7 @@ bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid
         log_debug("Endpoint [%d] got message %u to %d/%d from %u/%u", fd, msg_id, target_sysid, target_compid,
                   src_sysid, src_compid);
         log_debug("\tKnown components:");
-        for (auto it = _sys_comp_ids.begin(); it != _sys_comp_ids.end(); it++) {
-            log_debug("\t\t%u/%u", (*it >> 8), *it & 0xff);
-        }
+        _sys_comp_ids.for_each([](uint16_t id) { log_debug("\t\t%u/%u", id >> 8, id & 0xff); });
     }
 
     // This endpoint sent the message, we don't want to send it back over the
@@ -329,13 +704,8 @@ bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid
     if (has_sys_comp_id(src_sysid, src_compid))
         return false;
 
-    if (msg_id != UINT32_MAX && 
-        _message_filter.size() > 0 && 
-        std::find(_message_filter.begin(), _message_filter.end(), msg_id) == _message_filter.end()) {
-
-        // if filter is defined and message is not in the set then discard it
+    if (!accept_msg_id(msg_id))
         return false;
-    }
 
     // Message is broadcast on sysid or sysid is non-existent: accept msg
     if (target_sysid == 0 || target_sysid == -1)
@@ -353,29 +723,53 @@ bool Endpoint::accept_msg(int target_sysid, int target_compid, uint8_t src_sysid
     return false;
 }
 
-bool Endpoint::_check_crc(const mavlink_msg_entry_t *msg_entry)
+bool Endpoint::accept_msg_id(uint32_t msg_id)
+{
+    if (msg_id != UINT32_MAX &&
+        _message_filter.size() > 0 &&
+        std::find(_message_filter.begin(), _message_filter.end(), msg_id) == _message_filter.end()) {
+
+        // if filter is defined and message is not in the set then discard it
+        return false;
+    }
+
+    return true;
+}
+
+bool Endpoint::_check_msg(const mavlink_msg_entry_t *msg_entry, const struct buffer *frame)
+{
+    if (!_trusted_source)
+        return _check_crc(msg_entry, frame);
+
+    _stat.read.crc_skipped++;
+
+    /* Without a CRC check, at least make sure the length makes sense */
+    return frame->data[1] <= msg_entry->max_msg_len;
+}
+
+bool Endpoint::_check_crc(const mavlink_msg_entry_t *msg_entry, const struct buffer *frame)
 {
-    const bool mavlink2 = rx_buf.data[0] == MAVLINK_STX;
+    const bool mavlink2 = frame->data[0] == MAVLINK_STX;
     uint16_t crc_msg, crc_calc;
     uint8_t payload_len, header_len, *payload;
 
     if (mavlink2) {
         struct mavlink_router_mavlink2_header *hdr =
-                    (struct mavlink_router_mavlink2_header *)rx_buf.data;
-        payload = rx_buf.data + sizeof(*hdr);
+                    (struct mavlink_router_mavlink2_header *)frame->data;
+        payload = frame->data + sizeof(*hdr);
         header_len = sizeof(*hdr);
         payload_len = hdr->payload_len;
     } else {
         struct mavlink_router_mavlink1_header *hdr =
-                    (struct mavlink_router_mavlink1_header *)rx_buf.data;
-        payload = rx_buf.data + sizeof(*hdr);
+                    (struct mavlink_router_mavlink1_header *)frame->data;
+        payload = frame->data + sizeof(*hdr);
         header_len = sizeof(*hdr);
         payload_len = hdr->payload_len;
     }
 
     crc_msg = payload[payload_len] | (payload[payload_len + 1] << 8);
-    crc_calc = crc_calculate(&rx_buf.data[1], header_len + payload_len - 1);
-    crc_accumulate(msg_entry->crc_extra, &crc_calc);
+    crc_calc = crc16_mcrf4xx(CRC16_MCRF4XX_INIT, &frame->data[1], header_len + payload_len - 1);
+    crc_calc = crc16_mcrf4xx(crc_calc, &msg_entry->crc_extra, 1);
     if (crc_calc != crc_msg) {
         return false;
     }
@@ -386,19 +780,48 @@ bool Endpoint::_check_crc(const mavlink_msg_entry_t *msg_entry)
 void Endpoint::print_statistics()
 {
     const uint32_t read_total = _stat.read.total == 0 ? 1 : _stat.read.total;
+    const usec_t lag = _tx_lag_usec();
 
     printf("Endpoint %s [%d] {", _name, fd);
     printf("\n\tReceived messages {");
     printf("\n\t\tCRC error: %u %u%% %luKBytes", _stat.read.crc_error,
            (_stat.read.crc_error * 100) / read_total, _stat.read.crc_error_bytes / 1000);
+    if (_trusted_source)
+        printf("\n\t\tCRC skipped: %u", _stat.read.crc_skipped);
     printf("\n\t\tSequence lost: %u %u%%", _stat.read.drop_seq_total,
            (_stat.read.drop_seq_total * 100) / read_total);
     printf("\n\t\tHandled: %u %luKBytes", _stat.read.handled, _stat.read.handled_bytes / 1000);
     printf("\n\t\tTotal: %u", _stat.read.total);
+    printf("\n\t\tReads: %" PRIu64 " (%.2f messages per read)", _stat.read.reads,
+           _stat.read.reads ? (double)_stat.read.handled / _stat.read.reads : 0.0);
+    if (Mainloop::get_instance().has_loop_cache())
+        printf("\n\t\tLooped: %u", _stat.read.loops);
+    if (_dedup_group) {
+        const uint32_t dedup_total = _stat.read.dedup_first + _stat.read.dedup_duplicate;
+
+        printf("\n\t\tDedup group %s: first %u %u%%, duplicate %u", _dedup_group->name(),
+               _stat.read.dedup_first,
+               dedup_total ? (_stat.read.dedup_first * 100) / dedup_total : 0,
+               _stat.read.dedup_duplicate);
+    }
     printf("\n\t}");
     printf("\n\tTransmitted messages {");
     printf("\n\t\tTotal: %u %luKBytes", _stat.write.total, _stat.write.bytes / 1000);
+    printf("\n\t\tQueued: %u", _stat.write.queued);
+    printf("\n\t\tDropped: %u (%u evicted from the queue)", _stat.write.dropped,
+           _stat.write.evicted);
+    if (_egress.coalescing())
+        printf("\n\t\tCoalesced: %u", _stat.write.coalesced);
+    printf("\n\t\tQueue: %zu bytes (peak %zu, max %zu)", _tx_queue.bytes(),
+           _stat.write.queue_peak_bytes, _tx_queue.max_bytes());
+    printf("\n\t\tLag: %" PRIu64 "ms (max %" PRIu64 "ms)", lag / USEC_PER_MSEC,
+           _stat.write.lag_max_usec / USEC_PER_MSEC);
+    printf("\n\t\tWrites: %" PRIu64 " (%.2f messages per write)", _stat.write.writes,
+           _stat.write.writes ? (double)_stat.write.total / _stat.write.writes : 0.0);
     printf("\n\t}");
+    if (_rate_limiter.enabled())
+        _rate_limiter.print_statistics();
+    _print_extra_statistics();
     printf("\n}\n");
 }
 
@@ -420,10 +843,10 @@ uint8_t Endpoint::get_trimmed_zeros(const mavlink_msg_entry_t *msg_entry, const
 
 void Endpoint::log_aggregate(unsigned int interval_sec)
 {
-    if (_incomplete_msgs > 0) {
-        log_warning("Endpoint %s [%d]: %u incomplete messages in the last %d seconds", _name, fd,
-                    _incomplete_msgs, interval_sec);
-        _incomplete_msgs = 0;
+    if (_dropped_msgs > 0) {
+        log_warning("Endpoint %s [%d]: %u messages dropped in the last %d seconds", _name, fd,
+                    _dropped_msgs, interval_sec);
+        _dropped_msgs = 0;
     }
 }
 
@@ -681,37 +1104,44 @@ ssize_t UartEndpoint::_read_msg(uint8_t *buf, size_t len)
     return r;
 }
 
-int UartEndpoint::write_msg(const struct buffer *pbuf)
+ssize_t UartEndpoint::_write_msg(const struct iovec *iov, int iovcnt)
 {
-    if (fd < 0) {
-        log_error("Trying to write invalid fd");
-        return -EINVAL;
-    }
+    struct iovec limited[TX_IOV_MAX];
+    int pending;
+    ssize_t r;
 
-    /* TODO: send any pending data */
-    if (tx_buf.len > 0) {
-        ;
+    /*
+     * What's in the kernel's buffer can't be reordered or replaced anymore:
+     * with an egress scheduler, keep it short so urgent messages don't wait
+     * behind it
+     */
+    if ((_egress.enabled() || _egress.coalescing()) && ioctl(fd, TIOCOUTQ, &pending) == 0) {
+        size_t room;
+        int n;
+
+        if (pending >= UART_TX_KERNEL_WAKEUP_BYTES)
+            return -EAGAIN;
+
+        room = UART_TX_KERNEL_MAX_BYTES - pending;
+        for (n = 0; n < iovcnt && n < TX_IOV_MAX && room > 0; n++) {
+            limited[n] = iov[n];
+            limited[n].iov_len = std::min(iov[n].iov_len, room);
+            room -= limited[n].iov_len;
+        }
+        iov = limited;
+        iovcnt = n;
     }
 
-    ssize_t r = ::write(fd, pbuf->data, pbuf->len);
-    if (r == -1 && errno == EAGAIN)
-        return -EAGAIN;
-
-    _stat.write.total++;
-    _stat.write.bytes += pbuf->len;
-
-    /* Incomplete packet, we warn and discard the rest */
-    if (r != (ssize_t) pbuf->len) {
-        _incomplete_msgs++;
-        log_debug("Discarding packet, incomplete write %zd but len=%u", r, pbuf->len);
-    }
+    r = ::writev(fd, iov, iovcnt);
+    if (r == -1)
+        return -errno;
 
     log_debug("UART [%d] wrote %zd bytes", fd, r);
 
     return r;
 }
 
-int UartEndpoint::add_speeds(std::vector<unsigned long> bauds)
+int UartEndpoint::add_speeds(std::vector<unsigned long> bauds, Mainloop &mainloop)
 {
     if (!bauds.size())
         return -EINVAL;
@@ -720,25 +1150,30 @@ int UartEndpoint::add_speeds(std::vector<unsigned long> bauds)
 
     set_speed(_baudrates[0]);
 
-    _change_baud_timeout = Mainloop::get_instance().add_timeout(
+    /* Deleted and fired on the thread reading the UART */
+    _change_baud_timeout = mainloop.add_timeout(
         MSEC_PER_SEC * UART_BAUD_RETRY_SEC,
         std::bind(&UartEndpoint::_change_baud_cb, this, std::placeholders::_1), this);
 
     return 0;
 }
 
-UdpEndpoint::UdpEndpoint()
-    : Endpoint{"UDP"}
+UdpEndpoint::UdpEndpoint(const char *name, bool lazy_rx_buf)
+    : Endpoint{name, lazy_rx_buf}
 {
+    _datagram = true;
+
     bzero(&sockaddr, sizeof(sockaddr));
 #ifdef ENABLE_IPV6
     bzero(&sockaddr6, sizeof(sockaddr6));
 #endif
 }
 
-int UdpEndpoint::open(const char *ip, unsigned long port, bool to_bind)
+int UdpEndpoint::open(const char *ip, unsigned long port, bool to_bind,
+                      const struct udp_multicast *multicast)
 {
     const int broadcast_val = 1;
+    bool multicast_addr;
 
 #ifdef ENABLE_IPV6
     this->is_ipv6 = Endpoint::is_ipv6(ip);
@@ -765,20 +1200,7 @@ int UdpEndpoint::open(const char *ip, unsigned long port, bool to_bind)
 
         sockaddr6.sin6_family = AF_INET6;
         sockaddr6.sin6_port = htons(port);
-        
-        /* multicast address needs to listen to all, but "filter" incoming packets */
-        if (to_bind && Endpoint::ipv6_is_multicast(ip_str)) {
-            sockaddr6.sin6_addr = in6addr_any;
-
-            struct ipv6_mreq group;
-            inet_pton(AF_INET6, ip_str, &group.ipv6mr_multiaddr);
-            if (setsockopt(fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &group, sizeof(group)) < 0){
-                log_error("Error setting IPv6 multicast socket options (%m)");
-                goto fail;
-            }
-        } else {
-            inet_pton(AF_INET6, ip_str, &sockaddr6.sin6_addr);
-        }
+        inet_pton(AF_INET6, ip_str, &sockaddr6.sin6_addr);
 
         /* link-local address needs a scope ID */
         if (Endpoint::ipv6_is_linklocal(ip_str)) {
@@ -793,7 +1215,18 @@ int UdpEndpoint::open(const char *ip, unsigned long port, bool to_bind)
     sockaddr.sin_port = htons(port);
 #ifdef ENABLE_IPV6
     }
+
+    multicast_addr = this->is_ipv6 ? IN6_IS_ADDR_MULTICAST(&sockaddr6.sin6_addr)
+                                   : IN_MULTICAST(ntohl(sockaddr.sin_addr.s_addr));
+#else
+    multicast_addr = IN_MULTICAST(ntohl(sockaddr.sin_addr.s_addr));
 #endif
+    if (multicast_addr) {
+        const struct udp_multicast default_multicast = UDP_MULTICAST_DEFAULT;
+
+        if (_setup_multicast(to_bind, multicast ? multicast : &default_multicast) < 0)
+            goto fail;
+    }
 
     if (to_bind) {
 #ifdef ENABLE_IPV6
@@ -846,41 +1279,252 @@ fail:
     return -1;
 }
 
-ssize_t UdpEndpoint::_read_msg(uint8_t *buf, size_t len)
+int UdpEndpoint::_setup_multicast(bool to_bind, const struct udp_multicast *multicast)
 {
-    socklen_t addrlen = sizeof(sockaddr);
-    ssize_t r = 0;
+    const int reuse_val = 1;
+    const int ttl = multicast->ttl;
+    const int loop = multicast->loop;
+    unsigned int ifindex = 0;
+
+    if (multicast->interface[0] != '\0') {
+        ifindex = if_nametoindex(multicast->interface);
+        if (ifindex == 0) {
+            log_error("Unknown multicast interface %s (%m)", multicast->interface);
+            return -1;
+        }
+    }
+
+    if (to_bind) {
+        /* Other receivers on this host may join the group on the same port */
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse_val, sizeof(reuse_val)) < 0) {
+            log_error("Error setting multicast socket as reusable (%m)");
+            return -1;
+        }
+
 #ifdef ENABLE_IPV6
-    if (this->is_ipv6) {
-        addrlen = sizeof(sockaddr6);
-        r = ::recvfrom(fd, buf, len, 0, (struct sockaddr *)&sockaddr6, &addrlen);
-    } else {
+        if (this->is_ipv6) {
+            struct ipv6_mreq group;
+
+            group.ipv6mr_multiaddr = sockaddr6.sin6_addr;
+            group.ipv6mr_interface = ifindex;
+            if (setsockopt(fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+                log_error("Error setting IPv6 multicast socket options (%m)");
+                return -1;
+            }
+
+            /* multicast address needs to listen to all, but "filter" incoming packets */
+            sockaddr6.sin6_addr = in6addr_any;
+            return 0;
+        }
 #endif
-    r = ::recvfrom(fd, buf, len, 0, (struct sockaddr *)&sockaddr, &addrlen);
+        struct ip_mreqn group = {};
+
+        group.imr_multiaddr = sockaddr.sin_addr;
+        group.imr_ifindex = ifindex;
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+            log_error("Error joining multicast group (%m)");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /* One datagram reaches every receiver that joined the group */
+    _multicast_tx = true;
+
 #ifdef ENABLE_IPV6
+    if (this->is_ipv6) {
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) < 0
+            || setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+            || (ifindex != 0
+                && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0)) {
+            log_error("Error setting IPv6 multicast socket options (%m)");
+            return -1;
+        }
+
+        return 0;
     }
 #endif
+    struct ip_mreqn iface = {};
+
+    iface.imr_ifindex = ifindex;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+        || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+        || (ifindex != 0 && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0)) {
+        log_error("Error setting multicast socket options (%m)");
+        return -1;
+    }
+
+    return 0;
+}
+
+int UdpEndpoint::_recv_datagrams(uint8_t *buf, size_t len, struct mmsghdr *msgs,
+                                 struct iovec *iov, struct sockaddr_storage *addrs)
+{
+    unsigned n = std::min<size_t>(_batch_size, len / UDP_RX_SLOT_SIZE);
+    size_t slot_size;
+    int r;
+
+    if (n == 0)
+        n = 1;
 
+    /*
+     * Receive up to n datagrams, each one on its own slot of the buffer. The
+     * first one takes whatever doesn't fit in the others, so without batching
+     * a datagram can still use the whole buffer.
+     */
+    slot_size = n > 1 ? UDP_RX_SLOT_SIZE : len;
+    for (unsigned i = 0; i < n; i++) {
+        iov[i].iov_base = buf + len - (n - i) * slot_size;
+        iov[i].iov_len = slot_size;
+        msgs[i].msg_hdr = {};
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len - (n - 1) * slot_size;
+
+    r = ::recvmmsg(fd, msgs, n, 0, nullptr);
     if (r == -1 && errno == EAGAIN)
         return 0;
     if (r == -1)
         return -errno;
 
+    for (int i = 0; i < r; i++) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            _truncated_datagrams++;
+            log_debug("UDP [%d] datagram larger than %zu bytes truncated", fd, iov[i].iov_len);
+        }
+    }
+
     return r;
 }
 
-int UdpEndpoint::write_msg(const struct buffer *pbuf)
+ssize_t UdpEndpoint::_read_msg(uint8_t *buf, size_t len)
 {
-    if (fd < 0) {
-        log_error("Trying to write invalid fd");
-        return -EINVAL;
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    struct sockaddr_storage addrs[UDP_BATCH_MAX];
+    ssize_t total = 0;
+    int r;
+
+    r = _recv_datagrams(buf, len, msgs, iov, addrs);
+    if (r <= 0)
+        return r;
+
+    /* Datagrams are then put together, to be parsed like a stream */
+    for (int i = 0; i < r; i++) {
+        memmove(buf + total, iov[i].iov_base, msgs[i].msg_len);
+        total += msgs[i].msg_len;
+    }
+
+    /* Reply to whoever sent us the last datagram */
+    _set_reply_addr(&addrs[r - 1]);
+
+    return total;
+}
+
+void UdpEndpoint::_set_reply_addr(const struct sockaddr_storage *addr)
+{
+    if (_multicast_tx)
+        return;
+
+#ifdef ENABLE_IPV6
+    if (this->is_ipv6)
+        memcpy(&sockaddr6, addr, sizeof(sockaddr6));
+    else
+#endif
+        memcpy(&sockaddr, addr, sizeof(sockaddr));
+}
+
+int UdpEndpoint::handle_read()
+{
+#ifdef ENABLE_IO_URING
+    int r = _read_ring();
+    if (r != -ENOTSUP)
+        return r;
+#endif
+
+    return Endpoint::handle_read();
+}
+
+void UdpEndpoint::route_datagram(uint8_t *data, size_t len)
+{
+    /* Parsed in place, messages don't span datagrams */
+    rx_buf.data = data;
+    rx_buf.len = len;
+    _rx_offset = 0;
+    _stat.read.reads++;
+
+    _route_msgs();
+
+    rx_buf.data = nullptr;
+    rx_buf.len = 0;
+    _rx_offset = 0;
+}
+
+void UdpEndpoint::_route_datagram(uint8_t *data, size_t len, const struct sockaddr_storage *addr)
+{
+    _set_reply_addr(addr);
+    route_datagram(data, len);
+}
+
+#ifdef ENABLE_IO_URING
+bool UdpEndpoint::receive_from(UringPoller &uring)
+{
+    if (uring.add_recv_fd(fd, this, EPOLLIN) < 0)
+        return false;
+
+    /* Datagrams are parsed where the ring received them */
+    _release_rx_buf();
+    _uring_rx = &uring;
+
+    return true;
+}
+
+int UdpEndpoint::_read_ring()
+{
+    /* Up to a batch at once like recvmmsg(), others get a chance too */
+    const int max = std::max(_batch_size, 1U);
+    UringPoller::Datagram dgram;
+    int r = 0, n = 0;
+
+    if (!_uring_rx)
+        return -ENOTSUP;
+
+    while (n < max && (r = _uring_rx->next_datagram(fd, &dgram)) > 0) {
+        if (dgram.truncated) {
+            _truncated_datagrams++;
+            log_debug("UDP [%d] datagram larger than %zu bytes truncated", fd, dgram.len);
+        }
+
+        _route_datagram(dgram.data, dgram.len, dgram.addr);
+        n++;
     }
 
-    /* TODO: send any pending data */
-    if (tx_buf.len > 0) {
-        ;
+    /* Polled from now on, read from the socket like without io_uring */
+    if (r == -ENOTSUP)
+        _uring_rx = nullptr;
+
+    return n > 0 ? n : r;
+}
+#endif
+
+void UdpEndpoint::log_aggregate(unsigned int interval_sec)
+{
+    if (_truncated_datagrams > 0) {
+        log_warning("Endpoint %s [%d]: %u datagrams too large for batched receive in the last %d seconds",
+                    _name, fd, _truncated_datagrams, interval_sec);
+        _truncated_datagrams = 0;
     }
 
+    Endpoint::log_aggregate(interval_sec);
+}
+
+int UdpEndpoint::write_msg(const struct buffer *pbuf)
+{
 #ifdef ENABLE_IPV6
     bool sock_connected = false;
     if (is_ipv6) {
@@ -896,39 +1540,378 @@ int UdpEndpoint::write_msg(const struct buffer *pbuf)
         return 0;
     }
 
-    ssize_t r = 0;
+    return Endpoint::write_msg(pbuf);
+}
+
+void UdpEndpoint::_set_msghdr(struct msghdr *msg, const struct iovec *iov, int iovcnt)
+{
+    *msg = {};
+    msg->msg_iov = (struct iovec *)iov;
+    msg->msg_iovlen = iovcnt;
 #ifdef ENABLE_IPV6
     if (this->is_ipv6) {
-        r = ::sendto(fd, pbuf->data, pbuf->len, 0, (struct sockaddr *)&sockaddr6, sizeof(sockaddr6));
+        msg->msg_name = &sockaddr6;
+        msg->msg_namelen = sizeof(sockaddr6);
     } else {
 #endif
-    r = ::sendto(fd, pbuf->data, pbuf->len, 0, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    msg->msg_name = &sockaddr;
+    msg->msg_namelen = sizeof(sockaddr);
 #ifdef ENABLE_IPV6
     }
 #endif
+}
+
+ssize_t UdpEndpoint::_write_msg(const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    _set_msghdr(&msg, iov, iovcnt);
 
+    ssize_t r = ::sendmsg(fd, &msg, 0);
     if (r == -1) {
-        if (errno != EAGAIN && errno != ECONNREFUSED && errno != ENETUNREACH)
+        int err = errno;
+        if (err != EAGAIN && err != ECONNREFUSED && err != ENETUNREACH)
             log_error("Error sending udp packet (%m)");
-        return -errno;
-    };
+        return -err;
+    }
 
-    _stat.write.total++;
-    _stat.write.bytes += pbuf->len;
+    log_debug("UDP [%d] wrote %zd bytes", fd, r);
+
+    return r;
+}
 
-    /* Incomplete packet, we warn and discard the rest */
-    if (r != (ssize_t) pbuf->len) {
-        _incomplete_msgs++;
-        log_debug("Discarding packet, incomplete write %zd but len=%u", r, pbuf->len);
+int UdpEndpoint::_write_datagrams(const struct iovec *iov, int n)
+{
+    struct mmsghdr msgs[TX_IOV_MAX];
+
+    n = std::min(n, (int)TX_IOV_MAX);
+    for (int i = 0; i < n; i++)
+        _set_msghdr(&msgs[i].msg_hdr, &iov[i], 1);
+
+    int r = ::sendmmsg(fd, msgs, n, 0);
+    if (r == -1) {
+        int err = errno;
+        if (err != EAGAIN && err != ECONNREFUSED && err != ENETUNREACH)
+            log_error("Error sending udp packets (%m)");
+        return -err;
     }
+    if (r == 0)
+        return -EAGAIN;
 
-    log_debug("UDP [%d] wrote %zd bytes", fd, r);
+    log_debug("UDP [%d] wrote %d datagrams", fd, r);
+
+    return r;
+}
+
+UdpPeer::UdpPeer(UdpServerEndpoint *server, const struct sockaddr_storage *addr)
+    : UdpEndpoint{"UDP peer", true}
+    , _server{server}
+{
+#ifdef ENABLE_IPV6
+    is_ipv6 = addr->ss_family == AF_INET6;
+    if (is_ipv6)
+        memcpy(&sockaddr6, addr, sizeof(sockaddr6));
+    else
+#endif
+        memcpy(&sockaddr, addr, sizeof(sockaddr));
+
+    fd = server->fd;
+    _inherit_settings(*server);
+    /* Written along with other peers, see UdpServerEndpoint::flush_batch() */
+    set_batch(UDP_BATCH_MAX, 0);
+    /* Room for a whole batch, or the peer would have to be written on its own */
+    if (_tx_queue.max_bytes() < UDP_BATCH_MAX * MAVLINK_MAX_PACKET_LEN)
+        _tx_queue.set_max_bytes(UDP_BATCH_MAX * MAVLINK_MAX_PACKET_LEN);
+}
+
+UdpPeer::~UdpPeer()
+{
+    /* The socket is the server's */
+    fd = -1;
+}
+
+int UdpPeer::write_msg(const struct buffer *pbuf)
+{
+    int r = Endpoint::write_msg(pbuf);
+
+    if (!_tx_queue.empty())
+        _server->add_pending(this);
+
+    /* The server is the one waiting for its socket to be writable */
+    if (r == -EAGAIN) {
+        Mainloop::get_instance().mod_fd(fd, _server, EPOLLIN | EPOLLOUT);
+        return 0;
+    }
+
+    return r;
+}
+
+void UdpPeer::_print_extra_statistics()
+{
+    char ip[INET6_ADDRSTRLEN] = "";
+    unsigned port;
+
+#ifdef ENABLE_IPV6
+    if (is_ipv6) {
+        inet_ntop(AF_INET6, &sockaddr6.sin6_addr, ip, sizeof(ip));
+        port = ntohs(sockaddr6.sin6_port);
+    } else
+#endif
+    {
+        inet_ntop(AF_INET, &sockaddr.sin_addr, ip, sizeof(ip));
+        port = ntohs(sockaddr.sin_port);
+    }
+
+    printf("\n\tPeer: %s:%u, idle %" PRIu64 "s", ip, port,
+           (now_usec() - last_rx_usec) / USEC_PER_SEC);
+}
+
+size_t UdpServerEndpoint::PeerKeyHash::operator()(const PeerKey &key) const
+{
+    uint64_t lo, hi;
+
+    memcpy(&hi, key.addr, sizeof(hi));
+    memcpy(&lo, key.addr + sizeof(hi), sizeof(lo));
+
+    return std::hash<uint64_t>()((hi ^ lo) * 0x9e3779b97f4a7c15ULL + key.port);
+}
+
+UdpServerEndpoint::PeerKey UdpServerEndpoint::_peer_key(const struct sockaddr_storage *addr)
+{
+    PeerKey key = {};
+
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+        memcpy(key.addr, &in6->sin6_addr, sizeof(key.addr));
+        key.port = in6->sin6_port;
+    } else {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+        memcpy(key.addr, &in->sin_addr, sizeof(in->sin_addr));
+        key.port = in->sin_port;
+    }
+
+    return key;
+}
+
+UdpPeer *UdpServerEndpoint::_get_peer(const struct sockaddr_storage *addr)
+{
+    const PeerKey key = _peer_key(addr);
+    auto it = _peers.find(key);
+
+    if (it != _peers.end())
+        return it->second.get();
+
+    if (_peers.size() >= UDP_SERVER_MAX_PEERS) {
+        _peer_stat.rejected++;
+        _rejected_peers++;
+        return nullptr;
+    }
+
+    UdpPeer *peer = new UdpPeer(this, addr);
+    _peers.emplace(key, std::unique_ptr<UdpPeer>(peer));
+    _peer_stat.peak = std::max<uint32_t>(_peer_stat.peak, _peers.size());
+
+    Mainloop::get_instance().add_route(peer);
+
+    /* On the thread of the server, which may not be the one that opened it */
+    if (!_expire_timeout) {
+        _expire_timeout = Mainloop::get_instance().add_timeout(
+            MSEC_PER_SEC, std::bind(&UdpServerEndpoint::_expire_peers_cb, this, std::placeholders::_1),
+            this);
+    }
+
+    log_debug("UDP server [%d] has a new peer, %zu in total", fd, _peers.size());
+
+    return peer;
+}
+
+int UdpServerEndpoint::handle_read()
+{
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    struct sockaddr_storage addrs[UDP_BATCH_MAX];
+    int r;
+
+#ifdef ENABLE_IO_URING
+    r = _read_ring();
+    if (r > 0)
+        _stat.read.reads++;
+    if (r != -ENOTSUP)
+        return r;
+#endif
+
+    if (!rx_buf.data) {
+        rx_buf.data = (uint8_t *)rx_buf_pool.alloc();
+        if (!rx_buf.data)
+            return -ENOMEM;
+    }
+
+    r = _recv_datagrams(rx_buf.data, RX_BUF_MAX_SIZE, msgs, iov, addrs);
+    if (r <= 0)
+        return r;
+
+    _stat.read.reads++;
+
+    for (int i = 0; i < r; i++)
+        _route_datagram((uint8_t *)iov[i].iov_base, msgs[i].msg_len, &addrs[i]);
 
     return r;
 }
 
+void UdpServerEndpoint::_route_datagram(uint8_t *data, size_t len,
+                                        const struct sockaddr_storage *addr)
+{
+    UdpPeer *peer = _get_peer(addr);
+
+    if (!peer)
+        return;
+
+    peer->last_rx_usec = now_usec();
+    peer->route_datagram(data, len);
+}
+
+void UdpServerEndpoint::add_pending(UdpPeer *peer)
+{
+    if (peer->_pending)
+        return;
+
+    peer->_pending = true;
+    _pending.push_back(peer);
+}
+
+void UdpServerEndpoint::_remove_pending(UdpPeer *peer)
+{
+    if (!peer->_pending)
+        return;
+
+    _pending.erase(std::find(_pending.begin(), _pending.end(), peer));
+    peer->_pending = false;
+}
+
+int UdpServerEndpoint::flush_batch()
+{
+    struct mmsghdr msgs[TX_IOV_MAX];
+    struct iovec iov[TX_IOV_MAX];
+    UdpPeer *peers[TX_IOV_MAX];
+
+    /*
+     * Messages of several peers are written with each sendmmsg(), in the
+     * order of each peer's queue
+     */
+    while (!_pending.empty()) {
+        int n = 0, r;
+
+        for (UdpPeer *peer : _pending) {
+            int m = peer->_tx_queue.fill_iovec(iov + n, TX_IOV_MAX - n);
+
+            for (int i = n; i < n + m; i++) {
+                peer->_set_msghdr(&msgs[i].msg_hdr, &iov[i], 1);
+                peers[i] = peer;
+            }
+
+            n += m;
+            if (n == TX_IOV_MAX)
+                break;
+        }
+
+        r = n ? ::sendmmsg(fd, msgs, n, 0) : 0;
+        if (r == -1 && errno == EAGAIN)
+            return -EAGAIN;
+
+        if (r == -1) {
+            if (errno != ECONNREFUSED && errno != ENETUNREACH)
+                log_error("Error sending udp packets (%m)");
+
+            /* Only this datagram is lost, try the next ones */
+            peers[0]->_tx_queue.consume(iov[0].iov_len);
+            peers[0]->_stat.write.dropped++;
+            peers[0]->_dropped_msgs++;
+            r = 0;
+        } else if (n > 0) {
+            _stat.write.writes++;
+            _stat.write.total += r;
+        }
+
+        for (int i = 0; i < r; i++) {
+            peers[i]->_stat.write.bytes += iov[i].iov_len;
+            peers[i]->_stat.write.total += peers[i]->_tx_queue.consume(iov[i].iov_len);
+        }
+
+        /* Done with peers whose queue is empty */
+        auto end = std::remove_if(_pending.begin(), _pending.end(), [](UdpPeer *peer) {
+            if (!peer->_tx_queue.empty())
+                return false;
+
+            peer->_pending = false;
+            peer->_tx_blocked = false;
+            peer->_tx_queue.release_ring();
+            return true;
+        });
+        _pending.erase(end, _pending.end());
+    }
+
+    return 0;
+}
+
+bool UdpServerEndpoint::handle_canwrite()
+{
+    return flush_batch() == -EAGAIN;
+}
+
+bool UdpServerEndpoint::_expire_peers_cb(void *data)
+{
+    const usec_t now = now_usec();
+
+    for (auto it = _peers.begin(); it != _peers.end();) {
+        UdpPeer *peer = it->second.get();
+
+        if (now - peer->last_rx_usec < _peer_timeout_usec) {
+            ++it;
+            continue;
+        }
+
+        log_debug("UDP server [%d] peer timed out", fd);
+        _remove_pending(peer);
+        _peer_stat.expired++;
+        it = _peers.erase(it);
+    }
+
+    return true;
+}
+
+void UdpServerEndpoint::log_aggregate(unsigned int interval_sec)
+{
+    if (_rejected_peers > 0) {
+        log_warning("Endpoint %s [%d]: %u datagrams from new peers rejected in the last %d "
+                    "seconds, already %u peers",
+                    _name, fd, _rejected_peers, interval_sec, UDP_SERVER_MAX_PEERS);
+        _rejected_peers = 0;
+    }
+
+    UdpEndpoint::log_aggregate(interval_sec);
+
+    for (auto &it : _peers)
+        it.second->log_aggregate(interval_sec);
+}
+
+void UdpServerEndpoint::print_statistics()
+{
+    printf("Endpoint %s [%d] {", _name, fd);
+    printf("\n\tPeers: %zu (peak %u, %u timed out, %u rejected)", _peers.size(),
+           _peer_stat.peak, _peer_stat.expired, _peer_stat.rejected);
+    printf("\n\tReads: %" PRIu64, _stat.read.reads);
+    printf("\n\tWrites: %" PRIu64 " (%.2f messages per write)", _stat.write.writes,
+           _stat.write.writes ? (double)_stat.write.total / _stat.write.writes : 0.0);
+    printf("\n}\n");
+
+    for (auto &it : _peers)
+        it.second->print_statistics();
+}
+
 TcpEndpoint::TcpEndpoint()
-    : Endpoint{"TCP"}
+    : Endpoint{"TCP", true}
 {
     bzero(&sockaddr, sizeof(sockaddr));
 #ifdef ENABLE_IPV6
@@ -942,6 +1925,17 @@ TcpEndpoint::~TcpEndpoint()
     free(_ip);
 }
 
+void *TcpEndpoint::operator new(size_t size) noexcept
+{
+    assert(size <= sizeof(TcpEndpoint));
+    return pool.alloc();
+}
+
+void TcpEndpoint::operator delete(void *p)
+{
+    pool.free(p);
+}
+
 int TcpEndpoint::accept(int listener_fd)
 {
     socklen_t addrlen = sizeof(sockaddr);
@@ -972,6 +1966,11 @@ int TcpEndpoint::accept(int listener_fd)
 
 int TcpEndpoint::open(const char *ip, unsigned long port)
 {
+    struct sockaddr *addr = (struct sockaddr *)&sockaddr;
+    socklen_t addrlen = sizeof(sockaddr);
+    usec_t start;
+    int r;
+
     if (!_ip || strcmp(ip, _ip)) {
         free(_ip);
         _ip = strdup(ip);
@@ -983,10 +1982,10 @@ int TcpEndpoint::open(const char *ip, unsigned long port)
 #ifdef ENABLE_IPV6
     this->is_ipv6 = Endpoint::is_ipv6(ip);
     if (this->is_ipv6) {
-        fd = socket(AF_INET6, SOCK_STREAM, 0);
+        fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
     } else {
 #endif
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
 #ifdef ENABLE_IPV6
     }
@@ -1019,6 +2018,9 @@ int TcpEndpoint::open(const char *ip, unsigned long port)
         }
 
         free(ip_str);
+
+        addr = (struct sockaddr *)&sockaddr6;
+        addrlen = sizeof(sockaddr6);
     } else {
 #endif
     sockaddr.sin_family = AF_INET;
@@ -1028,37 +2030,139 @@ int TcpEndpoint::open(const char *ip, unsigned long port)
     }
 #endif
 
-#ifdef ENABLE_IPV6
-    if (this->is_ipv6) {
-        if (connect(fd, (struct sockaddr *)&sockaddr6, sizeof(sockaddr6)) < 0) {
-            log_error("Error connecting to IPv6 socket (%m)");
-            goto fail;
-        }
-    } else {
-#endif
-    if (connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
+    _connect_stat.attempts++;
+    start = now_usec();
+    r = connect(fd, addr, addrlen);
+    _connect_stat.syscall_usec += now_usec() - start;
+
+    if (r < 0 && errno != EINPROGRESS) {
         log_error("Error connecting to socket (%m)");
         goto fail;
     }
-#ifdef ENABLE_IPV6
-    }
-#endif
 
-    if (fcntl(fd, F_SETFL, O_NONBLOCK | FASYNC) < 0) {
-        log_error("Error setting socket fd as non-blocking (%m)");
-        goto fail;
+    _valid = true;
+
+    if (r < 0) {
+        /* Messages are queued until the connection is established */
+        log_info("Connecting TCP [%d] %s:%lu", fd, ip, port);
+        _connecting = true;
+        _connect_start_usec = start;
+        _tx_blocked = true;
+        return fd;
     }
 
     log_info("Open TCP [%d] %s:%lu", fd, ip, port);
+    _retry_attempts = 0;
 
-    _valid = true;
     return fd;
 
 fail:
+    _connect_stat.failed++;
     ::close(fd);
+    fd = -1;
     return -1;
 }
 
+int TcpEndpoint::_finish_connect()
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    _connecting = false;
+    _connect_stat.usec += now_usec() - _connect_start_usec;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+    if (err) {
+        log_error("Error connecting to TCP %s:%lu (%s)", _ip, _port, strerror(err));
+        _connect_stat.failed++;
+        _valid = false;
+        return -err;
+    }
+
+    log_info("Open TCP [%d] %s:%lu", fd, _ip, _port);
+    _retry_attempts = 0;
+
+    return 0;
+}
+
+int TcpEndpoint::handle_read()
+{
+    int r;
+
+    /* A failed connection is reported as readable too */
+    if (_connecting && _finish_connect() < 0)
+        return -1;
+
+    r = Endpoint::handle_read();
+    if (r == -ENOMEM) {
+        log_error("Out of memory for TCP [%d], closing it", fd);
+        _valid = false;
+        return r;
+    }
+
+    /*
+     * There may be thousands of clients, most of them only listening: only
+     * hold buffers while they are in use
+     */
+    _release_rx_buf();
+
+    return r;
+}
+
+int TcpEndpoint::write_msg(const struct buffer *pbuf)
+{
+    int r = Endpoint::write_msg(pbuf);
+
+    if (_slow_consumer.action == Disconnect && _tx_blocked
+        && _tx_lag_usec() > _slow_consumer.timeout_sec * USEC_PER_SEC) {
+        log_warning("TCP [%d] %s:%lu is lagging more than %lus behind, disconnecting", fd,
+                    _ip ? _ip : "client", _port, _slow_consumer.timeout_sec);
+        _valid = false;
+        return -EPIPE;
+    }
+
+    return r;
+}
+
+bool TcpEndpoint::handle_canwrite()
+{
+    if (_connecting && _finish_connect() < 0)
+        return false;
+
+    if (Endpoint::handle_canwrite())
+        return true;
+
+    _tx_queue.release_ring();
+    return false;
+}
+
+uint32_t TcpEndpoint::next_retry_msec()
+{
+    static thread_local std::minstd_rand rng{(std::minstd_rand::result_type)now_usec()};
+    const uint64_t base = (uint64_t)retry_timeout * MSEC_PER_SEC;
+    uint64_t delay = std::max(base, (uint64_t)TCP_RETRY_MAX_MSEC);
+
+    if (_retry_attempts < 32 && (base << _retry_attempts) < delay) {
+        delay = base << _retry_attempts;
+        _retry_attempts++;
+    }
+
+    /* +-25% so that routers restarted together don't retry in lockstep */
+    return delay * 3 / 4 + rng() % (delay / 2 + 1);
+}
+
+void TcpEndpoint::_print_extra_statistics()
+{
+    printf("\n\tConnect {");
+    printf("\n\t\tAttempts: %u", _connect_stat.attempts);
+    printf("\n\t\tFailed: %u", _connect_stat.failed);
+    printf("\n\t\tBlocked: %" PRIu64 "us", _connect_stat.syscall_usec);
+    printf("\n\t\tTime to connect: %" PRIu64 "ms", _connect_stat.usec / USEC_PER_MSEC);
+    printf("\n\t}");
+}
+
 ssize_t TcpEndpoint::_read_msg(uint8_t *buf, size_t len)
 {
     socklen_t addrlen = sizeof(sockaddr);
@@ -1089,58 +2193,615 @@ ssize_t TcpEndpoint::_read_msg(uint8_t *buf, size_t len)
     return r;
 }
 
-int TcpEndpoint::write_msg(const struct buffer *pbuf)
+ssize_t TcpEndpoint::_write_msg(const struct iovec *iov, int iovcnt)
 {
-    if (fd < 0) {
-        log_error("Trying to write invalid fd");
-        return -EINVAL;
+    ssize_t r = ::writev(fd, iov, iovcnt);
+    if (r == -1) {
+        int err = errno;
+        if (err != EAGAIN && err != ECONNREFUSED)
+            log_error("Error sending tcp packet (%m)");
+        if (err == EPIPE)
+            _valid = false;
+        return -err;
     }
 
-    /* TODO: send any pending data */
-    if (tx_buf.len > 0) {
-        ;
+    log_debug("TCP [%d] wrote %zd bytes", fd, r);
+
+    return r;
+}
+
+void TcpEndpoint::close()
+{
+    if (fd > -1) {
+        ::close(fd);
+
+        log_info("TCP Connection [%d] closed", fd);
     }
 
-    ssize_t r = 0;
-#ifdef ENABLE_IPV6
-    if (this->is_ipv6) {
-        r = ::sendto(fd, pbuf->data, pbuf->len, 0, (struct sockaddr *)&sockaddr6, sizeof(sockaddr6));
-    } else {
-#endif
-    r = ::sendto(fd, pbuf->data, pbuf->len, 0, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-#ifdef ENABLE_IPV6
+    fd = -1;
+    _connecting = false;
+
+    /* Partially written or read messages make no sense on a new connection */
+    _tx_queue.clear();
+    _tx_queue.release_ring();
+    _tx_blocked = false;
+    _rx_offset = rx_buf.len;
+    _release_rx_buf();
+}
+
+UnixClient::UnixClient(UnixEndpoint *server, int client_fd)
+    : Endpoint{"Unix client", true}
+    , _server{server}
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    fd = client_fd;
+    _datagram = true;
+    _inherit_settings(*server);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        _pid = cred.pid;
+        _uid = cred.uid;
     }
-#endif
+}
+
+int UnixClient::start()
+{
+    return Mainloop::get_instance().add_fd(fd, this, EPOLLIN);
+}
+
+void UnixClient::stop()
+{
+    Mainloop::get_instance().remove_fd(fd);
+}
+
+void UnixClient::_hangup(int err)
+{
+    if (_hung_up)
+        return;
+
+    if (err)
+        log_info("Unix client [%d] pid %d disconnected (%s)", fd, (int)_pid, strerror(err));
+    else
+        log_info("Unix client [%d] pid %d disconnected", fd, (int)_pid);
+
+    _hung_up = true;
+    _server->hangup(this);
+}
+
+int UnixClient::handle_read()
+{
+    int r;
+
+    if (_hung_up)
+        return 0;
+
+    r = Endpoint::handle_read();
+
+    /* Like TCP clients, most of them only listen */
+    _release_rx_buf();
+
+    return r;
+}
+
+int UnixClient::write_msg(const struct buffer *pbuf)
+{
+    if (_hung_up)
+        return -EPIPE;
+
+    int r = Endpoint::write_msg(pbuf);
+
+    if (_slow_consumer.action == Disconnect && _tx_blocked
+        && _tx_lag_usec() > _slow_consumer.timeout_sec * USEC_PER_SEC) {
+        log_warning("Unix client [%d] pid %d is lagging more than %lus behind, disconnecting", fd,
+                    (int)_pid, _slow_consumer.timeout_sec);
+        _hangup(0);
+        return -EPIPE;
+    }
+
+    return r;
+}
+
+ssize_t UnixClient::_read_msg(uint8_t *buf, size_t len)
+{
+    /* With MSG_TRUNC, the length of the whole record even if it didn't fit */
+    ssize_t r = ::recv(fd, buf, len, MSG_TRUNC);
+
+    if (r == -1 && errno == EAGAIN)
+        return 0;
 
     if (r == -1) {
-        if (errno != EAGAIN && errno != ECONNREFUSED)
-            log_error("Error sending tcp packet (%m)");
-        if (errno == EPIPE)
-            _valid = false;
-        return -errno;
-    };
+        int err = errno;
+        _hangup(err);
+        return -err;
+    }
 
-    _stat.write.total++;
-    _stat.write.bytes += pbuf->len;
+    /* A read of zero means the client closed the connection */
+    if (r == 0) {
+        _hangup(0);
+        return -EPIPE;
+    }
 
-    /* Incomplete packet, we warn and discard the rest */
-    if (r != (ssize_t) pbuf->len) {
-        _incomplete_msgs++;
-        log_debug("Discarding packet, incomplete write %zd but len=%u", r, pbuf->len);
+    if ((size_t)r > len) {
+        _truncated_records++;
+        r = len;
     }
 
-    log_debug("TCP [%d] wrote %zd bytes", fd, r);
+    return r;
+}
+
+ssize_t UnixClient::_write_msg(const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {};
+
+    if (_hung_up)
+        return -EPIPE;
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t r = ::sendmsg(fd, &msg, 0);
+    if (r == -1) {
+        int err = errno;
+        if (err == EPIPE || err == ECONNRESET)
+            _hangup(err);
+        else if (err != EAGAIN)
+            log_error("Error sending to Unix client [%d] (%m)", fd);
+        return -err;
+    }
+
+    log_debug("Unix [%d] wrote %zd bytes", fd, r);
 
     return r;
 }
 
-void TcpEndpoint::close()
+int UnixClient::_write_datagrams(const struct iovec *iov, int n)
 {
-    if (fd > -1) {
-        ::close(fd);
+    struct mmsghdr msgs[TX_IOV_MAX] = {};
 
-        log_info("TCP Connection [%d] closed", fd);
+    if (_hung_up)
+        return -EPIPE;
+
+    n = std::min(n, (int)TX_IOV_MAX);
+    for (int i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)&iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
+    int r = ::sendmmsg(fd, msgs, n, 0);
+    if (r == -1) {
+        int err = errno;
+        if (err == EPIPE || err == ECONNRESET)
+            _hangup(err);
+        else if (err != EAGAIN)
+            log_error("Error sending to Unix client [%d] (%m)", fd);
+        return -err;
+    }
+    if (r == 0)
+        return -EAGAIN;
+
+    log_debug("Unix [%d] wrote %d records", fd, r);
+
+    return r;
+}
+
+void UnixClient::log_aggregate(unsigned int interval_sec)
+{
+    if (_truncated_records > 0) {
+        log_warning("Endpoint %s [%d]: %u records truncated in the last %d seconds", _name, fd,
+                    _truncated_records, interval_sec);
+        _truncated_records = 0;
+    }
+
+    Endpoint::log_aggregate(interval_sec);
+}
+
+void UnixClient::_print_extra_statistics()
+{
+    printf("\n\tClient: pid %d, uid %u", (int)_pid, (unsigned)_uid);
+}
+
+UnixEndpoint::~UnixEndpoint()
+{
+    if (_path) {
+        unlink(_path);
+        free(_path);
+    }
+}
+
+int UnixEndpoint::open(const char *path)
+{
+    struct sockaddr_un addr = {};
+    const size_t len = strlen(path);
+    socklen_t addrlen = sizeof(addr);
+    struct stat st;
+
+    if (len < 2 || len >= sizeof(addr.sun_path)) {
+        log_error("Invalid Unix socket path '%s'", path);
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+
+    if (path[0] == '@') {
+        /* Abstract: the name is exactly the bytes after the leading '\0' */
+        addr.sun_path[0] = '\0';
+        addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    } else if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        /* Left behind by a previous run, anything else is kept */
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error("Could not create Unix socket (%m)");
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+        log_error("Error binding Unix socket %s (%m)", path);
+        goto fail;
+    }
+
+    if (path[0] != '@') {
+        _path = strdup(path);
+        if (!_path) {
+            unlink(path);
+            goto fail;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        log_error("Error listening on Unix socket %s (%m)", path);
+        goto fail;
+    }
+
+    log_info("Open %s [%d] %s", _name, fd, path);
+
+    return fd;
+
+fail:
+    ::close(fd);
     fd = -1;
+    return -1;
+}
+
+UnixClient *UnixEndpoint::_new_client(int client_fd)
+{
+    return new UnixClient{this, client_fd};
+}
+
+int UnixEndpoint::_accept()
+{
+    int client_fd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (client_fd == -1) {
+        int err = errno;
+        if (err != EAGAIN)
+            log_error("Could not accept Unix client (%m)");
+        return -err;
+    }
+
+    if (_clients.size() >= UNIX_MAX_CLIENTS) {
+        ::close(client_fd);
+        _client_stat.rejected++;
+        _rejected_clients++;
+        return 0;
+    }
+
+    /* On the thread of the endpoint, like its clients */
+    std::unique_ptr<UnixClient> client{_new_client(client_fd)};
+    if (client->start() < 0)
+        return -EIO;
+
+    Mainloop::get_instance().add_route(client.get());
+
+    log_info("Unix client [%d] pid %d connected", client_fd, (int)client->_pid);
+
+    _clients.push_back(std::move(client));
+    _client_stat.accepted++;
+    _client_stat.peak = std::max<uint32_t>(_client_stat.peak, _clients.size());
+
+    return 0;
+}
+
+int UnixEndpoint::handle_read()
+{
+    int r = 0;
+
+    for (unsigned i = 0; i < UNIX_ACCEPT_MAX && r == 0; i++)
+        r = _accept();
+
+    return r == -EAGAIN ? 0 : r;
+}
+
+int UnixEndpoint::flush_batch()
+{
+    for (UnixClient *client : _hangups) {
+        auto it = std::find_if(_clients.begin(), _clients.end(),
+                               [client](const std::unique_ptr<UnixClient> &c) {
+                                   return c.get() == client;
+                               });
+
+        client->stop();
+        /* Closes the socket and removes the client from the routing table */
+        _clients.erase(it);
+    }
+
+    _hangups.clear();
+
+    return 0;
+}
+
+void UnixEndpoint::log_aggregate(unsigned int interval_sec)
+{
+    if (_rejected_clients > 0) {
+        log_warning("Endpoint %s [%d]: %u clients rejected in the last %d seconds, already %u "
+                    "clients",
+                    _name, fd, _rejected_clients, interval_sec, UNIX_MAX_CLIENTS);
+        _rejected_clients = 0;
+    }
+
+    for (auto &client : _clients)
+        client->log_aggregate(interval_sec);
+}
+
+void UnixEndpoint::print_statistics()
+{
+    printf("Endpoint %s [%d] {", _name, fd);
+    printf("\n\tClients: %zu (peak %u, %u accepted, %u rejected)", _clients.size(),
+           _client_stat.peak, _client_stat.accepted, _client_stat.rejected);
+    printf("\n}\n");
+
+    for (auto &client : _clients)
+        client->print_statistics();
+}
+
+ShmClient::ShmClient(ShmEndpoint *server, int client_fd, uint32_t ring_size)
+    : UnixClient{server, client_fd}
+    , _shm_server{server}
+    , _ring_size{ring_size}
+{
+}
+
+ShmClient::~ShmClient()
+{
+    if (_region)
+        munmap(_region, shm_region_size(_ring_size));
+
+    if (_client_doorbell_fd > -1)
+        ::close(_client_doorbell_fd);
+}
+
+int ShmClient::start()
+{
+    const size_t size = shm_region_size(_ring_size);
+    struct shm_header hello = {};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control = {};
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    int fds[3];
+    int memfd;
+
+    memfd = memfd_create("mavlink-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        log_error("Could not create shared memory for client [%d] (%m)", fd);
+        return -1;
+    }
+
+    /* The client can't make us fault by shrinking it */
+    if (ftruncate(memfd, size) < 0
+        || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        log_error("Could not set up shared memory for client [%d] (%m)", fd);
+        goto fail;
+    }
+
+    _region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (_region == MAP_FAILED) {
+        log_error("Could not map shared memory for client [%d] (%m)", fd);
+        _region = nullptr;
+        goto fail;
+    }
+
+    shm_region_init(_region, _ring_size);
+    shm_ring_attach(&_tx, _region, _ring_size, SHM_TO_CLIENT, true);
+    shm_ring_attach(&_rx, _region, _ring_size, SHM_TO_ROUTER, false);
+    shm_ring_arm(&_rx);
+
+    _doorbell.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _client_doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_doorbell.fd < 0 || _client_doorbell_fd < 0) {
+        log_error("Could not create doorbells for client [%d] (%m)", fd);
+        goto fail;
+    }
+
+    /* The region, the doorbell the client waits on and the one it rings */
+    fds[0] = memfd;
+    fds[1] = _client_doorbell_fd;
+    fds[2] = _doorbell.fd;
+    memcpy(&hello, _region, sizeof(hello));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (::sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        log_error("Could not send shared memory to client [%d] (%m)", fd);
+        goto fail;
+    }
+
+    ::close(memfd);
+
+    if (UnixClient::start() < 0)
+        return -1;
+
+    if (Mainloop::get_instance().add_fd(_doorbell.fd, &_doorbell, EPOLLIN) < 0) {
+        UnixClient::stop();
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    ::close(memfd);
+    return -1;
+}
+
+void ShmClient::stop()
+{
+    Mainloop::get_instance().remove_fd(_doorbell.fd);
+    UnixClient::stop();
+}
+
+int ShmClient::handle_read()
+{
+    uint8_t buf[64];
+
+    /* Nothing is expected on the socket, it's only read to notice hangups */
+    ssize_t r = ::recv(fd, buf, sizeof(buf), 0);
+    if (r == -1 && errno == EAGAIN)
+        return 0;
+
+    if (r <= 0)
+        _hangup(r == 0 ? 0 : errno);
+
+    return 0;
+}
+
+void ShmClient::_corrupted()
+{
+    log_error("Shared memory of Unix client [%d] pid %d is corrupted, disconnecting", fd,
+              (int)_pid);
+    _hangup(EBADMSG);
+}
+
+int ShmClient::write_msg(const struct buffer *pbuf)
+{
+    if (_hung_up)
+        return -EPIPE;
+
+    int r = shm_ring_push(&_tx, pbuf->data, pbuf->len);
+    if (r == -EBADMSG) {
+        _corrupted();
+        return -EPIPE;
+    }
+
+    if (r < 0) {
+        _stat.write.dropped++;
+        _dropped_msgs++;
+        return r;
+    }
+
+    _stat.write.total++;
+    _stat.write.bytes += pbuf->len;
+
+    _tx_pushed = true;
+    _shm_server->add_pending(this);
+
+    return pbuf->len;
+}
+
+int ShmClient::_read_ring()
+{
+    uint8_t record[SHM_RECORD_MAX];
+    const uint8_t *data;
+    size_t len;
+    uint64_t n;
+    int r = 0;
+
+    if (::read(_doorbell.fd, &n, sizeof(n)) == sizeof(n))
+        _doorbell_stat.received += n;
+
+    if (_hung_up)
+        return 0;
+
+    /* No need for doorbells while reading, see ShmEndpoint::flush_batch() */
+    shm_ring_disarm(&_rx);
+    _rx_disarmed = true;
+    _shm_server->add_pending(this);
+
+    for (unsigned i = 0; i < SHM_RX_MAX && (r = shm_ring_peek(&_rx, &data, &len)) > 0; i++) {
+        /*
+         * Copied before parsing since the client could change it meanwhile,
+         * messages don't span records
+         */
+        memcpy(record, data, len);
+        rx_buf.data = record;
+        rx_buf.len = len;
+        _rx_offset = 0;
+        _stat.read.reads++;
+
+        _route_msgs();
+        shm_ring_consume(&_rx);
+    }
+
+    rx_buf.data = nullptr;
+    rx_buf.len = 0;
+    _rx_offset = 0;
+
+    if (r < 0)
+        _corrupted();
+
+    return 0;
+}
+
+void ShmClient::_print_extra_statistics()
+{
+    UnixClient::_print_extra_statistics();
+    printf("\n\tShared memory: %u bytes per ring, %u doorbells rung, %u received", _ring_size,
+           _doorbell_stat.rung, _doorbell_stat.received);
+}
+
+UnixClient *ShmEndpoint::_new_client(int client_fd)
+{
+    return new ShmClient{this, client_fd, _ring_size};
+}
+
+void ShmEndpoint::add_pending(ShmClient *client)
+{
+    if (client->_pending)
+        return;
+
+    client->_pending = true;
+    _pending.push_back(client);
+}
+
+int ShmEndpoint::flush_batch()
+{
+    const uint64_t one = 1;
+
+    for (ShmClient *client : _pending) {
+        /* Only if the client sleeps, see shm_ring_arm() */
+        if (client->_tx_pushed && !client->_hung_up && shm_ring_needs_wakeup(&client->_tx)) {
+            if (::write(client->_client_doorbell_fd, &one, sizeof(one)) == sizeof(one))
+                client->_doorbell_stat.rung++;
+        }
+
+        /* Written to since we last read it: ring our own doorbell to read it again */
+        if (client->_rx_disarmed && !client->_hung_up && !shm_ring_arm(&client->_rx)) {
+            if (::write(client->_doorbell.fd, &one, sizeof(one)) < 0)
+                log_error("Could not ring doorbell of Unix client [%d] (%m)", client->fd);
+        }
+
+        client->_pending = false;
+        client->_tx_pushed = false;
+        client->_rx_disarmed = false;
+    }
+
+    _pending.clear();
+
+    /* Remove clients that hung up */
+    return UnixEndpoint::flush_batch();
 }
@@ -18,15 +18,79 @@
 #pragma once
 
 #include <common/mavlink.h>
+#include <common/shm_ring.h>
+#include <common/util.h>
 
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <array>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "comm.h"
+#include "dedup.h"
+#include "egress.h"
 #include "pollable.h"
+#include "pool.h"
+#include "rate_limit.h"
 #include "timeout.h"
+#include "txqueue.h"
+
+class UringPoller;
+
+/* Maximum number of datagrams sent or received with a single syscall */
+#define UDP_BATCH_MAX 64
+
+/* Peers of a UDP server, see UdpServerEndpoint */
+#define UDP_SERVER_MAX_PEERS 1024
+#define UDP_PEER_DEFAULT_TIMEOUT_SEC 10
+
+/* Clients of a Unix socket endpoint, see UnixEndpoint */
+#define UNIX_MAX_CLIENTS 256
+
+/* Upper bound of the exponential backoff between TCP reconnection attempts */
+#define TCP_RETRY_MAX_MSEC (60 * MSEC_PER_SEC)
+
+/* Default size of the transmit queue, which also holds at most 256 messages */
+#define TX_QUEUE_DEFAULT_MAX_BYTES (8U * 1024U)
+#define SLOW_CONSUMER_DEFAULT_TIMEOUT_SEC 5
+
+/*
+ * What to do when an endpoint doesn't keep up and its transmit queue is full
+ */
+enum slow_consumer_action {
+    DropNewest,
+    DropOldest,
+    /* Drop the oldest message not in the high priority list, see endpoint.cpp */
+    DropLowPriority,
+    /* Drop new messages and disconnect once the oldest queued one is too old */
+    Disconnect,
+};
+
+struct slow_consumer_policy {
+    enum slow_consumer_action action;
+    unsigned long queue_max_bytes;
+    unsigned long timeout_sec;
+};
+
+/* Settings of a UdpEndpoint whose address is a multicast group */
+struct udp_multicast {
+    /* Number of hops sent datagrams may take */
+    unsigned long ttl;
+    /* Whether sent datagrams are also delivered to receivers on this host */
+    bool loop;
+    /* Interface to send from and join the group on, chosen by routing if empty */
+    char interface[IF_NAMESIZE];
+};
+
+#define UDP_MULTICAST_DEFAULT {1, true, ""}
 
 class Mainloop;
+class RoutingTable;
 
 /*
  * mavlink 2.0 packet in its wire format
@@ -65,6 +129,62 @@ struct _packed_ mavlink_router_mavlink1_header {
     uint8_t msgid;
 };
 
+/*
+ * Set of sysid/compid pairs an endpoint has seen.
+ *
+ * Membership is a bit test on a 256-bit map of sysids plus, for each known
+ * sysid, a 256-bit map of its compids. Compid maps are only allocated for
+ * known sysids and kept sorted, so the map for a sysid is at the position
+ * given by the number of known sysids below it.
+ */
+class SysCompIdSet {
+public:
+    bool has(uint8_t sysid) const { return _sysids[sysid / 64] & (1ULL << (sysid % 64)); }
+    bool has(uint8_t sysid, uint8_t compid) const
+    {
+        if (!has(sysid))
+            return false;
+
+        const auto &compids = _compids[_rank(sysid)];
+        return compids[compid / 64] & (1ULL << (compid % 64));
+    }
+
+    /*
+     * Return true if the pair was added, false if it was already there
+     */
+    bool add(uint8_t sysid, uint8_t compid);
+
+    /*
+     * Call @func with each sys_comp_id (sysid << 8 | compid) in the set
+     */
+    template<typename Func>
+    void for_each(Func func) const;
+
+private:
+    unsigned _rank(uint8_t sysid) const;
+
+    uint64_t _sysids[4] = {};
+    std::vector<std::array<uint64_t, 4>> _compids;
+};
+
+template<typename Func>
+void SysCompIdSet::for_each(Func func) const
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < 4; i++) {
+        for (uint64_t sysids = _sysids[i]; sysids; sysids &= sysids - 1) {
+            const unsigned sysid = i * 64 + __builtin_ctzll(sysids);
+            const auto &compids = _compids[n++];
+
+            for (unsigned j = 0; j < 4; j++) {
+                for (uint64_t w = compids[j]; w; w &= w - 1)
+                    func((uint16_t)(sysid << 8 | (j * 64 + __builtin_ctzll(w))));
+            }
+        }
+    }
+}
+
 class Endpoint : public Pollable {
 public:
     /*
@@ -75,40 +195,155 @@ public:
         ReadUnkownMsg,
     };
 
-    Endpoint(const char *name);
+    /*
+     * If @lazy_rx_buf is true, rx_buf is only allocated when there's
+     * something to read
+     */
+    Endpoint(const char *name, bool lazy_rx_buf = false);
     virtual ~Endpoint();
 
     int handle_read() override;
     bool handle_canwrite() override;
 
     virtual void print_statistics();
-    virtual int write_msg(const struct buffer *pbuf) = 0;
-    virtual int flush_pending_msgs() = 0;
 
-    void log_aggregate(unsigned int interval_sec);
+    /*
+     * Write @pbuf or, if the endpoint can't take it right now, add it to the
+     * transmit queue. Returns the number of bytes written, 0 if the message
+     * was queued after other pending ones, -EAGAIN if the endpoint just became
+     * blocked (caller should wait for EPOLLOUT and call flush_pending_msgs())
+     * or another negative errno on error.
+     */
+    virtual int write_msg(const struct buffer *pbuf);
+
+    /*
+     * Write as much as possible from the transmit queue. Returns -EAGAIN if
+     * there's still data pending.
+     */
+    virtual int flush_pending_msgs();
+
+    /*
+     * Write messages batched so far, called before the mainloop waits for
+     * new events. Returns -EAGAIN if the endpoint just became blocked, like
+     * write_msg().
+     */
+    virtual int flush_batch();
+
+    /*
+     * Batch up to @size messages, written together when the batch is full,
+     * when the oldest message waited for @max_latency_usec (if not 0) or at
+     * the end of the mainloop iteration. Only used by endpoints that can
+     * write many messages at once.
+     */
+    void set_batch(unsigned size, uint32_t max_latency_usec)
+    {
+        _batch_size = size;
+        _batch_max_latency_usec = max_latency_usec;
+    }
+
+    virtual void log_aggregate(unsigned int interval_sec);
+
+#ifdef ENABLE_IO_URING
+    /*
+     * Have @uring receive what comes to the endpoint, instead of polling it
+     * for EPOLLIN. Returns false if it can't.
+     */
+    virtual bool receive_from(UringPoller &uring) { return false; }
+#endif
 
     uint8_t get_trimmed_zeros(const mavlink_msg_entry_t *msg_entry, const struct buffer *buffer);
 
-    bool has_sys_id(unsigned sysid);
-    bool has_sys_comp_id(unsigned sys_comp_id);
-    bool has_sys_comp_id(unsigned sysid, unsigned compid) {
-        uint16_t sys_comp_id = ((sysid & 0xff) << 8) | (compid & 0xff);
-        return has_sys_comp_id(sys_comp_id);
+    bool has_sys_id(unsigned sysid) { return _sys_comp_ids.has(sysid & 0xff); }
+    bool has_sys_comp_id(unsigned sys_comp_id)
+    {
+        return _sys_comp_ids.has((sys_comp_id >> 8) & 0xff, sys_comp_id & 0xff);
+    }
+    bool has_sys_comp_id(unsigned sysid, unsigned compid)
+    {
+        return _sys_comp_ids.has(sysid & 0xff, compid & 0xff);
     }
 
     bool accept_msg(int target_sysid, int target_compid, uint8_t src_sysid, uint8_t src_compid, uint32_t msg_id);
+    bool accept_msg_id(uint32_t msg_id);
+
+    /*
+     * Return false if the message is over its rate limit and shouldn't be
+     * written, see set_rate_limiter()
+     */
+    bool accept_msg_rate(uint32_t msg_id, uint8_t src_sysid, uint8_t src_compid)
+    {
+        return !_rate_limiter.enabled()
+            || _rate_limiter.allow(msg_id, src_sysid, src_compid, now_usec());
+    }
 
     void add_message_to_filter(uint32_t msg_id) { _message_filter.push_back(msg_id); }
 
+    void set_slow_consumer_policy(const struct slow_consumer_policy &policy)
+    {
+        _slow_consumer = policy;
+        _tx_queue.set_max_bytes(policy.queue_max_bytes);
+    }
+
+    /*
+     * Write queued messages by priority class instead of in arrival order,
+     * see EgressScheduler
+     */
+    void set_egress_scheduler(const EgressScheduler &egress) { _egress = egress; }
+
+    void set_rate_limiter(const RateLimiter &rate_limiter) { _rate_limiter = rate_limiter; }
+
+    /*
+     * Only route messages not already received by another endpoint of
+     * @group, see DedupGroup
+     */
+    void set_dedup_group(DedupGroup *group) { _dedup_group = group; }
+
+    /*
+     * Messages from a trusted source have their CRC check skipped: only
+     * their length is verified
+     */
+    void set_trusted_source(bool trusted) { _trusted_source = trusted; }
+
     struct buffer rx_buf;
-    struct buffer tx_buf;
+
+    /* Buffers of all endpoints, see Mainloop::_reserve_pools() */
+    static Pool rx_buf_pool;
+    static Pool tx_ring_pool;
 
 protected:
     virtual int read_msg(struct buffer *pbuf, int *target_system, int *target_compid,
                          uint8_t *src_sysid, uint8_t *src_compid, uint32_t *msg_id);
     virtual ssize_t _read_msg(uint8_t *buf, size_t len) = 0;
-    bool _check_crc(const mavlink_msg_entry_t *msg_entry);
+    /*
+     * Write @iovcnt buffers with a single syscall. Returns the number of
+     * bytes written or negative errno
+     */
+    virtual ssize_t _write_msg(const struct iovec *iov, int iovcnt) { return -ENOSYS; }
+    /*
+     * Write @n datagrams, one per iovec. Returns how many were written or
+     * negative errno
+     */
+    virtual int _write_datagrams(const struct iovec *iov, int n) { return -ENOSYS; }
+    int _fill_rx_buf();
+    /* Route the complete messages in rx_buf. Returns like read_msg() */
+    int _route_msgs();
+    /* Give rx_buf back to its pool if it holds no incomplete message */
+    void _release_rx_buf();
+    bool _queue_msg(const struct buffer *pbuf, unsigned offset);
+    bool _make_room(uint64_t rank);
+    /*
+     * Age of the next message to be written: the oldest one in the transmit
+     * queue, unless an egress scheduler put another one first
+     */
+    usec_t _tx_lag_usec();
+    int _batch_msg(const struct buffer *pbuf);
+    bool _check_msg(const mavlink_msg_entry_t *msg_entry, const struct buffer *frame);
+    bool _check_crc(const mavlink_msg_entry_t *msg_entry, const struct buffer *frame);
     void _add_sys_comp_id(uint16_t sys_comp_id);
+    /* Take the filter, egress, rate limits, etc. of @e */
+    void _inherit_settings(const Endpoint &e);
+    /* Statistics specific to the kind of endpoint, printed at the end of its block */
+    virtual void _print_extra_statistics() { }
 
 #ifdef ENABLE_IPV6
     static bool is_ipv6(const char *ip);
@@ -118,30 +353,80 @@ protected:
 #endif
 
     const char *_name;
-    size_t _last_packet_len = 0;
+
+    /* Position in rx_buf of the first byte not parsed yet */
+    size_t _rx_offset = 0;
+    /* Skipping bytes since a CRC error, until the next valid message */
+    bool _rx_resyncing = false;
+    /*
+     * Skipped garbage or a message with a bad CRC: until the next valid
+     * message, unknown messages are only trusted if followed by a magic byte
+     */
+    bool _rx_lost_sync = false;
 
     // Statistics
     struct {
         struct {
             uint64_t crc_error_bytes = 0;
             uint64_t handled_bytes = 0;
+            uint64_t reads = 0;
             uint32_t total = 0; // handled + crc error + seq lost
             uint32_t crc_error = 0;
+            uint32_t crc_skipped = 0;
             uint32_t handled = 0;
             uint32_t drop_seq_total = 0;
+            /* Received here before any other endpoint of the dedup group */
+            uint32_t dedup_first = 0;
+            uint32_t dedup_duplicate = 0;
+            /* Already routed, coming back through other routers, see LoopCache */
+            uint32_t loops = 0;
             uint8_t expected_seq = 0;
         } read;
         struct {
             uint64_t bytes = 0;
+            uint64_t writes = 0;
             uint32_t total = 0;
+            uint32_t queued = 0;
+            uint32_t dropped = 0;
+            /* Dropped from the queue to make room for new messages */
+            uint32_t evicted = 0;
+            /* Replaced in the queue by a newer one, see EgressScheduler */
+            uint32_t coalesced = 0;
+            size_t queue_peak_bytes = 0;
+            usec_t lag_max_usec = 0;
         } write;
     } _stat;
 
-    uint32_t _incomplete_msgs = 0;
-    std::vector<uint16_t> _sys_comp_ids;
+    uint32_t _dropped_msgs = 0;
+    SysCompIdSet _sys_comp_ids;
+    bool _trusted_source = false;
+
+    /*
+     * Messages that couldn't be written yet. On datagram endpoints each
+     * message is written on its own, otherwise as many as possible are
+     * written at once
+     */
+    TxQueue _tx_queue;
+    struct slow_consumer_policy _slow_consumer = {DropNewest, TX_QUEUE_DEFAULT_MAX_BYTES,
+                                                   SLOW_CONSUMER_DEFAULT_TIMEOUT_SEC};
+    EgressScheduler _egress;
+    RateLimiter _rate_limiter;
+    DedupGroup *_dedup_group = nullptr;
+    bool _datagram = false;
+    /* Waiting for EPOLLOUT: everything goes to the queue */
+    bool _tx_blocked = false;
+
+    unsigned _batch_size = 1;
+    uint32_t _batch_max_latency_usec = 0;
+    usec_t _batch_start_usec = 0;
 
 private:
+    friend class RoutingTable;
+
     std::vector<uint32_t> _message_filter;
+
+    RoutingTable *_routing_table = nullptr;
+    unsigned _routing_slot = 0;
 };
 
 class UartEndpoint : public Endpoint {
@@ -151,18 +436,17 @@ public:
     {
     }
     virtual ~UartEndpoint();
-    int write_msg(const struct buffer *pbuf) override;
-    int flush_pending_msgs() override { return -ENOSYS; }
-
     int open(const char *path);
     int set_speed(speed_t baudrate);
     int set_flow_control(bool enabled);
-    int add_speeds(std::vector<unsigned long> baudrates);
+    /* Try @baudrates in turn until one responds, from the Mainloop the endpoint goes to */
+    int add_speeds(std::vector<unsigned long> baudrates, Mainloop &mainloop);
 
 protected:
     int read_msg(struct buffer *pbuf, int *target_system, int *target_compid, uint8_t *src_sysid,
                  uint8_t *src_compid, uint32_t *msg_id) override;
     ssize_t _read_msg(uint8_t *buf, size_t len) override;
+    ssize_t _write_msg(const struct iovec *iov, int iovcnt) override;
 
 private:
     size_t _current_baud_idx = 0;
@@ -174,13 +458,25 @@ private:
 
 class UdpEndpoint : public Endpoint {
 public:
-    UdpEndpoint();
+    UdpEndpoint(const char *name = "UDP", bool lazy_rx_buf = false);
     virtual ~UdpEndpoint() { }
 
+    int handle_read() override;
     int write_msg(const struct buffer *pbuf) override;
-    int flush_pending_msgs() override { return -ENOSYS; }
+    void log_aggregate(unsigned int interval_sec) override;
+#ifdef ENABLE_IO_URING
+    bool receive_from(UringPoller &uring) override;
+#endif
 
-    int open(const char *ip, unsigned long port, bool bind = false);
+    /* Route the messages of a datagram received by the endpoint */
+    void route_datagram(uint8_t *data, size_t len);
+
+    /*
+     * If @ip is a multicast group, messages are sent to the whole group, or
+     * the group is joined when binding, following @multicast.
+     */
+    int open(const char *ip, unsigned long port, bool bind = false,
+             const struct udp_multicast *multicast = nullptr);
 
     struct sockaddr_in sockaddr;
 #ifdef ENABLE_IPV6
@@ -190,6 +486,128 @@ public:
 
 protected:
     ssize_t _read_msg(uint8_t *buf, size_t len) override;
+    ssize_t _write_msg(const struct iovec *iov, int iovcnt) override;
+    int _write_datagrams(const struct iovec *iov, int n) override;
+    /*
+     * Receive up to BatchSize datagrams in @buf, with their sender in @addrs.
+     * Returns how many or negative errno, 0 if there was none
+     */
+    int _recv_datagrams(uint8_t *buf, size_t len, struct mmsghdr *msgs, struct iovec *iov,
+                        struct sockaddr_storage *addrs);
+
+    void _set_msghdr(struct msghdr *msg, const struct iovec *iov, int iovcnt);
+    /* Reply to @addr, unless writing to a multicast group */
+    void _set_reply_addr(const struct sockaddr_storage *addr);
+    /* Route a datagram @addr sent us */
+    virtual void _route_datagram(uint8_t *data, size_t len, const struct sockaddr_storage *addr);
+
+#ifdef ENABLE_IO_URING
+    /*
+     * Route the datagrams received by the ring, if it receives for this
+     * endpoint. Returns -ENOTSUP if it doesn't, the socket must be read then.
+     */
+    int _read_ring();
+
+    UringPoller *_uring_rx = nullptr;
+#endif
+
+    uint32_t _truncated_datagrams = 0;
+
+private:
+    int _setup_multicast(bool to_bind, const struct udp_multicast *multicast);
+
+    /* Sending to a multicast group, which replies must not replace */
+    bool _multicast_tx = false;
+};
+
+class UdpServerEndpoint;
+
+/*
+ * A peer of a UDP server, routed like an endpoint of its own: it has its own
+ * sysid/compids, transmit queue and statistics, but shares the socket of the
+ * server, which reads for it and writes its queued messages.
+ */
+class UdpPeer : public UdpEndpoint {
+public:
+    UdpPeer(UdpServerEndpoint *server, const struct sockaddr_storage *addr);
+    ~UdpPeer();
+
+    int write_msg(const struct buffer *pbuf) override;
+
+    usec_t last_rx_usec = 0;
+
+protected:
+    void _print_extra_statistics() override;
+
+private:
+    friend class UdpServerEndpoint;
+
+    UdpServerEndpoint *_server;
+    /* In the server's list of peers with messages to write */
+    bool _pending = false;
+};
+
+/*
+ * UDP endpoint serving many peers on the same port, each one routed as a
+ * UdpPeer created when it sends its first datagram and removed once it
+ * stayed quiet for the peer timeout.
+ *
+ * Messages to peers are queued until the end of the mainloop iteration and
+ * then written to all peers at once, with as few sendmmsg() calls as
+ * possible.
+ */
+class UdpServerEndpoint : public UdpEndpoint {
+public:
+    UdpServerEndpoint(unsigned long peer_timeout_sec)
+        : UdpEndpoint{"UDP server"}
+        , _peer_timeout_usec{peer_timeout_sec * USEC_PER_SEC}
+    {
+    }
+
+    int handle_read() override;
+    bool handle_canwrite() override;
+    int flush_batch() override;
+    void print_statistics() override;
+    void log_aggregate(unsigned int interval_sec) override;
+
+    /* Write @peer's queued messages with the next flush_batch() */
+    void add_pending(UdpPeer *peer);
+
+protected:
+    void _route_datagram(uint8_t *data, size_t len, const struct sockaddr_storage *addr) override;
+
+private:
+    /* Peers by address and port */
+    struct PeerKey {
+        uint8_t addr[16];
+        uint16_t port;
+
+        bool operator==(const PeerKey &other) const
+        {
+            return port == other.port && memcmp(addr, other.addr, sizeof(addr)) == 0;
+        }
+    };
+    struct PeerKeyHash {
+        size_t operator()(const PeerKey &key) const;
+    };
+
+    static PeerKey _peer_key(const struct sockaddr_storage *addr);
+    UdpPeer *_get_peer(const struct sockaddr_storage *addr);
+    void _remove_pending(UdpPeer *peer);
+    bool _expire_peers_cb(void *data);
+
+    usec_t _peer_timeout_usec;
+    /* Added with the first peer, then owned and freed by the Mainloop */
+    Timeout *_expire_timeout = nullptr;
+    std::unordered_map<PeerKey, std::unique_ptr<UdpPeer>, PeerKeyHash> _peers;
+    std::vector<UdpPeer *> _pending;
+
+    struct {
+        uint32_t peak = 0;
+        uint32_t expired = 0;
+        uint32_t rejected = 0;
+    } _peer_stat;
+    uint32_t _rejected_peers = 0;
 };
 
 class TcpEndpoint : public Endpoint {
@@ -198,11 +616,27 @@ public:
     ~TcpEndpoint();
 
     int accept(int listener_fd);
+    /*
+     * Start connecting, without blocking. Returns the fd, the connection is
+     * established when it becomes writable: see is_connecting().
+     */
     int open(const char *ip, unsigned long port);
     void close();
 
+    int handle_read() override;
+    bool handle_canwrite() override;
     int write_msg(const struct buffer *pbuf) override;
-    int flush_pending_msgs() override { return -ENOSYS; }
+
+    bool is_connecting() const { return _connecting; }
+
+    /* Key in the Mainloop's TCP endpoints, see SlotMap */
+    uint64_t slot_key = 0;
+
+    /*
+     * Delay before the next reconnection attempt: RetryTimeout doubled after
+     * each failed attempt, up to TCP_RETRY_MAX_MSEC, with some jitter
+     */
+    uint32_t next_retry_msec();
 
     struct sockaddr_in sockaddr;
 #ifdef ENABLE_IPV6
@@ -222,11 +656,216 @@ public:
     bool is_valid() override { return _valid; };
     bool is_critical() override { return false; };
 
+    /*
+     * TCP clients come and go all the time: allocate them from a pool. Like
+     * the non-throwing new, this returns nullptr if the pool is exhausted.
+     */
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *p);
+    static Pool pool;
+
 protected:
     ssize_t _read_msg(uint8_t *buf, size_t len) override;
+    ssize_t _write_msg(const struct iovec *iov, int iovcnt) override;
+    void _print_extra_statistics() override;
 
 private:
+    int _finish_connect();
+
     char *_ip = nullptr;
     unsigned long _port = 0;
     bool _valid = true;
+
+    bool _connecting = false;
+    usec_t _connect_start_usec = 0;
+    unsigned _retry_attempts = 0;
+
+    struct {
+        uint32_t attempts = 0;
+        uint32_t failed = 0;
+        /* Time blocked in connect() itself and until connections were established */
+        uint64_t syscall_usec = 0;
+        uint64_t usec = 0;
+    } _connect_stat;
+};
+
+class UnixEndpoint;
+
+/*
+ * A process connected to a UnixEndpoint, routed like an endpoint of its own
+ * until it hangs up. Each message is written as a record of its own.
+ */
+class UnixClient : public Endpoint {
+public:
+    UnixClient(UnixEndpoint *server, int client_fd);
+
+    /* Start and stop polling the client, once accepted and once it hung up */
+    virtual int start();
+    virtual void stop();
+
+    int handle_read() override;
+    int write_msg(const struct buffer *pbuf) override;
+    void log_aggregate(unsigned int interval_sec) override;
+
+    /* A client going away is no reason to exit */
+    bool is_critical() override { return false; };
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override;
+    ssize_t _write_msg(const struct iovec *iov, int iovcnt) override;
+    int _write_datagrams(const struct iovec *iov, int n) override;
+    void _print_extra_statistics() override;
+
+    void _hangup(int err);
+
+    pid_t _pid = 0;
+    uid_t _uid = 0;
+    bool _hung_up = false;
+
+private:
+    friend class UnixEndpoint;
+
+    UnixEndpoint *_server;
+    uint32_t _truncated_records = 0;
+};
+
+/*
+ * Unix socket for processes on the same host, listening on a filesystem
+ * path or, if it starts with '@', on an abstract one. SOCK_SEQPACKET keeps
+ * message boundaries, so clients read and write whole messages without the
+ * IP stack in the way. Each client that connects is a UnixClient.
+ */
+class UnixEndpoint : public Endpoint {
+public:
+    UnixEndpoint(const char *name = "Unix")
+        : Endpoint{name, true}
+    {
+    }
+    ~UnixEndpoint();
+
+    int open(const char *path);
+
+    int handle_read() override;
+    int flush_batch() override;
+    void print_statistics() override;
+    void log_aggregate(unsigned int interval_sec) override;
+
+    /* Remove @client with the next flush_batch(), it may still have pending events */
+    void hangup(UnixClient *client) { _hangups.push_back(client); }
+
+protected:
+    /* Clients are the ones read from */
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
+
+    virtual UnixClient *_new_client(int client_fd);
+
+private:
+    int _accept();
+
+    /* Removed when closed, unset for abstract paths */
+    char *_path = nullptr;
+    std::vector<std::unique_ptr<UnixClient>> _clients;
+    std::vector<UnixClient *> _hangups;
+
+    struct {
+        uint32_t peak = 0;
+        uint32_t accepted = 0;
+        uint32_t rejected = 0;
+    } _client_stat;
+    uint32_t _rejected_clients = 0;
+};
+
+class ShmEndpoint;
+
+/*
+ * A client of a ShmEndpoint. Messages go through the rings of a region of
+ * shared memory set up when it connects, its socket only tells when it goes
+ * away.
+ */
+class ShmClient : public UnixClient {
+public:
+    ShmClient(ShmEndpoint *server, int client_fd, uint32_t ring_size);
+    ~ShmClient();
+
+    int start() override;
+    void stop() override;
+    int handle_read() override;
+    /* Drops the message if the client's ring is full */
+    int write_msg(const struct buffer *pbuf) override;
+
+protected:
+    void _print_extra_statistics() override;
+
+private:
+    friend class ShmEndpoint;
+
+    /* Rung by the client after writing to its ring, if we asked for it */
+    class Doorbell : public Pollable {
+    public:
+        explicit Doorbell(ShmClient *client)
+            : _client{client}
+        {
+        }
+
+        int handle_read() override { return _client->_read_ring(); }
+        bool handle_canwrite() override { return false; }
+        bool is_critical() override { return false; }
+
+    private:
+        ShmClient *_client;
+    };
+
+    int _read_ring();
+    void _corrupted();
+
+    ShmEndpoint *_shm_server;
+    uint32_t _ring_size;
+    void *_region = nullptr;
+    /* Messages to and from the client */
+    struct shm_ring _tx;
+    struct shm_ring _rx;
+    Doorbell _doorbell{this};
+    /* Rung when the client waits for messages */
+    int _client_doorbell_fd = -1;
+
+    /* In the server's list of clients to check with the next flush_batch() */
+    bool _pending = false;
+    bool _tx_pushed = false;
+    bool _rx_disarmed = false;
+
+    struct {
+        uint32_t rung = 0;
+        uint32_t received = 0;
+    } _doorbell_stat;
+};
+
+/*
+ * Endpoint for processes on the same host exchanging messages through
+ * shared memory, without syscalls while both sides keep up: see
+ * common/shm_ring.h and the client library in mavlink-shm/.
+ *
+ * Clients connect to a Unix socket like with UnixEndpoint, and get the
+ * region of shared memory and the doorbells (eventfds) of its rings.
+ * Doorbells are only rung at the end of the mainloop iteration, if the
+ * client sleeps.
+ */
+class ShmEndpoint : public UnixEndpoint {
+public:
+    ShmEndpoint(uint32_t ring_size)
+        : UnixEndpoint{"Shm"}
+        , _ring_size{ring_size}
+    {
+    }
+
+    int flush_batch() override;
+
+    /* Check @client's rings with the next flush_batch() */
+    void add_pending(ShmClient *client);
+
+protected:
+    UnixClient *_new_client(int client_fd) override;
+
+private:
+    uint32_t _ring_size;
+    std::vector<ShmClient *> _pending;
 };
@@ -29,6 +29,7 @@
 #include <common/conf_file.h>
 #include <common/dbg.h>
 #include <common/log.h>
+#include <common/shm_ring.h>
 #include <common/util.h>
 
 #include "comm.h"
@@ -40,6 +41,21 @@
 #define DEFAULT_CONFFILE "/etc/mavlink-router/main.conf"
 #define DEFAULT_CONF_DIR "/etc/mavlink-router/config.d"
 #define DEFAULT_RETRY_TCP_TIMEOUT 5
+#define DEFAULT_SLOW_CONSUMER_POLICY \
+    {DropNewest, TX_QUEUE_DEFAULT_MAX_BYTES, SLOW_CONSUMER_DEFAULT_TIMEOUT_SEC}
+#define DEFAULT_OPTION_EGRESS \
+    {nullptr, nullptr, nullptr, nullptr, EGRESS_DEFAULT_TELEMETRY_WEIGHT, \
+     EGRESS_DEFAULT_BULK_WEIGHT}
+
+/* Egress scheduling keys, common to all endpoint sections */
+struct option_egress {
+    char *control;
+    char *heartbeat;
+    char *bulk;
+    char *coalesce;
+    unsigned long telemetry_weight;
+    unsigned long bulk_weight;
+};
 
 static struct options opt = {
     .endpoints = nullptr,
@@ -53,6 +69,13 @@ static struct options opt = {
     .mavlink_dialect = Auto,
     .min_free_space = 0,
     .max_log_files = 0,
+    .prealloc_tcp_clients = 0,
+    .prealloc_packets = 0,
+    .no_heap_after_startup = false,
+    .event_backend = Epoll,
+    .threads = 1,
+    .loop_window_msec = 0,
+    .tcp_slow_consumer = DEFAULT_SLOW_CONSUMER_POLICY,
 };
 
 static const struct option long_options[] = {
@@ -170,7 +193,10 @@ static int log_level_from_str(const char *str)
 }
 
 static int add_tcp_endpoint_address(const char *name, size_t name_len, const char *ip,
-                                    long unsigned port, int timeout)
+                                    long unsigned port, int timeout, bool trusted,
+                                    const struct slow_consumer_policy &slow_consumer,
+                                    EgressScheduler *egress, RateLimiter *rate_limiter,
+                                    const char *dedup_group)
 {
     int ret;
 
@@ -211,7 +237,19 @@ static int add_tcp_endpoint_address(const char *name, size_t name_len, const cha
         goto fail;
     }
 
+    if (dedup_group) {
+        conf->dedup_group = strdup(dedup_group);
+        if (!conf->dedup_group) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
     conf->retry_timeout = timeout;
+    conf->trusted = trusted;
+    conf->slow_consumer = slow_consumer;
+    conf->egress = egress;
+    conf->rate_limiter = rate_limiter;
 
     conf->next = opt.endpoints;
     opt.endpoints = conf;
@@ -220,6 +258,7 @@ static int add_tcp_endpoint_address(const char *name, size_t name_len, const cha
 
 fail:
     free(conf->address);
+    free(conf->dedup_group);
     free(conf->name);
     free(conf);
 
@@ -227,7 +266,11 @@ fail:
 }
 
 static int add_endpoint_address(const char *name, size_t name_len, const char *ip,
-                                long unsigned port, bool eavesdropping, const char *filter)
+                                long unsigned port, enum udp_mode mode, const char *filter,
+                                bool trusted, unsigned long batch_size,
+                                unsigned long batch_max_latency, unsigned long peer_timeout,
+                                const struct udp_multicast &multicast, EgressScheduler *egress,
+                                RateLimiter *rate_limiter, const char *dedup_group)
 {
     int ret;
 
@@ -275,7 +318,77 @@ static int add_endpoint_address(const char *name, size_t name_len, const char *i
         conf->port = find_next_endpoint_port(conf->address);
     }
 
-    conf->eavesdropping = eavesdropping;
+    if (dedup_group) {
+        conf->dedup_group = strdup(dedup_group);
+        if (!conf->dedup_group) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    conf->mode = mode;
+    conf->peer_timeout = peer_timeout;
+    conf->multicast = multicast;
+    conf->trusted = trusted;
+    conf->batch_size = batch_size;
+    conf->batch_max_latency = batch_max_latency;
+    conf->egress = egress;
+    conf->rate_limiter = rate_limiter;
+
+    conf->next = opt.endpoints;
+    opt.endpoints = conf;
+
+    return 0;
+
+fail:
+    free(conf->address);
+    free(conf->dedup_group);
+    free(conf->name);
+    free(conf);
+
+    return ret;
+}
+
+/* With a @ring_size, clients exchange messages through shared memory */
+static int add_unix_endpoint(const char *name, size_t name_len, const char *path, bool trusted,
+                             const struct slow_consumer_policy &slow_consumer,
+                             EgressScheduler *egress, RateLimiter *rate_limiter,
+                             const char *dedup_group, unsigned long ring_size)
+{
+    int ret;
+
+    struct endpoint_config *conf
+        = (struct endpoint_config *)calloc(1, sizeof(struct endpoint_config));
+    assert_or_return(conf, -ENOMEM);
+    conf->type = ring_size ? Shm : Unix;
+    conf->ring_size = ring_size;
+
+    if (name) {
+        conf->name = strndup(name, name_len);
+        if (!conf->name) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    conf->address = strdup(path);
+    if (!conf->address) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    if (dedup_group) {
+        conf->dedup_group = strdup(dedup_group);
+        if (!conf->dedup_group) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    conf->trusted = trusted;
+    conf->slow_consumer = slow_consumer;
+    conf->egress = egress;
+    conf->rate_limiter = rate_limiter;
 
     conf->next = opt.endpoints;
     opt.endpoints = conf;
@@ -284,6 +397,7 @@ static int add_endpoint_address(const char *name, size_t name_len, const char *i
 
 fail:
     free(conf->address);
+    free(conf->dedup_group);
     free(conf->name);
     free(conf);
 
@@ -334,7 +448,8 @@ error:
 }
 
 static int add_uart_endpoint(const char *name, size_t name_len, const char *uart_device,
-                             const char *bauds, bool flowcontrol)
+                             const char *bauds, bool flowcontrol, EgressScheduler *egress,
+                             RateLimiter *rate_limiter, const char *dedup_group)
 {
     int ret;
 
@@ -363,7 +478,17 @@ static int add_uart_endpoint(const char *name, size_t name_len, const char *uart
         goto fail;
     }
 
+    if (dedup_group) {
+        conf->dedup_group = strdup(dedup_group);
+        if (!conf->dedup_group) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
     conf->flowcontrol = flowcontrol;
+    conf->egress = egress;
+    conf->rate_limiter = rate_limiter;
 
     conf->next = opt.endpoints;
     opt.endpoints = conf;
@@ -372,6 +497,7 @@ static int add_uart_endpoint(const char *name, size_t name_len, const char *uart
 
 fail:
     free(conf->device);
+    free(conf->dedup_group);
     free(conf->name);
     free(conf);
 
@@ -413,6 +539,7 @@ static int parse_argv(int argc, char *argv[])
 {
     int c;
     struct stat st;
+    const struct udp_multicast default_multicast = UDP_MULTICAST_DEFAULT;
 
     assert(argc >= 0);
     assert(argv);
@@ -437,7 +564,9 @@ static int parse_argv(int argc, char *argv[])
                 return -EINVAL;
             }
 
-            add_endpoint_address(NULL, 0, ip, port, false, NULL);
+            add_endpoint_address(NULL, 0, ip, port, UdpNormal, NULL, false, 1, 0,
+                                 UDP_PEER_DEFAULT_TIMEOUT_SEC, default_multicast, nullptr, nullptr,
+                                 nullptr);
             free(ip);
             break;
         }
@@ -492,7 +621,8 @@ static int parse_argv(int argc, char *argv[])
                 return -EINVAL;
             }
 
-            add_tcp_endpoint_address(NULL, 0, ip, port, DEFAULT_RETRY_TCP_TIMEOUT);
+            add_tcp_endpoint_address(NULL, 0, ip, port, DEFAULT_RETRY_TCP_TIMEOUT, false,
+                                     DEFAULT_SLOW_CONSUMER_POLICY, nullptr, nullptr, nullptr);
             free(ip);
             break;
         }
@@ -533,10 +663,12 @@ static int parse_argv(int argc, char *argv[])
                 return -EINVAL;
             }
 
-            add_endpoint_address(NULL, 0, base, number, true, NULL);
+            add_endpoint_address(NULL, 0, base, number, UdpEavesdropping, NULL, false, 1, 0,
+                                 UDP_PEER_DEFAULT_TIMEOUT_SEC, default_multicast, nullptr, nullptr,
+                                 nullptr);
         } else {
             const char *bauds = number != ULONG_MAX ? base + strlen(base) + 1 : NULL;
-            int ret = add_uart_endpoint(NULL, 0, base, bauds, false);
+            int ret = add_uart_endpoint(NULL, 0, base, bauds, false, nullptr, nullptr, nullptr);
             if (ret < 0) {
                 free(base);
                 return ret;
@@ -629,6 +761,197 @@ static int parse_log_level(const char *val, size_t val_len, void *storage, size_
 #undef MAX_LOG_LEVEL_SIZE
 
 #define MAX_LOG_MODE_SIZE 20
+static int parse_event_backend(const char *val, size_t val_len, void *storage, size_t storage_len)
+{
+    assert(val);
+    assert(storage);
+    assert(val_len);
+
+    enum event_backend *backend = (enum event_backend *)storage;
+
+    if (storage_len < sizeof(options::event_backend))
+        return -ENOBUFS;
+    if (val_len > INT_MAX)
+        return -EINVAL;
+
+    if (memcaseeq(val, val_len, "epoll", sizeof("epoll") - 1)) {
+        *backend = Epoll;
+    } else if (memcaseeq(val, val_len, "io_uring", sizeof("io_uring") - 1)) {
+        *backend = IoUring;
+    } else {
+        log_error("Invalid argument for EventBackend = %.*s", (int)val_len, val);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int parse_slow_consumer_action(const char *val, size_t val_len, void *storage,
+                                      size_t storage_len)
+{
+    assert(val);
+    assert(storage);
+    assert(val_len);
+
+    enum slow_consumer_action *action = (enum slow_consumer_action *)storage;
+
+    if (storage_len < sizeof(slow_consumer_policy::action))
+        return -ENOBUFS;
+    if (val_len > INT_MAX)
+        return -EINVAL;
+
+    if (memcaseeq(val, val_len, "drop-newest", sizeof("drop-newest") - 1)) {
+        *action = DropNewest;
+    } else if (memcaseeq(val, val_len, "drop-oldest", sizeof("drop-oldest") - 1)) {
+        *action = DropOldest;
+    } else if (memcaseeq(val, val_len, "drop-low-priority", sizeof("drop-low-priority") - 1)) {
+        *action = DropLowPriority;
+    } else if (memcaseeq(val, val_len, "disconnect", sizeof("disconnect") - 1)) {
+        *action = Disconnect;
+    } else {
+        log_error("Invalid argument for SlowConsumerPolicy = %.*s", (int)val_len, val);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int validate_slow_consumer_policy(const struct slow_consumer_policy &policy,
+                                         const char *section, size_t section_len)
+{
+    if (policy.queue_max_bytes < MAVLINK_MAX_PACKET_LEN) {
+        log_error("TxQueueMaxBytes must be at least %d in section %.*s", MAVLINK_MAX_PACKET_LEN,
+                  (int)section_len, section);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int validate_ring_size(unsigned long ring_size, const char *section, size_t section_len)
+{
+    if (ring_size > SHM_RING_MAX_SIZE || !shm_ring_size_valid(ring_size)) {
+        log_error("RingSize must be a power of 2 between %d and %d in section %.*s",
+                  SHM_RING_MIN_SIZE, SHM_RING_MAX_SIZE, (int)section_len, section);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int parse_msg_ids(char *list, std::vector<uint32_t> &msg_ids, const char *section,
+                         size_t section_len)
+{
+    unsigned long msg_id;
+
+    msg_ids.clear();
+    if (!list)
+        return 0;
+
+    for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+        if (safe_atoul(s, &msg_id) < 0 || msg_id > 0xffffff) {
+            log_error("Invalid message id %s in section %.*s", s, (int)section_len, section);
+            return -EINVAL;
+        }
+        msg_ids.push_back(msg_id);
+    }
+
+    return 0;
+}
+
+/*
+ * Create the EgressScheduler for the egress options of a section. @egress is
+ * set to nullptr if no message was assigned a class or coalesced.
+ */
+static int parse_egress(const struct option_egress &opt_egress, const char *section,
+                        size_t section_len, EgressScheduler **egress)
+{
+    const struct {
+        char *list;
+        enum egress_class egress_class;
+    } classes[] = {
+        {opt_egress.control, EgressControl},
+        {opt_egress.heartbeat, EgressHeartbeat},
+        {opt_egress.bulk, EgressBulk},
+    };
+    std::unique_ptr<EgressScheduler> e{new EgressScheduler{}};
+    std::vector<uint32_t> msg_ids;
+
+    if (opt_egress.telemetry_weight == 0 || opt_egress.bulk_weight == 0) {
+        log_error("Egress weights must be at least 1 in section %.*s", (int)section_len, section);
+        return -EINVAL;
+    }
+
+    e->set_weight(EgressTelemetry, opt_egress.telemetry_weight);
+    e->set_weight(EgressBulk, opt_egress.bulk_weight);
+
+    for (auto &c : classes) {
+        if (parse_msg_ids(c.list, msg_ids, section, section_len) < 0)
+            return -EINVAL;
+        for (uint32_t msg_id : msg_ids)
+            e->set_class(msg_id, c.egress_class);
+    }
+
+    if (parse_msg_ids(opt_egress.coalesce, msg_ids, section, section_len) < 0)
+        return -EINVAL;
+    for (uint32_t msg_id : msg_ids)
+        e->set_coalesced(msg_id);
+
+    *egress = e->enabled() || e->coalescing() ? e.release() : nullptr;
+
+    return 0;
+}
+
+/*
+ * Create the RateLimiter for a list of <msgid>:<rate>[:<burst>] limits, rate
+ * being in messages per second
+ */
+static int parse_rate_limits(char *list, const char *section, size_t section_len,
+                             RateLimiter **rate_limiter)
+{
+    std::unique_ptr<RateLimiter> limiter{new RateLimiter{}};
+    unsigned long msg_id, burst;
+    char *s, *end, *save;
+    double rate;
+
+    for (s = strtok_r(list, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        msg_id = strtoul(s, &end, 10);
+        if (end == s || *end != ':' || msg_id > 0xffffff)
+            goto invalid;
+
+        errno = 0;
+        rate = strtod(end + 1, &end);
+        if (errno || !(rate > 0))
+            goto invalid;
+
+        burst = 1;
+        if (*end == ':') {
+            if (safe_atoul(end + 1, &burst) < 0 || burst == 0)
+                goto invalid;
+        } else if (*end != '\0') {
+            goto invalid;
+        }
+
+        limiter->add_limit(msg_id, rate, burst);
+    }
+
+    *rate_limiter = limiter->enabled() ? limiter.release() : nullptr;
+
+    return 0;
+
+invalid:
+    log_error("Invalid rate limit %s in section %.*s", s, (int)section_len, section);
+    return -EINVAL;
+}
+
+static void free_option_egress(struct option_egress &opt_egress)
+{
+    free(opt_egress.control);
+    free(opt_egress.heartbeat);
+    free(opt_egress.bulk);
+    free(opt_egress.coalesce);
+}
+
 static int parse_log_mode(const char *val, size_t val_len, void *storage, size_t storage_len)
 {
     assert(val);
@@ -663,16 +986,18 @@ static int parse_mode(const char *val, size_t val_len, void *storage, size_t sto
     assert(storage);
     assert(val_len);
 
-    if (storage_len < sizeof(bool))
+    if (storage_len < sizeof(enum udp_mode))
         return -ENOBUFS;
     if (val_len > INT_MAX)
         return -EINVAL;
 
-    bool *eavesdropping = (bool *)storage;
+    enum udp_mode *mode = (enum udp_mode *)storage;
     if (memcaseeq(val, val_len, "normal", sizeof("normal") - 1)) {
-        *eavesdropping = false;
+        *mode = UdpNormal;
     } else if (memcaseeq(val, val_len, "eavesdropping", sizeof("eavesdropping") - 1)) {
-        *eavesdropping = true;
+        *mode = UdpEavesdropping;
+    } else if (memcaseeq(val, val_len, "server", sizeof("server") - 1)) {
+        *mode = UdpServer;
     } else {
         log_error("Unknown 'mode' key: %.*s", (int)val_len, val);
         return -EINVAL;
@@ -702,44 +1027,160 @@ static int parse_confs(ConfFile &conf)
          OPTIONS_TABLE_STRUCT_FIELD(options, min_free_space)},
         {"MaxLogFiles", false, ConfFile::parse_ul,
          OPTIONS_TABLE_STRUCT_FIELD(options, max_log_files)},
+        {"PreallocTcpClients", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, prealloc_tcp_clients)},
+        {"PreallocPackets", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, prealloc_packets)},
+        {"NoHeapAfterStartup", false, ConfFile::parse_bool,
+         OPTIONS_TABLE_STRUCT_FIELD(options, no_heap_after_startup)},
+        {"EventBackend", false, parse_event_backend,
+         OPTIONS_TABLE_STRUCT_FIELD(options, event_backend)},
+        {"Threads", false, ConfFile::parse_ul, OPTIONS_TABLE_STRUCT_FIELD(options, threads)},
+        {"LoopWindow", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, loop_window_msec)},
+        {"TcpServerSlowConsumerPolicy", false, parse_slow_consumer_action,
+         OPTIONS_TABLE_STRUCT_FIELD(options, tcp_slow_consumer.action)},
+        {"TcpServerTxQueueMaxBytes", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, tcp_slow_consumer.queue_max_bytes)},
+        {"TcpServerSlowConsumerTimeout", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(options, tcp_slow_consumer.timeout_sec)},
     };
 
     struct option_uart {
         char *device;
         char *bauds;
         bool flowcontrol;
+        struct option_egress egress;
+        char *rate_limit;
+        char *dedup_group;
     };
     static const ConfFile::OptionsTable option_table_uart[] = {
         {"baud",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, bauds)},
         {"device",      true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, device)},
         {"FlowControl", false,  ConfFile::parse_bool,       OPTIONS_TABLE_STRUCT_FIELD(option_uart, flowcontrol)},
+        {"EgressControl",   false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, egress.control)},
+        {"EgressHeartbeat", false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, egress.heartbeat)},
+        {"EgressBulk",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, egress.bulk)},
+        {"Coalesce",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, egress.coalesce)},
+        {"EgressTelemetryWeight", false, ConfFile::parse_ul,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, egress.telemetry_weight)},
+        {"EgressBulkWeight", false, ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_uart, egress.bulk_weight)},
+        {"RateLimit",       false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, rate_limit)},
+        {"DedupGroup",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_uart, dedup_group)},
     };
 
     struct option_udp {
         char *addr;
-        bool eavesdropping;
+        enum udp_mode mode;
         unsigned long port;
         char *filter;
+        bool trusted;
+        unsigned long batch_size;
+        unsigned long batch_max_latency;
+        unsigned long peer_timeout;
+        struct udp_multicast multicast;
+        struct option_egress egress;
+        char *rate_limit;
+        char *dedup_group;
     };
     static const ConfFile::OptionsTable option_table_udp[] = {
         {"address", true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, addr)},
-        {"mode",    true,   parse_mode,                 OPTIONS_TABLE_STRUCT_FIELD(option_udp, eavesdropping)},
+        {"mode",    true,   parse_mode,                 OPTIONS_TABLE_STRUCT_FIELD(option_udp, mode)},
         {"port",    false,  ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_udp, port)},
         {"filter",  false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, filter)},
+        {"TrustedSource", false, ConfFile::parse_bool,  OPTIONS_TABLE_STRUCT_FIELD(option_udp, trusted)},
+        {"BatchSize", false,    ConfFile::parse_ul,     OPTIONS_TABLE_STRUCT_FIELD(option_udp, batch_size)},
+        {"BatchMaxLatency", false, ConfFile::parse_ul,  OPTIONS_TABLE_STRUCT_FIELD(option_udp, batch_max_latency)},
+        {"PeerTimeout", false,  ConfFile::parse_ul,     OPTIONS_TABLE_STRUCT_FIELD(option_udp, peer_timeout)},
+        {"MulticastTTL", false, ConfFile::parse_ul,     OPTIONS_TABLE_STRUCT_FIELD(option_udp, multicast.ttl)},
+        {"MulticastLoop", false, ConfFile::parse_bool,  OPTIONS_TABLE_STRUCT_FIELD(option_udp, multicast.loop)},
+        {"MulticastInterface", false, ConfFile::parse_str_buf,
+         OPTIONS_TABLE_STRUCT_FIELD(option_udp, multicast.interface)},
+        {"EgressControl",   false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, egress.control)},
+        {"EgressHeartbeat", false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, egress.heartbeat)},
+        {"EgressBulk",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, egress.bulk)},
+        {"Coalesce",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, egress.coalesce)},
+        {"EgressTelemetryWeight", false, ConfFile::parse_ul,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, egress.telemetry_weight)},
+        {"EgressBulkWeight", false, ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_udp, egress.bulk_weight)},
+        {"RateLimit",       false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, rate_limit)},
+        {"DedupGroup",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_udp, dedup_group)},
     };
 
     struct option_tcp {
         char *addr;
         unsigned long port;
         int timeout;
+        bool trusted;
+        struct slow_consumer_policy slow_consumer;
+        struct option_egress egress;
+        char *rate_limit;
+        char *dedup_group;
     };
     static const ConfFile::OptionsTable option_table_tcp[] = {
         {"address",         true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, addr)},
         {"port",            true,   ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_tcp, port)},
         {"RetryTimeout",    false,  ConfFile::parse_i,          OPTIONS_TABLE_STRUCT_FIELD(option_tcp, timeout)},
+        {"TrustedSource",   false,  ConfFile::parse_bool,       OPTIONS_TABLE_STRUCT_FIELD(option_tcp, trusted)},
+        {"SlowConsumerPolicy", false, parse_slow_consumer_action,
+         OPTIONS_TABLE_STRUCT_FIELD(option_tcp, slow_consumer.action)},
+        {"TxQueueMaxBytes", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(option_tcp, slow_consumer.queue_max_bytes)},
+        {"SlowConsumerTimeout", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(option_tcp, slow_consumer.timeout_sec)},
+        {"EgressControl",   false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, egress.control)},
+        {"EgressHeartbeat", false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, egress.heartbeat)},
+        {"EgressBulk",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, egress.bulk)},
+        {"Coalesce",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, egress.coalesce)},
+        {"EgressTelemetryWeight", false, ConfFile::parse_ul,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, egress.telemetry_weight)},
+        {"EgressBulkWeight", false, ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_tcp, egress.bulk_weight)},
+        {"RateLimit",       false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, rate_limit)},
+        {"DedupGroup",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_tcp, dedup_group)},
+    };
+
+    struct option_unix {
+        char *path;
+        bool trusted;
+        struct slow_consumer_policy slow_consumer;
+        struct option_egress egress;
+        char *rate_limit;
+        char *dedup_group;
+    };
+    static const ConfFile::OptionsTable option_table_unix[] = {
+        {"path",            true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, path)},
+        {"TrustedSource",   false,  ConfFile::parse_bool,       OPTIONS_TABLE_STRUCT_FIELD(option_unix, trusted)},
+        {"SlowConsumerPolicy", false, parse_slow_consumer_action,
+         OPTIONS_TABLE_STRUCT_FIELD(option_unix, slow_consumer.action)},
+        {"TxQueueMaxBytes", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(option_unix, slow_consumer.queue_max_bytes)},
+        {"SlowConsumerTimeout", false, ConfFile::parse_ul,
+         OPTIONS_TABLE_STRUCT_FIELD(option_unix, slow_consumer.timeout_sec)},
+        {"EgressControl",   false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, egress.control)},
+        {"EgressHeartbeat", false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, egress.heartbeat)},
+        {"EgressBulk",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, egress.bulk)},
+        {"Coalesce",        false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, egress.coalesce)},
+        {"EgressTelemetryWeight", false, ConfFile::parse_ul,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, egress.telemetry_weight)},
+        {"EgressBulkWeight", false, ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_unix, egress.bulk_weight)},
+        {"RateLimit",       false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, rate_limit)},
+        {"DedupGroup",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_unix, dedup_group)},
+    };
+
+    struct option_shm {
+        char *path;
+        unsigned long ring_size;
+        bool trusted;
+        char *rate_limit;
+        char *dedup_group;
+    };
+    static const ConfFile::OptionsTable option_table_shm[] = {
+        {"path",            true,   ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_shm, path)},
+        {"RingSize",        false,  ConfFile::parse_ul,         OPTIONS_TABLE_STRUCT_FIELD(option_shm, ring_size)},
+        {"TrustedSource",   false,  ConfFile::parse_bool,       OPTIONS_TABLE_STRUCT_FIELD(option_shm, trusted)},
+        {"RateLimit",       false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_shm, rate_limit)},
+        {"DedupGroup",      false,  ConfFile::parse_str_dup,    OPTIONS_TABLE_STRUCT_FIELD(option_shm, dedup_group)},
     };
 
     ret = conf.extract_options("General", option_table, ARRAY_SIZE(option_table), &opt);
+    if (ret == 0)
+        ret = validate_slow_consumer_policy(opt.tcp_slow_consumer, "General", strlen("General"));
     if (ret < 0)
         return ret;
 
@@ -747,49 +1188,97 @@ static int parse_confs(ConfFile &conf)
     pattern = "uartendpoint *";
     offset = strlen(pattern) - 1;
     while (conf.get_sections(pattern, &iter) == 0) {
-        struct option_uart opt_uart = {nullptr, nullptr};
+        struct option_uart opt_uart = {nullptr, nullptr, false, DEFAULT_OPTION_EGRESS, nullptr,
+                                       nullptr};
+        EgressScheduler *egress = nullptr;
+        RateLimiter *rate_limiter = nullptr;
         ret = conf.extract_options(&iter, option_table_uart, ARRAY_SIZE(option_table_uart),
                                    &opt_uart);
+        if (ret == 0)
+            ret = parse_egress(opt_uart.egress, iter.name, iter.name_len, &egress);
+        if (ret == 0 && opt_uart.rate_limit)
+            ret = parse_rate_limits(opt_uart.rate_limit, iter.name, iter.name_len, &rate_limiter);
         if (ret == 0)
             ret = add_uart_endpoint(iter.name + offset, iter.name_len - offset, opt_uart.device,
-                                    opt_uart.bauds, opt_uart.flowcontrol);
+                                    opt_uart.bauds, opt_uart.flowcontrol, egress, rate_limiter,
+                                    opt_uart.dedup_group);
         free(opt_uart.device);
         free(opt_uart.bauds);
-        if (ret < 0)
+        free(opt_uart.rate_limit);
+        free(opt_uart.dedup_group);
+        free_option_egress(opt_uart.egress);
+        if (ret < 0) {
+            delete egress;
+            delete rate_limiter;
             return ret;
+        }
     }
 
     iter = {};
     pattern = "udpendpoint *";
     offset = strlen(pattern) - 1;
     while (conf.get_sections(pattern, &iter) == 0) {
-        struct option_udp opt_udp = {nullptr, false, ULONG_MAX};
+        struct option_udp opt_udp = {nullptr, UdpNormal, ULONG_MAX, nullptr, false, 1, 0,
+                                     UDP_PEER_DEFAULT_TIMEOUT_SEC, UDP_MULTICAST_DEFAULT,
+                                     DEFAULT_OPTION_EGRESS, nullptr, nullptr};
+        EgressScheduler *egress = nullptr;
+        RateLimiter *rate_limiter = nullptr;
         ret = conf.extract_options(&iter, option_table_udp, ARRAY_SIZE(option_table_udp), &opt_udp);
+        if (ret == 0)
+            ret = parse_egress(opt_udp.egress, iter.name, iter.name_len, &egress);
+        if (ret == 0 && opt_udp.rate_limit)
+            ret = parse_rate_limits(opt_udp.rate_limit, iter.name, iter.name_len, &rate_limiter);
         if (ret == 0) {
-            if (opt_udp.eavesdropping && opt_udp.port == ULONG_MAX) {
+            if (opt_udp.mode != UdpNormal && opt_udp.port == ULONG_MAX) {
                 log_error("Expected 'port' key for section %.*s", (int)iter.name_len, iter.name);
                 ret = -EINVAL;
+            } else if (opt_udp.batch_size == 0 || opt_udp.batch_size > UDP_BATCH_MAX) {
+                log_error("BatchSize must be between 1 and %d in section %.*s", UDP_BATCH_MAX,
+                          (int)iter.name_len, iter.name);
+                ret = -EINVAL;
+            } else if (opt_udp.peer_timeout == 0) {
+                log_error("PeerTimeout must be at least 1 in section %.*s", (int)iter.name_len,
+                          iter.name);
+                ret = -EINVAL;
+            } else if (opt_udp.multicast.ttl > 255) {
+                log_error("MulticastTTL must be at most 255 in section %.*s", (int)iter.name_len,
+                          iter.name);
+                ret = -EINVAL;
             } else {
                 if (validate_ip(opt_udp.addr) < 0) {
                     log_error("Invalid IP address in section %.*s: %s", (int)iter.name_len, iter.name, opt_udp.addr);
                     ret = -EINVAL;
                 } else {
                     ret = add_endpoint_address(iter.name + offset, iter.name_len - offset, opt_udp.addr,
-                                               opt_udp.port, opt_udp.eavesdropping, opt_udp.filter);
+                                               opt_udp.port, opt_udp.mode, opt_udp.filter,
+                                               opt_udp.trusted, opt_udp.batch_size,
+                                               opt_udp.batch_max_latency, opt_udp.peer_timeout,
+                                               opt_udp.multicast, egress, rate_limiter,
+                                               opt_udp.dedup_group);
                 }
             }
         }
 
         free(opt_udp.addr);
-        if (ret < 0)
+        free(opt_udp.rate_limit);
+        free(opt_udp.dedup_group);
+        free_option_egress(opt_udp.egress);
+        if (ret < 0) {
+            delete egress;
+            delete rate_limiter;
             return ret;
+        }
     }
 
     iter = {};
     pattern = "tcpendpoint *";
     offset = strlen(pattern) - 1;
     while (conf.get_sections(pattern, &iter) == 0) {
-        struct option_tcp opt_tcp = {nullptr, ULONG_MAX, DEFAULT_RETRY_TCP_TIMEOUT};
+        struct option_tcp opt_tcp = {nullptr, ULONG_MAX, DEFAULT_RETRY_TCP_TIMEOUT, false,
+                                     DEFAULT_SLOW_CONSUMER_POLICY, DEFAULT_OPTION_EGRESS, nullptr,
+                                     nullptr};
+        EgressScheduler *egress = nullptr;
+        RateLimiter *rate_limiter = nullptr;
         ret = conf.extract_options(&iter, option_table_tcp, ARRAY_SIZE(option_table_tcp), &opt_tcp);
 
         if (ret == 0) {
@@ -797,13 +1286,87 @@ static int parse_confs(ConfFile &conf)
                 log_error("Invalid IP address in section %.*s: %s", (int)iter.name_len, iter.name, opt_tcp.addr);
                 ret = -EINVAL;
             } else {
-                ret = add_tcp_endpoint_address(iter.name + offset, iter.name_len - offset, opt_tcp.addr,
-                                               opt_tcp.port, opt_tcp.timeout);
+                ret = validate_slow_consumer_policy(opt_tcp.slow_consumer, iter.name,
+                                                    iter.name_len);
             }
+
+            if (ret == 0)
+                ret = parse_egress(opt_tcp.egress, iter.name, iter.name_len, &egress);
+            if (ret == 0 && opt_tcp.rate_limit)
+                ret = parse_rate_limits(opt_tcp.rate_limit, iter.name, iter.name_len,
+                                        &rate_limiter);
+            if (ret == 0)
+                ret = add_tcp_endpoint_address(iter.name + offset, iter.name_len - offset, opt_tcp.addr,
+                                               opt_tcp.port, opt_tcp.timeout, opt_tcp.trusted,
+                                               opt_tcp.slow_consumer, egress, rate_limiter,
+                                               opt_tcp.dedup_group);
         }
         free(opt_tcp.addr);
-        if (ret < 0)
+        free(opt_tcp.rate_limit);
+        free(opt_tcp.dedup_group);
+        free_option_egress(opt_tcp.egress);
+        if (ret < 0) {
+            delete egress;
+            delete rate_limiter;
             return ret;
+        }
+    }
+
+    iter = {};
+    pattern = "unixendpoint *";
+    offset = strlen(pattern) - 1;
+    while (conf.get_sections(pattern, &iter) == 0) {
+        struct option_unix opt_unix = {nullptr, false, DEFAULT_SLOW_CONSUMER_POLICY,
+                                       DEFAULT_OPTION_EGRESS, nullptr, nullptr};
+        EgressScheduler *egress = nullptr;
+        RateLimiter *rate_limiter = nullptr;
+        ret = conf.extract_options(&iter, option_table_unix, ARRAY_SIZE(option_table_unix),
+                                   &opt_unix);
+        if (ret == 0)
+            ret = validate_slow_consumer_policy(opt_unix.slow_consumer, iter.name, iter.name_len);
+        if (ret == 0)
+            ret = parse_egress(opt_unix.egress, iter.name, iter.name_len, &egress);
+        if (ret == 0 && opt_unix.rate_limit)
+            ret = parse_rate_limits(opt_unix.rate_limit, iter.name, iter.name_len, &rate_limiter);
+        if (ret == 0)
+            ret = add_unix_endpoint(iter.name + offset, iter.name_len - offset, opt_unix.path,
+                                    opt_unix.trusted, opt_unix.slow_consumer, egress, rate_limiter,
+                                    opt_unix.dedup_group, 0);
+        free(opt_unix.path);
+        free(opt_unix.rate_limit);
+        free(opt_unix.dedup_group);
+        free_option_egress(opt_unix.egress);
+        if (ret < 0) {
+            delete egress;
+            delete rate_limiter;
+            return ret;
+        }
+    }
+
+    iter = {};
+    pattern = "shmendpoint *";
+    offset = strlen(pattern) - 1;
+    while (conf.get_sections(pattern, &iter) == 0) {
+        struct option_shm opt_shm = {nullptr, SHM_RING_DEFAULT_SIZE, false, nullptr, nullptr};
+        RateLimiter *rate_limiter = nullptr;
+        ret = conf.extract_options(&iter, option_table_shm, ARRAY_SIZE(option_table_shm),
+                                   &opt_shm);
+        if (ret == 0)
+            ret = validate_ring_size(opt_shm.ring_size, iter.name, iter.name_len);
+        if (ret == 0 && opt_shm.rate_limit)
+            ret = parse_rate_limits(opt_shm.rate_limit, iter.name, iter.name_len, &rate_limiter);
+        /* Messages are dropped when a ring is full, there's no queue to manage */
+        if (ret == 0)
+            ret = add_unix_endpoint(iter.name + offset, iter.name_len - offset, opt_shm.path,
+                                    opt_shm.trusted, DEFAULT_SLOW_CONSUMER_POLICY, nullptr,
+                                    rate_limiter, opt_shm.dedup_group, opt_shm.ring_size);
+        free(opt_shm.path);
+        free(opt_shm.rate_limit);
+        free(opt_shm.dedup_group);
+        if (ret < 0) {
+            delete rate_limiter;
+            return ret;
+        }
     }
 
     return 0;
@@ -909,7 +1472,7 @@ int main(int argc, char *argv[])
 
     dbg("Cmd line and options parsed");
 
-    if (mainloop.open() < 0)
+    if (mainloop.open(opt.event_backend) < 0)
         goto close_log;
 
     if (opt.tcp_port == ULONG_MAX)
@@ -18,23 +18,32 @@
 #include "mainloop.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <atomic>
 #include <memory>
+#include <mutex>
 
 #include <common/log.h>
 #include <common/util.h>
 
 #include "autolog.h"
+#include "packet.h"
+#include "pool.h"
 
 static std::atomic<bool> should_exit {false};
 
 Mainloop Mainloop::_instance{};
 bool Mainloop::_initialized = false;
+thread_local Mainloop *Mainloop::_current = nullptr;
 
 static void exit_signal_handler(int signum)
 {
@@ -59,6 +68,7 @@ Mainloop &Mainloop::init()
     assert(_initialized == false);
 
     _initialized = true;
+    _current = &_instance;
 
     return _instance;
 }
@@ -71,17 +81,61 @@ Mainloop &Mainloop::instance()
 void Mainloop::request_exit(int retcode)
 {
     _retcode = retcode;
-    _initialized = false;
     should_exit.store(true, std::memory_order_relaxed);
+
+    /* The main thread stops the other shards once it's out of its loop */
+    if (_shards && _shard_id != 0)
+        _shards->ring_doorbell(0);
 }
 
-int Mainloop::open()
+int Mainloop::open(enum event_backend backend)
 {
     _retcode = -1;
 
+    if (_open_poller(backend) < 0)
+        return -1;
+
+    /* A single timerfd, armed for the next expiration of _timers */
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (_timer_fd < 0) {
+        log_error("Unable to create timerfd: %m");
+        return -1;
+    }
+
+    if (add_fd(_timer_fd, &_timer_fd, EPOLLIN) < 0)
+        return -1;
+
+    _retcode = 0;
+
+    return 0;
+}
+
+int Mainloop::_open_poller(enum event_backend backend)
+{
     if (epollfd != -1)
         return -EBUSY;
 
+    if (backend == IoUring) {
+#ifdef ENABLE_IO_URING
+        int r;
+
+        if (_uring)
+            return -EBUSY;
+
+        _uring = new UringPoller();
+        r = _uring->open(256);
+        if (r == 0)
+            return 0;
+
+        log_warning("Could not set up io_uring (%s), falling back to epoll", strerror(-r));
+        delete _uring;
+        _uring = nullptr;
+#else
+        log_error("EventBackend=io_uring requested but built without io_uring support");
+        return -ENOTSUP;
+#endif
+    }
+
     epollfd = epoll_create1(EPOLL_CLOEXEC);
 
     if (epollfd == -1) {
@@ -89,8 +143,6 @@ int Mainloop::open()
         return -1;
     }
 
-    _retcode = 0;
-
     return 0;
 }
 
@@ -98,6 +150,17 @@ int Mainloop::mod_fd(int fd, void *data, int events)
 {
     struct epoll_event epev = { };
 
+#ifdef ENABLE_IO_URING
+    if (_uring) {
+        int r = _uring->mod_fd(fd, data, events);
+        if (r < 0) {
+            log_error("Could not mod fd (%s)", strerror(-r));
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
     epev.events = events;
     epev.data.ptr = data;
 
@@ -113,6 +176,17 @@ int Mainloop::add_fd(int fd, void *data, int events)
 {
     struct epoll_event epev = { };
 
+#ifdef ENABLE_IO_URING
+    if (_uring) {
+        int r = _uring->add_fd(fd, data, events);
+        if (r < 0) {
+            log_error("Could not add fd to io_uring (%s)", strerror(-r));
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
     epev.events = events;
     epev.data.ptr = data;
 
@@ -126,6 +200,17 @@ int Mainloop::add_fd(int fd, void *data, int events)
 
 int Mainloop::remove_fd(int fd)
 {
+#ifdef ENABLE_IO_URING
+    if (_uring) {
+        int r = _uring->remove_fd(fd);
+        if (r < 0) {
+            log_error("Could not remove fd from io_uring (%s)", strerror(-r));
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
     if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
         log_error("Could not remove fd from epoll (%m)");
         return -1;
@@ -139,8 +224,8 @@ int Mainloop::write_msg(Endpoint *e, const struct buffer *buf)
     int r = e->write_msg(buf);
 
     /*
-     * If endpoint would block, add EPOLLOUT event to get notified when it's
-     * possible to write again
+     * If endpoint just blocked, add EPOLLOUT event to get notified when it's
+     * possible to write again. It's removed once its queue is flushed.
      */
     if (r == -EAGAIN)
         mod_fd(e->fd, e, EPOLLIN | EPOLLOUT);
@@ -150,118 +235,244 @@ int Mainloop::write_msg(Endpoint *e, const struct buffer *buf)
 
 void Mainloop::route_msg(struct buffer *buf, int target_sysid, int target_compid, int sender_sysid,
                          int sender_compid, uint32_t msg_id)
+{
+    bool unknown = !_route_local(buf, target_sysid, target_compid, sender_sysid, sender_compid,
+                                 msg_id);
+
+    if (_shards
+        && _forward_msg(buf, target_sysid, target_compid, sender_sysid, sender_compid, msg_id))
+        unknown = false;
+
+    /* Endpoints that queued the message hold their own reference */
+    Packet::release(buf);
+
+    if (unknown) {
+        _errors_aggregate.msg_to_unknown++;
+        log_debug("Message %u to unknown sysid/compid: %u/%u", msg_id, target_sysid, target_compid);
+    }
+}
+
+/*
+ * Write @buf to the endpoints of this shard that should receive it. Returns
+ * false if there's none.
+ */
+bool Mainloop::_route_local(struct buffer *buf, int target_sysid, int target_compid,
+                            int sender_sysid, int sender_compid, uint32_t msg_id)
 {
     bool unknown = true;
 
-    for (Endpoint **e = g_endpoints; *e != nullptr; e++) {
-        if ((*e)->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
-            log_debug("Endpoint [%d] accepted message %u to %d/%d from %u/%u", (*e)->fd, msg_id, target_sysid,
-                      target_compid, sender_sysid, sender_compid);
-            write_msg(*e, buf);
-            unknown = false;
+    _routing.for_each_target(target_sysid, target_compid, sender_sysid, sender_compid,
+                             [&](Endpoint *e) {
+        if (!e->accept_msg_id(msg_id))
+            return;
+
+        /* Rate limited, but it does have a destination */
+        unknown = false;
+        if (!e->accept_msg_rate(msg_id, sender_sysid, sender_compid))
+            return;
+
+        log_debug("Endpoint [%d] accepted message %u to %d/%d from %u/%u", e->fd, msg_id,
+                  target_sysid, target_compid, sender_sysid, sender_compid);
+        int r = write_msg(e, buf);
+        if (r == -EPIPE && !e->is_valid()) {
+            // Only TcpEndpoint may become invalid after a write
+            _tcp_hangup(static_cast<TcpEndpoint *>(e));
         }
+    });
+
+    return !unknown;
+}
+
+/*
+ * Hand @buf over to the other shards that may route it. Returns false if
+ * there's none.
+ */
+bool Mainloop::_forward_msg(struct buffer *buf, int target_sysid, int target_compid,
+                            int sender_sysid, int sender_compid, uint32_t msg_id)
+{
+    uint64_t shards = _shards->targets(target_sysid, target_compid) & ~(1ULL << _shard_id);
+    Packet *pkt;
+
+    if (!shards)
+        return false;
+
+    pkt = Packet::get(buf);
+    if (!pkt) {
+        _shard_stat.dropped += __builtin_popcountll(shards);
+        return true;
     }
 
-    for (struct endpoint_entry *e = g_tcp_endpoints; e; e = e->next) {
-        if (e->endpoint->accept_msg(target_sysid, target_compid, sender_sysid, sender_compid, msg_id)) {
-            log_debug("Endpoint [%d] accepted message %u to %d/%d from %u/%u", e->endpoint->fd, msg_id,
-                      target_sysid, target_compid, sender_sysid, sender_compid);
-            int r = write_msg(e->endpoint, buf);
-            if (r == -EPIPE) {
-                should_process_tcp_hangups = true;
-            }
-            unknown = false;
+    for (; shards; shards &= shards - 1) {
+        const unsigned shard = __builtin_ctzll(shards);
+        const ShardMsg msg = {pkt->ref(),
+                              (int16_t)target_sysid,
+                              (int16_t)target_compid,
+                              (uint8_t)sender_sysid,
+                              (uint8_t)sender_compid,
+                              msg_id};
+
+        if (!_shards->ring(_shard_id, shard).push(msg)) {
+            pkt->unref();
+            _shard_stat.dropped++;
+            continue;
         }
+
+        _shard_stat.forwarded++;
+        _doorbells_pending |= 1ULL << shard;
     }
 
-    if (unknown) {
-        _errors_aggregate.msg_to_unknown++;
-        log_debug("Message %u to unknown sysid/compid: %u/%u", msg_id, target_sysid, target_compid);
+    return true;
+}
+
+void Mainloop::_drain_shards()
+{
+    ShardMsg msg;
+    unsigned n = 0;
+
+    _shards->clear_doorbell(_shard_id);
+
+    for (unsigned from = 0; from < _shards->size(); from++) {
+        if (from == _shard_id)
+            continue;
+
+        ShardRing &ring = _shards->ring(from, _shard_id);
+
+        /* Don't starve our own endpoints if the other shard keeps pushing */
+        for (n = 0; n < ShardRing::SIZE && ring.pop(&msg); n++) {
+            struct buffer buf = {};
+
+            buf.len = msg.pkt->len;
+            buf.data = msg.pkt->data;
+            buf.pkt = msg.pkt;
+
+            _route_local(&buf, msg.target_sysid, msg.target_compid, msg.sender_sysid,
+                         msg.sender_compid, msg.msg_id);
+            Packet::release(&buf);
+        }
+
+        _shard_stat.received += n;
+        if (n == ShardRing::SIZE)
+            _doorbells_pending |= 1ULL << _shard_id;
     }
 }
 
+void Mainloop::_ring_doorbells()
+{
+    for (; _doorbells_pending; _doorbells_pending &= _doorbells_pending - 1)
+        _shards->ring_doorbell(__builtin_ctzll(_doorbells_pending));
+}
+
+void Mainloop::_tcp_hangup(TcpEndpoint *tcp)
+{
+    /* Removed at the end of the iteration, it may still have pending events */
+    _tcp_hangups.push_back(tcp->slot_key);
+}
+
 void Mainloop::process_tcp_hangups()
 {
-    // First, remove entries from the beginning of list, ensuring `g_tcp_endpoints` still
-    // points to list beginning
-    struct endpoint_entry **first = &g_tcp_endpoints;
-    while (*first && !(*first)->endpoint->is_valid()) {
-        struct endpoint_entry *next = (*first)->next;
-        remove_fd((*first)->endpoint->fd);
-        if ((*first)->endpoint->retry_timeout > 0) {
-            _add_tcp_retry((*first)->endpoint);
+    for (auto key : _tcp_hangups) {
+        TcpEndpoint **entry = g_tcp_endpoints.get(key);
+
+        // Already removed if it hung up more than once
+        if (!entry)
+            continue;
+
+        TcpEndpoint *tcp = *entry;
+        g_tcp_endpoints.remove(key);
+        remove_fd(tcp->fd);
+        _routing.remove_endpoint(tcp);
+        if (tcp->retry_timeout > 0) {
+            _add_tcp_retry(tcp);
         } else {
-            delete (*first)->endpoint;
-        }
-        free(*first);
-        *first = next;
-    }
-
-    // Remove other entries
-    if (*first) {
-        struct endpoint_entry *prev = *first;
-        struct endpoint_entry *current = prev->next;
-        while (current) {
-            if (!current->endpoint->is_valid()) {
-                prev->next = current->next;
-                remove_fd(current->endpoint->fd);
-                if (current->endpoint->retry_timeout > 0) {
-                    _add_tcp_retry(current->endpoint);
-                } else {
-                    delete current->endpoint;
-                }
-                free(current);
-                current = prev->next;
-            } else {
-                prev = current;
-                current = current->next;
-            }
+            delete tcp;
         }
     }
 
-    should_process_tcp_hangups = false;
+    _tcp_hangups.clear();
 }
 
 int Mainloop::_add_tcp_endpoint(TcpEndpoint *tcp)
 {
-    struct endpoint_entry *tcp_entry;
+    tcp->slot_key = g_tcp_endpoints.insert(tcp);
 
-    tcp_entry = (struct endpoint_entry *)calloc(1, sizeof(struct endpoint_entry));
-    if (!tcp_entry)
-        return -ENOMEM;
-
-    tcp_entry->next = g_tcp_endpoints;
-    tcp_entry->endpoint = tcp;
-    g_tcp_endpoints = tcp_entry;
-
-    add_fd(tcp->fd, tcp, EPOLLIN);
+    /* Writable once connected, see TcpEndpoint::handle_canwrite() */
+    add_fd(tcp->fd, tcp, tcp->is_connecting() ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    _routing.add_endpoint(tcp);
 
     return 0;
 }
 
 void Mainloop::handle_tcp_connection()
+{
+    /* Drain the backlog, but don't starve routing if clients keep coming */
+    for (unsigned i = 0; i < TCP_ACCEPT_MAX; i++) {
+        if (_accept_tcp_connection() == -EAGAIN)
+            break;
+    }
+}
+
+int Mainloop::_accept_tcp_connection()
 {
     TcpEndpoint *tcp = new TcpEndpoint{};
-    int fd;
-    int errno_copy;
+    int fd, err;
+
+    if (!tcp) {
+        log_error("Out of memory for new TCP client, rejecting connection");
+        return _reject_tcp_connection();
+    }
+
+    tcp->set_slow_consumer_policy(_tcp_slow_consumer);
 
     fd = tcp->accept(g_tcp_fd);
-    if (fd == -1)
-        goto accept_error;
+    if (fd == -1) {
+        err = errno;
+        delete tcp;
+
+        if (err == EAGAIN)
+            return -EAGAIN;
+
+        if (err == EMFILE || err == ENFILE) {
+            log_error("Too many open files, rejecting TCP connection");
+            return _reject_tcp_connection();
+        }
 
-    if (_add_tcp_endpoint(tcp) < 0)
-        goto add_error;
+        errno = err;
+        log_error("Could not accept TCP connection (%m)");
+        return -err;
+    }
+
+    if (_add_tcp_endpoint(tcp) < 0) {
+        log_error("Could not add TCP connection [%d]", fd);
+        delete tcp;
+        return -ENOMEM;
+    }
 
     log_debug("Accepted TCP connection on [%d]", fd);
-    return;
+    return 0;
+}
 
-add_error:
-    errno_copy = errno;
-    close(fd);
-    errno = errno_copy;
-accept_error:
-    log_error("Could not accept TCP connection (%m)");
-    delete tcp;
+/*
+ * Take a connection out of the backlog, otherwise we'd be woken up again.
+ * We may be out of fds: temporarily give up the spare one to do so.
+ */
+int Mainloop::_reject_tcp_connection()
+{
+    int fd, r = 0;
+
+    if (_spare_fd >= 0) {
+        close(_spare_fd);
+        _spare_fd = -1;
+    }
+
+    fd = accept4(g_tcp_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0)
+        close(fd);
+    else
+        r = -errno;
+
+    _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return r;
 }
 
 int Mainloop::loop()
@@ -270,18 +481,46 @@ int Mainloop::loop()
     struct epoll_event events[max_events];
     int r;
 
+#ifdef ENABLE_IO_URING
+    if (epollfd < 0 && !_uring)
+#else
     if (epollfd < 0)
+#endif
         return -EINVAL;
 
-    setup_signal_handlers();
+    _current = this;
+
+    if (_shard_id == 0)
+        setup_signal_handlers();
 
     add_timeout(LOG_AGGREGATE_INTERVAL_SEC * MSEC_PER_SEC,
                 std::bind(&Mainloop::_log_aggregate_timeout, this, std::placeholders::_1), this);
 
+    if (_shards && _shard_id == 0 && _shards->start() < 0)
+        request_exit(EXIT_FAILURE);
+
     while (!should_exit.load(std::memory_order_relaxed)) {
         int i;
 
-        r = epoll_wait(epollfd, events, max_events, -1);
+        _flush_batches();
+
+        _arm_timer();
+
+        if (_shards) {
+            _ring_doorbells();
+            _shards->offline(_shard_id);
+        }
+
+#ifdef ENABLE_IO_URING
+        if (_uring)
+            r = _uring->wait(events, max_events);
+        else
+#endif
+            r = epoll_wait(epollfd, events, max_events, -1);
+
+        if (_shards)
+            _shards->online(_shard_id);
+
         if (r < 0 && errno == EINTR)
             continue;
 
@@ -291,19 +530,32 @@ int Mainloop::loop()
                 continue;
             }
 
+            if (events[i].data.ptr == &_timer_fd) {
+                _run_timeouts();
+                continue;
+            }
+
+            if (_shards && events[i].data.ptr == _shards) {
+                _drain_shards();
+                continue;
+            }
+
             Pollable *p = static_cast<Pollable *>(events[i].data.ptr);
 
-            if (events[i].events & EPOLLIN) {
+            /* Pending errors, like a failed TCP connection, are reported by reading */
+            if (events[i].events & (EPOLLIN | EPOLLERR)) {
                 int rd = p->handle_read();
                 if (rd < 0 && !p->is_valid()) {
                     // Only TcpEndpoint may become invalid after a read
-                    should_process_tcp_hangups = true;
+                    _tcp_hangup(static_cast<TcpEndpoint *>(p));
                 }
             }
 
             if (events[i].events & EPOLLOUT) {
                 if (!p->handle_canwrite()) {
                     mod_fd(p->fd, p, EPOLLIN);
+                    if (!p->is_valid())
+                        _tcp_hangup(static_cast<TcpEndpoint *>(p));
                 }
             }
 
@@ -319,27 +571,43 @@ int Mainloop::loop()
             }
         }
 
-        if (should_process_tcp_hangups) {
+        if (!_tcp_hangups.empty()) {
             process_tcp_hangups();
         }
 
         _del_timeouts();
     }
 
+    if (_shards && _shard_id == 0) {
+        _shards->stop();
+
+        for (unsigned i = 1; i < _shards->size(); i++) {
+            if (_shards->loop(i)->_retcode)
+                _retcode = _shards->loop(i)->_retcode;
+        }
+    }
+
     if (_log_endpoint)
         _log_endpoint->stop();
 
-    // free all remaning Timeouts
-    while (_timeouts) {
-        Timeout *current = _timeouts;
-        _timeouts = current->next;
-        remove_fd(current->fd);
-        delete current;
-    }
+    /* Other shards may use their instance until they are stopped */
+    if (_shard_id == 0)
+        _initialized = false;
 
     return _retcode;
 }
 
+void Mainloop::_flush_batches()
+{
+    if (!g_endpoints)
+        return;
+
+    for (Endpoint **e = g_endpoints; *e != nullptr; e++) {
+        if ((*e)->flush_batch() == -EAGAIN)
+            mod_fd((*e)->fd, *e, EPOLLIN | EPOLLOUT);
+    }
+}
+
 bool Mainloop::_log_aggregate_timeout(void *data)
 {
     if (_errors_aggregate.msg_to_unknown > 0) {
@@ -354,19 +622,38 @@ bool Mainloop::_log_aggregate_timeout(void *data)
         }
     }
 
-    for (auto *t = g_tcp_endpoints; t; t = t->next) {
-        t->endpoint->log_aggregate(LOG_AGGREGATE_INTERVAL_SEC);
+    for (TcpEndpoint *tcp : g_tcp_endpoints) {
+        tcp->log_aggregate(LOG_AGGREGATE_INTERVAL_SEC);
     }
     return true;
 }
 
+/* Shards print their statistics from their own thread, one at a time */
+static std::mutex print_statistics_lock;
+
 void Mainloop::print_statistics()
 {
+    std::lock_guard<std::mutex> lock(print_statistics_lock);
+
     for (Endpoint **e = g_endpoints; *e != nullptr; e++)
         (*e)->print_statistics();
 
-    for (auto *t = g_tcp_endpoints; t; t = t->next)
-        t->endpoint->print_statistics();
+    for (TcpEndpoint *tcp : g_tcp_endpoints)
+        tcp->print_statistics();
+
+    if (_shards) {
+        printf("Shard %u {", _shard_id);
+        printf("\n\tForwarded: %" PRIu64, _shard_stat.forwarded);
+        printf("\n\tReceived: %" PRIu64, _shard_stat.received);
+        printf("\n\tDropped: %u", _shard_stat.dropped);
+        printf("\n}\n");
+    }
+
+    /* Other shards print their own endpoints */
+    if (_shard_id == 0)
+        Pool::print_statistics();
+
+    fflush(stdout);
 }
 
 static bool _print_statistics_timeout_cb(void *data)
@@ -378,14 +665,16 @@ static bool _print_statistics_timeout_cb(void *data)
 
 bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
 {
-    unsigned n_endpoints = 0, i = 0;
+    unsigned n_endpoints = 0, n_shardable = 0;
     struct endpoint_config *conf;
 
     for (conf = opt->endpoints; conf; conf = conf->next) {
         if (conf->type != Tcp) {
             // TCP endpoints are efemeral, that's why they don't
-            // live on `g_endpoints` array, but on `g_tcp_endpoints` list
+            // live on `g_endpoints` array, but on `g_tcp_endpoints` slot map
             n_endpoints++;
+            if (!conf->dedup_group)
+                n_shardable++;
         }
     }
 
@@ -395,9 +684,17 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
     g_endpoints = (Endpoint**) calloc(n_endpoints + 1, sizeof(Endpoint*));
     assert_or_return(g_endpoints, false);
 
+    if (opt->loop_window_msec)
+        _loop_cache = new LoopCache(opt->loop_window_msec * USEC_PER_MSEC);
+
+    if (opt->threads > 1 && !_open_shards(opt, n_endpoints, n_shardable))
+        return false;
+
     for (conf = opt->endpoints; conf; conf = conf->next) {
         switch (conf->type) {
         case Uart: {
+            /* Endpoints of a dedup group share it, so they all stay on this thread */
+            Mainloop *shard = conf->dedup_group ? this : _pick_shard();
             std::unique_ptr<UartEndpoint> uart{new UartEndpoint{}};
             if (uart->open(conf->device) < 0)
                 return false;
@@ -406,7 +703,7 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
                 if (uart->set_speed((*(conf->bauds))[0]) < 0)
                     return false;
             } else {
-                if (uart->add_speeds(*conf->bauds) < 0)
+                if (uart->add_speeds(*conf->bauds, *shard) < 0)
                     return false;
             }
 
@@ -415,14 +712,23 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
                     return false;
             }
 
-            g_endpoints[i] = uart.release();
-            mainloop.add_fd(g_endpoints[i]->fd, g_endpoints[i], EPOLLIN);
-            i++;
+            if (conf->egress)
+                uart->set_egress_scheduler(*conf->egress);
+            if (conf->rate_limiter)
+                uart->set_rate_limiter(*conf->rate_limiter);
+            if (conf->dedup_group)
+                uart->set_dedup_group(_get_dedup_group(conf->dedup_group));
+
+            shard->_add_endpoint(uart.release());
             break;
         }
         case Udp: {
-            std::unique_ptr<UdpEndpoint> udp{new UdpEndpoint{}};
-            if (udp->open(conf->address, conf->port, conf->eavesdropping) < 0) {
+            /* Servers aren't routed themselves, their peers are */
+            const bool server = conf->mode == UdpServer;
+            std::unique_ptr<UdpEndpoint> udp{server ? new UdpServerEndpoint{conf->peer_timeout}
+                                                    : new UdpEndpoint{}};
+            if (udp->open(conf->address, conf->port, conf->mode != UdpNormal, &conf->multicast)
+                < 0) {
                 log_error("Could not open %s:%ld", conf->address, conf->port);
                 return false;
             }
@@ -435,14 +741,65 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
                 } 
             }
 
-            g_endpoints[i] = udp.release();
-            mainloop.add_fd(g_endpoints[i]->fd, g_endpoints[i], EPOLLIN);
-            i++;
+            udp->set_trusted_source(conf->trusted);
+            udp->set_batch(conf->batch_size, conf->batch_max_latency);
+            if (conf->egress)
+                udp->set_egress_scheduler(*conf->egress);
+            if (conf->rate_limiter)
+                udp->set_rate_limiter(*conf->rate_limiter);
+
+            /* Endpoints of a dedup group share it, so they all stay on this thread */
+            if (conf->dedup_group) {
+                udp->set_dedup_group(_get_dedup_group(conf->dedup_group));
+                _add_endpoint(udp.release(), !server);
+                break;
+            }
+
+            _pick_shard()->_add_endpoint(udp.release(), !server);
+            break;
+        }
+        case Unix:
+        case Shm: {
+            std::unique_ptr<UnixEndpoint> unix_socket;
+            if (conf->type == Shm)
+                unix_socket.reset(new ShmEndpoint{(uint32_t)conf->ring_size});
+            else
+                unix_socket.reset(new UnixEndpoint{});
+            if (unix_socket->open(conf->address) < 0) {
+                log_error("Could not open %s", conf->address);
+                return false;
+            }
+
+            /* Taken by each client, which is routed instead of the endpoint */
+            unix_socket->set_trusted_source(conf->trusted);
+            unix_socket->set_slow_consumer_policy(conf->slow_consumer);
+            if (conf->egress)
+                unix_socket->set_egress_scheduler(*conf->egress);
+            if (conf->rate_limiter)
+                unix_socket->set_rate_limiter(*conf->rate_limiter);
+
+            /* Endpoints of a dedup group share it, so they all stay on this thread */
+            if (conf->dedup_group) {
+                unix_socket->set_dedup_group(_get_dedup_group(conf->dedup_group));
+                _add_endpoint(unix_socket.release(), false);
+                break;
+            }
+
+            _pick_shard()->_add_endpoint(unix_socket.release(), false);
             break;
         }
         case Tcp: {
             std::unique_ptr<TcpEndpoint> tcp{new TcpEndpoint{}};
+            assert_or_return(tcp, false);
             tcp->retry_timeout = conf->retry_timeout;
+            tcp->set_trusted_source(conf->trusted);
+            tcp->set_slow_consumer_policy(conf->slow_consumer);
+            if (conf->egress)
+                tcp->set_egress_scheduler(*conf->egress);
+            if (conf->rate_limiter)
+                tcp->set_rate_limiter(*conf->rate_limiter);
+            if (conf->dedup_group)
+                tcp->set_dedup_group(_get_dedup_group(conf->dedup_group));
             if (tcp->open(conf->address, conf->port) < 0) {
                 log_error("Could not open %s:%ld.", conf->address, conf->port);
                 if (tcp->retry_timeout > 0) {
@@ -464,8 +821,10 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
         }
     }
 
-    if (opt->tcp_port)
+    if (opt->tcp_port) {
+        _tcp_slow_consumer = opt->tcp_slow_consumer;
         g_tcp_fd = tcp_open(opt->tcp_port);
+    }
 
     if (opt->logs_dir) {
         if (opt->mavlink_dialect == Ardupilotmega) {
@@ -479,11 +838,178 @@ bool Mainloop::add_endpoints(Mainloop &mainloop, struct options *opt)
                                         opt->max_log_files);
         }
         _log_endpoint->mark_unfinished_logs();
-        g_endpoints[i] = _log_endpoint;
+        g_endpoints[_n_endpoints++] = _log_endpoint;
+        _routing.add_endpoint(_log_endpoint);
     }
 
-    if (opt->report_msg_statistics)
+    if (opt->report_msg_statistics) {
         add_timeout(MSEC_PER_SEC, _print_statistics_timeout_cb, this);
+        for (unsigned s = 1; _shards && s < _shards->size(); s++) {
+            Mainloop *shard = _shards->loop(s);
+            shard->add_timeout(MSEC_PER_SEC, _print_statistics_timeout_cb, shard);
+        }
+    }
+
+    if (!_reserve_pools(opt))
+        return false;
+
+    Pool::end_startup(opt->no_heap_after_startup);
+
+    return true;
+}
+
+void Mainloop::_add_endpoint(Endpoint *e, bool routed)
+{
+    g_endpoints[_n_endpoints++] = e;
+#ifdef ENABLE_IO_URING
+    if (!_uring || !e->receive_from(*_uring))
+#endif
+        add_fd(e->fd, e, EPOLLIN);
+    if (routed)
+        _routing.add_endpoint(e);
+}
+
+DedupGroup *Mainloop::_get_dedup_group(const char *name)
+{
+    for (auto &group : _dedup_groups) {
+        if (strcmp(group->name(), name) == 0)
+            return group.get();
+    }
+
+    _dedup_groups.emplace_back(new DedupGroup{name});
+    return _dedup_groups.back().get();
+}
+
+/*
+ * Create the Mainloops of the other shards. UART, UDP, Unix and Shm endpoints are
+ * then spread over all shards, while TCP and logging stay on this one.
+ */
+bool Mainloop::_open_shards(struct options *opt, unsigned n_endpoints, unsigned n_shardable)
+{
+    unsigned n = opt->threads;
+
+    if (n > ShardSet::MAX_SHARDS)
+        n = ShardSet::MAX_SHARDS;
+    /* No point in having idle shards */
+    if (n > n_shardable + 1)
+        n = n_shardable + 1;
+    if (n < 2)
+        return true;
+
+    _shards = new ShardSet(n);
+    if (_shards->open() < 0)
+        return false;
+
+    _shards->loop(0) = this;
+    for (unsigned s = 1; s < n; s++) {
+        Mainloop *shard = new Mainloop();
+
+        _shards->loop(s) = shard;
+        shard->_shards = _shards;
+        shard->_shard_id = s;
+        shard->_loop_cache = _loop_cache;
+        shard->g_endpoints = (Endpoint **)calloc(n_endpoints + 1, sizeof(Endpoint *));
+        assert_or_return(shard->g_endpoints, false);
+        if (shard->open(opt->event_backend) < 0)
+            return false;
+    }
+
+    for (unsigned s = 0; s < n; s++) {
+        Mainloop *shard = _shards->loop(s);
+
+        shard->add_fd(_shards->doorbell_fd(s), _shards, EPOLLIN);
+        shard->_routing.set_new_sys_comp_id_cb(
+            [this, s](uint16_t sys_comp_id) { _shards->add_sys_comp_id(s, sys_comp_id); });
+    }
+
+    /* Packets, timeouts, etc. are now allocated and freed from all shards */
+    Pool::set_threaded(true);
+    if (_loop_cache)
+        _loop_cache->set_threaded(true);
+
+    log_info("Routing on %u threads", n);
+
+    return true;
+}
+
+Mainloop *Mainloop::_pick_shard()
+{
+    if (!_shards)
+        return this;
+
+    /* Start with other shards: this one also has TCP and logging */
+    _next_shard = (_next_shard + 1) % _shards->size();
+    return _shards->loop(_next_shard);
+}
+
+void Mainloop::_free_shards()
+{
+    for (unsigned s = 1; s < _shards->size(); s++) {
+        Mainloop *shard = _shards->loop(s);
+
+        if (!shard)
+            continue;
+
+        for (Endpoint **e = shard->g_endpoints; e && *e; e++)
+            delete *e;
+        free(shard->g_endpoints);
+        shard->_free_timeouts();
+
+        if (shard->_timer_fd >= 0)
+            close(shard->_timer_fd);
+
+        if (shard->epollfd >= 0)
+            close(shard->epollfd);
+#ifdef ENABLE_IO_URING
+        delete shard->_uring;
+#endif
+        delete shard;
+    }
+
+    delete _shards;
+    _shards = nullptr;
+}
+
+bool Mainloop::_reserve_pools(struct options *opt)
+{
+    unsigned n_static = 0, n_tcp = 0;
+
+    for (struct endpoint_config *conf = opt->endpoints; conf; conf = conf->next) {
+        if (conf->type == Tcp)
+            n_tcp++;
+        else
+            n_static++;
+    }
+
+    /*
+     * Static endpoints already have their buffers, except for the TX queue
+     * ring that is only allocated when they block. Leave room for the TCP
+     * clients, the retry timeouts of TCP endpoints, log timeouts and the
+     * logger created later by AutoLog. TCP endpoints only have an RX buffer
+     * while reading.
+     */
+    g_tcp_endpoints.reserve(opt->prealloc_tcp_clients + n_tcp);
+    _tcp_hangups.reserve(opt->prealloc_tcp_clients + n_tcp);
+
+    if (TcpEndpoint::pool.reserve(opt->prealloc_tcp_clients) < 0
+        || Endpoint::rx_buf_pool.reserve(opt->prealloc_tcp_clients + n_tcp + 1) < 0
+        || Endpoint::tx_ring_pool.reserve(opt->prealloc_tcp_clients + n_tcp + n_static + 1) < 0
+        || Timeout::pool.reserve(n_tcp + 4) < 0
+        || Packet::pool.reserve(opt->prealloc_packets) < 0) {
+        log_error("Could not preallocate memory pools");
+        return false;
+    }
+
+#ifdef ENABLE_IO_URING
+    /* One poll per endpoint, TCP client, timerfd, shard doorbell and the TCP server */
+    if (_uring
+        && UringPoller::poll_pool.reserve(n_static + n_tcp + opt->prealloc_tcp_clients + 4
+                                          + (_shards ? 2 * _shards->size() : 0))
+            < 0) {
+        log_error("Could not preallocate memory pools");
+        return false;
+    }
+#endif
 
     return true;
 }
@@ -495,21 +1021,36 @@ void Mainloop::free_endpoints(struct options *opt)
     }
     free(g_endpoints);
 
-    for (auto *t = g_tcp_endpoints; t;) {
-        auto next = t->next;
-        delete t->endpoint;
-        free(t);
-        t = next;
-    }
+    if (_shards)
+        _free_shards();
+
+    /* After the endpoints: they remove their timeouts when destroyed */
+    _free_timeouts();
+
+    for (TcpEndpoint *tcp : g_tcp_endpoints)
+        delete tcp;
+
+#ifdef ENABLE_IO_URING
+    /* After the endpoints, like for shards: it releases what they polled */
+    delete _uring;
+    _uring = nullptr;
+#endif
+
+    _dedup_groups.clear();
+    delete _loop_cache;
+    _loop_cache = nullptr;
 
     for (auto e = opt->endpoints; e;) {
         auto next = e->next;
-        if (e->type == Udp || e->type == Tcp) {
+        if (e->type == Udp || e->type == Tcp || e->type == Unix || e->type == Shm) {
             free(e->address);
         } else {
             free(e->device);
             delete e->bauds;
         }
+        delete e->egress;
+        delete e->rate_limiter;
+        free(e->dedup_group);
         free(e->name);
         free(e);
         e = next;
@@ -520,8 +1061,18 @@ int Mainloop::tcp_open(unsigned long tcp_port)
 {
     int fd;
     struct sockaddr_in sockaddr = { };
+    struct rlimit rl;
     int val = 1;
 
+    /* Each client takes an fd: allow as many as we can */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            log_warning("Could not raise the limit of open files (%m)");
+    }
+
+    _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+
     fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (fd == -1) {
         log_error("Could not create tcp socket (%m)");
@@ -555,79 +1106,100 @@ int Mainloop::tcp_open(unsigned long tcp_port)
 
 Timeout *Mainloop::add_timeout(uint32_t timeout_msec, std::function<bool(void*)> cb, const void *data)
 {
-    struct itimerspec ts;
     Timeout *t = new Timeout(cb, data);
 
     assert_or_return(t, NULL);
 
-    t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-    if (t->fd < 0) {
-        log_error("Unable to create timerfd: %m");
-        goto error;
-    }
-
-    ts.it_interval.tv_sec = timeout_msec / MSEC_PER_SEC;
-    ts.it_interval.tv_nsec = (timeout_msec % MSEC_PER_SEC) * NSEC_PER_MSEC;
-    ts.it_value.tv_sec = ts.it_interval.tv_sec;
-    ts.it_value.tv_nsec = ts.it_interval.tv_nsec;
-    timerfd_settime(t->fd, 0, &ts, NULL);
-
-    if (add_fd(t->fd, t, EPOLLIN) < 0)
-        goto error;
-
-    t->next = _timeouts;
-    _timeouts = t;
+    _timers.add(t, timeout_msec, now_usec() / USEC_PER_MSEC);
 
     return t;
-
-error:
-    delete t;
-    return NULL;
 }
 
 void Mainloop::del_timeout(Timeout *t)
 {
+    if (t->remove_me)
+        return;
+
+    /* Freed at the end of the iteration, its owner may still be using it */
     t->remove_me = true;
+    t->unlink();
+    _removed_timeouts.push_back(t);
 }
 
 void Mainloop::_del_timeouts()
 {
-    // Guarantee one valid Timeout on the beginning of the list
-    while (_timeouts && _timeouts->remove_me) {
-        Timeout *next = _timeouts->next;
-        remove_fd(_timeouts->fd);
-        delete _timeouts;
-        _timeouts = next;
-    }
-
-    // Remove all other Timeouts
-    if (_timeouts) {
-        Timeout *prev = _timeouts;
-        Timeout *current = _timeouts->next;
-        while (current) {
-            if (current->remove_me) {
-                prev->next = current->next;
-                remove_fd(current->fd);
-                delete current;
-                current = prev->next;
-            } else {
-                prev = current;
-                current = current->next;
-            }
-        }
+    while (!_removed_timeouts.empty()) {
+        Timeout *t = static_cast<Timeout *>(_removed_timeouts.next);
+        t->unlink();
+        delete t;
     }
 }
 
+void Mainloop::_free_timeouts()
+{
+    Timeout *t;
+
+    _del_timeouts();
+
+    while ((t = _timers.first())) {
+        t->unlink();
+        delete t;
+    }
+}
+
+void Mainloop::_run_timeouts()
+{
+    const uint64_t now = now_usec() / USEC_PER_MSEC;
+    uint64_t val;
+    Timeout *t;
+
+    (void)read(_timer_fd, &val, sizeof(val));
+    _timer_armed_msec = UINT64_MAX;
+
+    while ((t = _timers.pop_expired(now))) {
+        if (!t->fire())
+            del_timeout(t);
+        else if (!t->remove_me)
+            _timers.rearm(t, now);
+    }
+}
+
+void Mainloop::_arm_timer()
+{
+    const uint64_t next = _timers.next_expiration();
+    struct itimerspec ts = {};
+
+    if (next == _timer_armed_msec)
+        return;
+
+    /* Absolute time: if it's already past, the timerfd fires right away */
+    if (next != UINT64_MAX) {
+        ts.it_value.tv_sec = next / MSEC_PER_SEC;
+        ts.it_value.tv_nsec = (next % MSEC_PER_SEC) * NSEC_PER_MSEC;
+    }
+
+    if (timerfd_settime(_timer_fd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+        log_error("Unable to arm timerfd: %m");
+        return;
+    }
+
+    _timer_armed_msec = next;
+}
+
 void Mainloop::_add_tcp_retry(TcpEndpoint *tcp)
 {
-    Timeout *t
-        ;
+    uint32_t delay_msec;
+    Timeout *t;
+
     if (tcp->retry_timeout <= 0) {
         return;
     }
 
     tcp->close();
-    t = add_timeout(MSEC_PER_SEC * tcp->retry_timeout,
+    delay_msec = tcp->next_retry_msec();
+    log_debug("Reconnecting to %s:%lu in %ums", tcp->get_ip(), tcp->get_port(), delay_msec);
+
+    t = add_timeout(delay_msec,
             std::bind(&Mainloop::_retry_timeout_cb, this, std::placeholders::_1),
             tcp);
 
@@ -641,14 +1213,9 @@ bool Mainloop::_retry_timeout_cb(void *data)
 {
     TcpEndpoint *tcp = (TcpEndpoint *)data;
 
-    if (tcp->open(tcp->get_ip(), tcp->get_port()) < 0) {
-        return true;
-    }
-
-    if (_add_tcp_endpoint(tcp) < 0) {
-        tcp->close();
-        return true;
-    }
+    /* Either way this timeout is done: the next attempt has its own delay */
+    if (tcp->open(tcp->get_ip(), tcp->get_port()) < 0 || _add_tcp_endpoint(tcp) < 0)
+        _add_tcp_retry(tcp);
 
     return false;
 }
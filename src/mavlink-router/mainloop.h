@@ -17,20 +17,24 @@
  */
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "binlog.h"
 #include "comm.h"
 #include "endpoint.h"
+#include "routing.h"
+#include "shard.h"
+#include "slot_map.h"
 #include "timeout.h"
 #include "ulog.h"
+#include "uring_poller.h"
 
-struct endpoint_entry {
-    struct endpoint_entry *next;
-    TcpEndpoint *endpoint;
-};
+enum event_backend { Epoll, IoUring };
 
 class Mainloop {
 public:
-    int open();
+    int open(enum event_backend backend = Epoll);
     int add_fd(int fd, void *data, int events);
     int mod_fd(int fd, void *data, int events);
     int remove_fd(int fd);
@@ -42,6 +46,23 @@ public:
     void handle_tcp_connection();
     int write_msg(Endpoint *e, const struct buffer *buf);
     void process_tcp_hangups();
+
+    /*
+     * Return true if the message was already routed recently and came back
+     * through a loop of routers, see LoopCache
+     */
+    bool seen_recently(const struct buffer *buf, uint8_t sysid, uint8_t compid, uint32_t msg_id)
+    {
+        return _loop_cache && _loop_cache->seen(buf, sysid, compid, msg_id, now_usec());
+    }
+
+    bool has_loop_cache() const { return _loop_cache != nullptr; }
+
+    /*
+     * Route messages to @e, an endpoint that isn't polled on its own, like
+     * the peers of a UDP server. It's removed when destroyed.
+     */
+    void add_route(Endpoint *e) { _routing.add_endpoint(e); }
     Timeout *add_timeout(uint32_t timeout_msec, std::function<bool(void*)> cb, const void *data);
     void del_timeout(Timeout *t);
 
@@ -51,16 +72,16 @@ public:
     void print_statistics();
 
     int epollfd = -1;
-    bool should_process_tcp_hangups = false;
 
     /*
-     * Return singleton for this class, tied to the main thread. It needds to
-     * be called after a call to Mainloop::init().
+     * Return the Mainloop of the calling thread: the singleton for this class
+     * or, on shard threads, the shard's own. It needds to be called after a
+     * call to Mainloop::init().
      */
     static Mainloop &get_instance()
     {
         assert(_initialized);
-        return _instance;
+        return *_current;
     }
 
     /*
@@ -78,13 +99,33 @@ public:
 
 private:
     static const unsigned int LOG_AGGREGATE_INTERVAL_SEC = 5;
+    /* Connections accepted per wakeup of the TCP server */
+    static const unsigned int TCP_ACCEPT_MAX = 64;
 
-    endpoint_entry *g_tcp_endpoints = nullptr;
+    SlotMap<TcpEndpoint *> g_tcp_endpoints;
+    /* TCP endpoints that hung up during this iteration */
+    std::vector<SlotMap<TcpEndpoint *>::Key> _tcp_hangups;
     Endpoint **g_endpoints = nullptr;
     int g_tcp_fd = -1;
+    /* Given up to accept a connection when out of fds, see _reject_tcp_connection() */
+    int _spare_fd = -1;
+    struct slow_consumer_policy _tcp_slow_consumer;
     LogEndpoint *_log_endpoint = nullptr;
-
-    Timeout *_timeouts = nullptr;
+    RoutingTable _routing;
+    std::vector<std::unique_ptr<DedupGroup>> _dedup_groups;
+    /* Shared by all shards, owned by the first one */
+    LoopCache *_loop_cache = nullptr;
+
+    TimerWheel _timers;
+    /* Timeouts removed during this iteration */
+    TimerList _removed_timeouts;
+    int _timer_fd = -1;
+    uint64_t _timer_armed_msec = UINT64_MAX;
+
+#ifdef ENABLE_IO_URING
+    /* Used instead of epollfd if EventBackend=io_uring */
+    UringPoller *_uring = nullptr;
+#endif
 
     struct {
         uint32_t msg_to_unknown = 0;
@@ -92,12 +133,45 @@ private:
 
     int _retcode;
 
+    /* Set if endpoints are spread over several threads, see ShardSet */
+    ShardSet *_shards = nullptr;
+    unsigned _shard_id = 0;
+    unsigned _next_shard = 0;
+    uint64_t _doorbells_pending = 0;
+    unsigned _n_endpoints = 0;
+
+    struct {
+        uint64_t forwarded = 0;
+        uint64_t received = 0;
+        uint32_t dropped = 0;
+    } _shard_stat;
+
     int tcp_open(unsigned long tcp_port);
+    int _open_poller(enum event_backend backend);
     void _del_timeouts();
+    void _free_timeouts();
+    void _run_timeouts();
+    void _arm_timer();
     int _add_tcp_endpoint(TcpEndpoint *tcp);
+    void _tcp_hangup(TcpEndpoint *tcp);
+    int _accept_tcp_connection();
+    int _reject_tcp_connection();
     void _add_tcp_retry(TcpEndpoint *tcp);
     bool _retry_timeout_cb(void *data);
     bool _log_aggregate_timeout(void *data);
+    void _flush_batches();
+    bool _reserve_pools(struct options *opt);
+    void _add_endpoint(Endpoint *e, bool routed = true);
+    DedupGroup *_get_dedup_group(const char *name);
+    bool _route_local(struct buffer *buf, int target_sysid, int target_compid, int sender_sysid,
+                      int sender_compid, uint32_t msg_id);
+    bool _open_shards(struct options *opt, unsigned n_endpoints, unsigned n_shardable);
+    Mainloop *_pick_shard();
+    bool _forward_msg(struct buffer *buf, int target_sysid, int target_compid, int sender_sysid,
+                      int sender_compid, uint32_t msg_id);
+    void _drain_shards();
+    void _ring_doorbells();
+    void _free_shards();
 
     Mainloop() { }
     Mainloop(const Mainloop &) = delete;
@@ -105,9 +179,11 @@ private:
 
     static Mainloop _instance;
     static bool _initialized;
+    static thread_local Mainloop *_current;
 };
 
-enum endpoint_type { Tcp, Uart, Udp, Unknown };
+enum endpoint_type { Tcp, Uart, Udp, Unix, Shm, Unknown };
+enum udp_mode { UdpNormal, UdpEavesdropping, UdpServer };
 enum mavlink_dialect { Auto, Common, Ardupilotmega };
 
 struct endpoint_config {
@@ -116,10 +192,19 @@ struct endpoint_config {
     enum endpoint_type type;
     union {
         struct {
+            /* Or path of a Unix socket */
             char *address;
             long unsigned port;
             int retry_timeout;
-            bool eavesdropping;
+            enum udp_mode mode;
+            unsigned long peer_timeout;
+            struct udp_multicast multicast;
+            bool trusted;
+            unsigned long batch_size;
+            unsigned long batch_max_latency;
+            struct slow_consumer_policy slow_consumer;
+            /* Of each ring of a Shm client */
+            unsigned long ring_size;
         };
         struct {
             char *device;
@@ -128,6 +213,11 @@ struct endpoint_config {
         };
     };
     char *filter;
+    /* Set if messages are written by priority class, see EgressScheduler */
+    EgressScheduler *egress;
+    RateLimiter *rate_limiter;
+    /* Endpoints with the same one share a DedupGroup */
+    char *dedup_group;
 };
 
 struct options {
@@ -142,4 +232,13 @@ struct options {
     enum mavlink_dialect mavlink_dialect;
     unsigned long min_free_space;
     unsigned long max_log_files;
+    unsigned long prealloc_tcp_clients;
+    unsigned long prealloc_packets;
+    bool no_heap_after_startup;
+    enum event_backend event_backend;
+    unsigned long threads;
+    /* How long routed messages are remembered to drop looped copies, 0 to disable */
+    unsigned long loop_window_msec;
+    /* For clients of the TCP server */
+    struct slow_consumer_policy tcp_slow_consumer;
 };
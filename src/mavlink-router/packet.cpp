@@ -0,0 +1,68 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "packet.h"
+
+#include <string.h>
+
+#include <new>
+
+Pool Packet::pool{"Packet", sizeof(Packet), 64};
+
+Packet *Packet::get(const struct buffer *buf)
+{
+    Packet *pkt;
+    void *mem;
+
+    if (buf->pkt)
+        return buf->pkt;
+
+    if (buf->len > sizeof(pkt->data))
+        return nullptr;
+
+    mem = pool.alloc();
+    if (!mem)
+        return nullptr;
+
+    pkt = new (mem) Packet;
+
+    pkt->_refcount.store(1, std::memory_order_relaxed);
+    pkt->len = buf->len;
+    pkt->queued_usec = now_usec();
+    memcpy(pkt->data, buf->data, buf->len);
+
+    buf->pkt = pkt;
+
+    return pkt;
+}
+
+void Packet::release(struct buffer *buf)
+{
+    if (!buf->pkt)
+        return;
+
+    buf->pkt->unref();
+    buf->pkt = nullptr;
+}
+
+void Packet::unref()
+{
+    if (_refcount.fetch_sub(1, std::memory_order_acq_rel) > 1)
+        return;
+
+    pool.free(this);
+}
@@ -0,0 +1,87 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <common/mavlink.h>
+#include <common/util.h>
+
+#include <atomic>
+
+#include "comm.h"
+#include "pool.h"
+
+/*
+ * Reference counted copy of a message, shared by all endpoints that need to
+ * keep it after it's routed.
+ *
+ * Messages are routed straight from the ingress endpoint's rx_buf: they are
+ * only copied to a Packet when the first endpoint can't write them right away.
+ * Other endpoints queueing the same message just take a new reference, so
+ * fanning it out to many blocked clients costs a single copy. Messages handed
+ * to other shards (see ShardSet) are always copied, so the reference count
+ * is atomic.
+ */
+class Packet {
+public:
+    /*
+     * Return the Packet holding @buf's data, creating it on first use. The
+     * reference belongs to @buf: take a new one to keep the Packet around
+     * after release() is called on @buf.
+     */
+    static Packet *get(const struct buffer *buf);
+
+    /*
+     * Drop @buf's reference, if it has one
+     */
+    static void release(struct buffer *buf);
+
+    Packet *ref()
+    {
+        _refcount.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+
+    void unref();
+
+    uint32_t msg_id() const
+    {
+        if (data[0] == MAVLINK_STX)
+            return data[7] | data[8] << 8 | data[9] << 16;
+        return data[5];
+    }
+
+    /* sysid << 8 | compid of the sender */
+    uint16_t sys_comp_id() const
+    {
+        if (data[0] == MAVLINK_STX)
+            return data[5] << 8 | data[6];
+        return data[3] << 8 | data[4];
+    }
+
+    unsigned len;
+    /* When it was created, i.e. when endpoints started queueing it */
+    usec_t queued_usec;
+    uint8_t data[MAVLINK_MAX_PACKET_LEN];
+
+    static Pool pool;
+
+private:
+    Packet() { }
+
+    std::atomic<unsigned> _refcount;
+};
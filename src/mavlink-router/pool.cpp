@@ -0,0 +1,174 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "pool.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+Pool *Pool::_pools = nullptr;
+bool Pool::_startup_done = false;
+bool Pool::_no_heap = false;
+bool Pool::_threaded = false;
+
+Pool::Pool(const char *name, size_t block_size, unsigned chunk_blocks)
+    : _name{name}
+    , _chunk_blocks{chunk_blocks}
+{
+    /* Blocks in the free list hold the pointer to the next one */
+    if (block_size < sizeof(void *))
+        block_size = sizeof(void *);
+    _block_size = (block_size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+    _next = _pools;
+    _pools = this;
+}
+
+Pool::~Pool()
+{
+    while (_chunks) {
+        Chunk *next = _chunks->next;
+        ::free(_chunks);
+        _chunks = next;
+    }
+
+    for (Pool **p = &_pools; *p; p = &(*p)->_next) {
+        if (*p == this) {
+            *p = _next;
+            break;
+        }
+    }
+}
+
+int Pool::_grow(unsigned n)
+{
+    const size_t header = (sizeof(Chunk) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    uint8_t *mem;
+    Chunk *chunk;
+
+    if (_startup_done) {
+        if (_no_heap) {
+            _stat.failed++;
+            return -ENOMEM;
+        }
+        _stat.heap_allocs_after_startup++;
+    }
+
+    mem = (uint8_t *)malloc(header + n * _block_size);
+    if (!mem) {
+        _stat.failed++;
+        return -ENOMEM;
+    }
+
+    chunk = (Chunk *)mem;
+    chunk->next = _chunks;
+    _chunks = chunk;
+
+    for (unsigned i = 0; i < n; i++) {
+        void **block = (void **)(mem + header + i * _block_size);
+        *block = _free_list;
+        _free_list = block;
+    }
+
+    _stat.capacity += n;
+
+    return 0;
+}
+
+void *Pool::alloc()
+{
+    if (_threaded) {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _alloc();
+    }
+
+    return _alloc();
+}
+
+void *Pool::_alloc()
+{
+    void **block;
+
+    if (!_free_list && _grow(_chunk_blocks) < 0)
+        return nullptr;
+
+    block = (void **)_free_list;
+    _free_list = *block;
+
+    _stat.allocs++;
+    _stat.in_use++;
+    if (_stat.in_use > _stat.peak)
+        _stat.peak = _stat.in_use;
+
+    return block;
+}
+
+void Pool::free(void *block)
+{
+    if (!block)
+        return;
+
+    if (_threaded) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _free(block);
+        return;
+    }
+
+    _free(block);
+}
+
+void Pool::_free(void *block)
+{
+    *(void **)block = _free_list;
+    _free_list = block;
+
+    _stat.in_use--;
+}
+
+int Pool::reserve(unsigned n)
+{
+    if (_stat.capacity - _stat.in_use >= n)
+        return 0;
+
+    return _grow(n - (_stat.capacity - _stat.in_use));
+}
+
+void Pool::end_startup(bool no_heap)
+{
+    _startup_done = true;
+    _no_heap = no_heap;
+}
+
+void Pool::print_statistics()
+{
+    for (Pool *p = _pools; p; p = p->_next) {
+        std::unique_lock<std::mutex> lock(p->_lock, std::defer_lock);
+
+        if (_threaded)
+            lock.lock();
+
+        printf("Pool %s {", p->_name);
+        printf("\n\tIn use: %u (peak %u)", p->_stat.in_use, p->_stat.peak);
+        printf("\n\tCapacity: %u", p->_stat.capacity);
+        printf("\n\tAllocations: %" PRIu64, p->_stat.allocs);
+        printf("\n\tHeap allocations after startup: %u", p->_stat.heap_allocs_after_startup);
+        printf("\n\tFailed: %u", p->_stat.failed);
+        printf("\n}\n");
+    }
+}
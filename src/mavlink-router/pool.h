@@ -0,0 +1,96 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+/*
+ * Fixed-size block allocator for objects created and destroyed while routing:
+ * packets, TCP clients, timeouts, etc.
+ *
+ * Blocks are carved from chunks allocated on the heap and recycled through a
+ * free list; chunks are never given back. Pools can be filled at startup with
+ * reserve() and, after Pool::end_startup(), growing a pool is counted as a
+ * heap allocation after startup or, if that is not allowed, fails.
+ *
+ * Pools are only locked once Pool::set_threaded() is called, when endpoints
+ * run on several threads.
+ */
+class Pool {
+public:
+    Pool(const char *name, size_t block_size, unsigned chunk_blocks = 16);
+    ~Pool();
+
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+
+    void *alloc();
+    void free(void *block);
+
+    /*
+     * Make sure @n blocks can be allocated without growing the pool
+     */
+    int reserve(unsigned n);
+
+    /*
+     * Mark the end of startup. If @no_heap is true, pools won't grow anymore
+     * and allocations fail when they are exhausted.
+     */
+    static void end_startup(bool no_heap);
+
+    static void set_threaded(bool threaded) { _threaded = threaded; }
+
+    static void print_statistics();
+
+private:
+    struct Chunk {
+        Chunk *next;
+    };
+
+    int _grow(unsigned n);
+    void *_alloc();
+    void _free(void *block);
+
+    const char *_name;
+    size_t _block_size;
+    unsigned _chunk_blocks;
+
+    std::mutex _lock;
+    void *_free_list = nullptr;
+    Chunk *_chunks = nullptr;
+
+    struct {
+        uint64_t allocs = 0;
+        uint32_t in_use = 0;
+        uint32_t peak = 0;
+        uint32_t capacity = 0;
+        uint32_t heap_allocs_after_startup = 0;
+        uint32_t failed = 0;
+    } _stat;
+
+    /* All pools, for statistics */
+    Pool *_next;
+    static Pool *_pools;
+
+    static bool _startup_done;
+    static bool _no_heap;
+    static bool _threaded;
+};
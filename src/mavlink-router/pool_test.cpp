@@ -0,0 +1,42 @@
+#include "pool.h"
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+
+#include <set>
+
+TEST(PoolTest, recycle) {
+    Pool pool{"test", 100, 4};
+    std::set<void *> blocks;
+
+    for (int i = 0; i < 10; i++) {
+        void *p = pool.alloc();
+        ASSERT_NE(p, nullptr);
+        EXPECT_EQ((uintptr_t)p % alignof(max_align_t), 0U);
+        EXPECT_TRUE(blocks.insert(p).second);
+    }
+
+    // Freed blocks are handed out again
+    void *p = *blocks.begin();
+    pool.free(p);
+    EXPECT_EQ(pool.alloc(), p);
+}
+
+TEST(PoolTest, no_heap_after_startup) {
+    Pool pool{"test", 8, 4};
+    void *blocks[6];
+
+    ASSERT_EQ(pool.reserve(6), 0);
+    Pool::end_startup(true);
+
+    for (int i = 0; i < 6; i++) {
+        blocks[i] = pool.alloc();
+        ASSERT_NE(blocks[i], nullptr);
+    }
+    EXPECT_EQ(pool.alloc(), nullptr);
+
+    pool.free(blocks[3]);
+    EXPECT_EQ(pool.alloc(), blocks[3]);
+    EXPECT_EQ(pool.alloc(), nullptr);
+}
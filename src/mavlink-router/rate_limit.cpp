@@ -0,0 +1,74 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "rate_limit.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+void RateLimiter::add_limit(uint32_t msg_id, double rate, unsigned burst)
+{
+    const usec_t interval_usec = (usec_t)(USEC_PER_SEC / rate);
+
+    _limits[msg_id] = {interval_usec, interval_usec * (std::max(burst, 1U) - 1), 0, 0};
+}
+
+bool RateLimiter::allow(uint32_t msg_id, uint8_t src_sysid, uint8_t src_compid,
+                        usec_t now_usec)
+{
+    auto it = _limits.find(msg_id);
+
+    if (it == _limits.end())
+        return true;
+
+    Limit &limit = it->second;
+    usec_t &tat = _buckets[(uint64_t)msg_id << 16 | src_sysid << 8 | src_compid];
+
+    if (tat < now_usec)
+        tat = now_usec;
+
+    if (tat - now_usec > limit.burst_usec) {
+        limit.dropped++;
+        return false;
+    }
+
+    tat += limit.interval_usec;
+    limit.passed++;
+
+    return true;
+}
+
+void RateLimiter::print_statistics() const
+{
+    std::vector<uint32_t> msg_ids;
+
+    for (auto &it : _limits)
+        msg_ids.push_back(it.first);
+    std::sort(msg_ids.begin(), msg_ids.end());
+
+    printf("\n\tRate limits {");
+    for (uint32_t msg_id : msg_ids) {
+        const Limit &limit = _limits.at(msg_id);
+
+        printf("\n\t\tMessage %u: %u passed, %u dropped (every %" PRIu64 "ms)", msg_id,
+               limit.passed, limit.dropped, limit.interval_usec / USEC_PER_MSEC);
+    }
+    printf("\n\t}");
+}
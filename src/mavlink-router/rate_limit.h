@@ -0,0 +1,67 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <common/util.h>
+
+#include <stdint.h>
+
+#include <unordered_map>
+
+/*
+ * Per message id rate limits of an endpoint.
+ *
+ * Each source (sysid/compid) of a limited message has its own token bucket,
+ * implemented as the generic cell rate algorithm: rather than a token count,
+ * a bucket only keeps the theoretical arrival time of the next message,
+ * which moves forward by the message interval each time one goes through.
+ * A message is dropped if that would put it more than the burst ahead of
+ * now. Both lookups are in hash tables, so the cost doesn't depend on the
+ * number of limits or sources.
+ */
+class RateLimiter {
+public:
+    /*
+     * Let at most @rate messages with @msg_id per second through, from each
+     * source, and up to @burst of them at once
+     */
+    void add_limit(uint32_t msg_id, double rate, unsigned burst = 1);
+
+    bool enabled() const { return !_limits.empty(); }
+
+    /*
+     * Return true if a message can be sent at @now_usec, false if it should
+     * be dropped
+     */
+    bool allow(uint32_t msg_id, uint8_t src_sysid, uint8_t src_compid, usec_t now_usec);
+
+    void print_statistics() const;
+
+private:
+    struct Limit {
+        usec_t interval_usec;
+        /* How far ahead of now the next arrival time may be */
+        usec_t burst_usec;
+        uint32_t passed;
+        uint32_t dropped;
+    };
+
+    std::unordered_map<uint32_t, Limit> _limits;
+    /* Theoretical arrival time, by msg_id << 16 | sysid << 8 | compid */
+    std::unordered_map<uint64_t, usec_t> _buckets;
+};
@@ -0,0 +1,56 @@
+#include "rate_limit.h"
+
+#include <gtest/gtest.h>
+
+TEST(RateLimiterTest, rate) {
+    RateLimiter limiter;
+    unsigned passed = 0;
+
+    EXPECT_FALSE(limiter.enabled());
+    limiter.add_limit(30, 2);
+    EXPECT_TRUE(limiter.enabled());
+
+    // 50Hz for 10s: 2Hz go through
+    for (usec_t t = 0; t < 10 * USEC_PER_SEC; t += 20 * USEC_PER_MSEC)
+        passed += limiter.allow(30, 1, 1, t);
+    EXPECT_EQ(passed, 20U);
+
+    // Not limited
+    EXPECT_TRUE(limiter.allow(33, 1, 1, 0));
+    EXPECT_TRUE(limiter.allow(33, 1, 1, 0));
+}
+
+TEST(RateLimiterTest, burst) {
+    RateLimiter limiter;
+    const usec_t t0 = 100 * USEC_PER_SEC;
+
+    limiter.add_limit(30, 1, 3);
+
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0));
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0));
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0));
+    EXPECT_FALSE(limiter.allow(30, 1, 1, t0));
+
+    // One more per second after that
+    EXPECT_FALSE(limiter.allow(30, 1, 1, t0 + 999 * USEC_PER_MSEC));
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0 + USEC_PER_SEC));
+    EXPECT_FALSE(limiter.allow(30, 1, 1, t0 + USEC_PER_SEC));
+
+    // Idle time refills the bucket, but only up to the burst
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0 + 60 * USEC_PER_SEC));
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0 + 60 * USEC_PER_SEC));
+    EXPECT_TRUE(limiter.allow(30, 1, 1, t0 + 60 * USEC_PER_SEC));
+    EXPECT_FALSE(limiter.allow(30, 1, 1, t0 + 60 * USEC_PER_SEC));
+}
+
+TEST(RateLimiterTest, per_source) {
+    RateLimiter limiter;
+
+    limiter.add_limit(30, 0.5);
+
+    EXPECT_TRUE(limiter.allow(30, 1, 1, 0));
+    EXPECT_FALSE(limiter.allow(30, 1, 1, USEC_PER_SEC));
+    EXPECT_TRUE(limiter.allow(30, 2, 1, USEC_PER_SEC));
+    EXPECT_TRUE(limiter.allow(30, 1, 2, USEC_PER_SEC));
+    EXPECT_TRUE(limiter.allow(30, 1, 1, 2 * USEC_PER_SEC));
+}
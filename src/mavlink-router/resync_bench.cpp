@@ -0,0 +1,220 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parsing of a corrupted stream, as received from a lossy radio link: valid
+ * messages separated by bursts of garbage, some of them with flipped bits.
+ * Reports how fast read_msg() goes through it and how many of the intact
+ * messages it recovers, plus the speed of the magic byte search alone with
+ * memchr2() and with the scalar loop.
+ *
+ * Run with: resync_bench [iterations]
+ */
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <common/crc.h>
+#include <common/memchr2.h>
+
+#include "endpoint.h"
+
+#define DEFAULT_ITERATIONS 20
+#define N_MSGS 20000
+#define READ_SIZE 256
+
+#define MAX_GARBAGE_LEN 64
+
+struct Corpus {
+    const char *name;
+    /* Out of 100 messages, how many follow a burst of garbage */
+    unsigned garbage_percent;
+    /* Out of 100 messages, how many have a flipped bit */
+    unsigned corrupted_percent;
+};
+
+class BenchEndpoint : public Endpoint {
+public:
+    BenchEndpoint(const std::vector<uint8_t> &stream)
+        : Endpoint{"Bench"}
+        , _stream(stream)
+    {
+    }
+
+    int write_msg(const struct buffer *pbuf) override { return 0; }
+    int flush_pending_msgs() override { return 0; }
+
+    /*
+     * Parse the whole stream and return the number of HEARTBEATs, i.e. of
+     * our messages, that were found. Garbage starting with a magic byte and
+     * an unknown message id is returned as a message as well, counted in
+     * @unknown.
+     */
+    unsigned parse(unsigned *unknown)
+    {
+        int target_sysid, target_compid;
+        uint8_t src_sysid, src_compid;
+        uint32_t msg_id;
+        struct buffer buf{};
+        unsigned n = 0;
+
+        *unknown = 0;
+        while (_fill_rx_buf() > 0) {
+            while (read_msg(&buf, &target_sysid, &target_compid, &src_sysid, &src_compid, &msg_id) > 0) {
+                if (msg_id == 0)
+                    n++;
+                else
+                    (*unknown)++;
+            }
+        }
+
+        return n;
+    }
+
+    uint32_t crc_errors() const { return _stat.read.crc_error; }
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override
+    {
+        len = std::min(len, std::min((size_t)READ_SIZE, _stream.size() - _pos));
+        memcpy(buf, _stream.data() + _pos, len);
+        _pos += len;
+        return len;
+    }
+
+private:
+    const std::vector<uint8_t> &_stream;
+    size_t _pos = 0;
+};
+
+static uint64_t now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A MAVLink 2 HEARTBEAT */
+static void append_msg(std::vector<uint8_t> &stream, uint8_t seq)
+{
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(0);
+    uint8_t msg[12 + 9] = {MAVLINK_STX, 9, 0, 0, seq, 1, 1, 0, 0, 0};
+
+    for (unsigned i = 10; i < 10 + 9; i++)
+        msg[i] = rand();
+
+    uint16_t crc = crc16_mcrf4xx(CRC16_MCRF4XX_INIT, &msg[1], 9 + 9);
+    crc = crc16_mcrf4xx(crc, &entry->crc_extra, 1);
+    msg[19] = crc & 0xff;
+    msg[20] = crc >> 8;
+
+    stream.insert(stream.end(), msg, msg + sizeof(msg));
+}
+
+/*
+ * Return the stream and set @intact to the number of messages in it that
+ * weren't corrupted
+ */
+static std::vector<uint8_t> make_stream(const Corpus &corpus, unsigned *intact)
+{
+    std::vector<uint8_t> stream;
+
+    srand(1);
+    *intact = 0;
+
+    for (unsigned i = 0; i < N_MSGS; i++) {
+        if ((unsigned)rand() % 100 < corpus.garbage_percent) {
+            for (unsigned len = 1 + rand() % MAX_GARBAGE_LEN; len; len--)
+                stream.push_back(rand());
+        }
+
+        append_msg(stream, i);
+
+        if ((unsigned)rand() % 100 < corpus.corrupted_percent)
+            stream[stream.size() - 1 - rand() % 21] ^= 1 << (rand() % 8);
+        else
+            (*intact)++;
+    }
+
+    return stream;
+}
+
+template<typename Func>
+static double search_mb_per_sec(const std::vector<uint8_t> &stream, unsigned iterations, Func search)
+{
+    size_t found = 0;
+    const uint64_t start = now_nsec();
+
+    for (unsigned i = 0; i < iterations; i++) {
+        const uint8_t *p = stream.data();
+        const uint8_t *end = p + stream.size();
+
+        while ((p = (const uint8_t *)search(p, MAVLINK_STX, MAVLINK_STX_MAVLINK1, end - p))) {
+            found++;
+            if (++p == end)
+                break;
+        }
+    }
+
+    const uint64_t elapsed = now_nsec() - start;
+
+    /* Keep the calls from being optimized out */
+    if (found == SIZE_MAX)
+        printf("\n");
+
+    return (double)stream.size() * iterations * 1000 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    const Corpus corpora[] = {
+        {"bit flips", 0, 5},
+        {"garbage and bit flips", 20, 5},
+    };
+
+    for (const auto &corpus : corpora) {
+        unsigned intact, parsed = 0, unknown = 0;
+        uint32_t crc_errors = 0;
+        const auto stream = make_stream(corpus, &intact);
+
+        const uint64_t start = now_nsec();
+        for (unsigned i = 0; i < iterations; i++) {
+            BenchEndpoint endpoint{stream};
+
+            parsed = endpoint.parse(&unknown);
+            crc_errors = endpoint.crc_errors();
+        }
+        const uint64_t elapsed = now_nsec() - start;
+
+        printf("%s: %zu bytes, %u messages, %u intact\n", corpus.name, stream.size(), N_MSGS, intact);
+        printf("  read_msg: %u messages recovered, %u unknown, %u CRC errors, %.1f MB/s\n", parsed,
+               unknown, crc_errors, (double)stream.size() * iterations * 1000 / elapsed);
+        printf("  magic byte search: memchr2 %.1f MB/s, scalar %.1f MB/s\n",
+               search_mb_per_sec(stream, iterations, memchr2),
+               search_mb_per_sec(stream, iterations, memchr2_scalar));
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "routing.h"
+
+#include <assert.h>
+
+#include "endpoint.h"
+
+void EndpointSet::set(unsigned slot)
+{
+    if (slot / 64 >= words.size())
+        words.resize(slot / 64 + 1, 0);
+
+    words[slot / 64] |= 1ULL << (slot % 64);
+}
+
+void EndpointSet::clear(unsigned slot)
+{
+    if (slot / 64 < words.size())
+        words[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+bool EndpointSet::test(unsigned slot) const
+{
+    if (slot / 64 >= words.size())
+        return false;
+
+    return words[slot / 64] & (1ULL << (slot % 64));
+}
+
+bool EndpointSet::empty() const
+{
+    for (auto w : words) {
+        if (w)
+            return false;
+    }
+
+    return true;
+}
+
+void RoutingTable::add_endpoint(Endpoint *e)
+{
+    unsigned slot;
+
+    assert(e->_routing_table == nullptr);
+
+    if (!_free_slots.empty()) {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+        _endpoints[slot] = e;
+    } else {
+        slot = _endpoints.size();
+        _endpoints.push_back(e);
+    }
+
+    e->_routing_table = this;
+    e->_routing_slot = slot;
+    _all.set(slot);
+
+    e->_sys_comp_ids.for_each([&](uint16_t id) { add_sys_comp_id(e, id); });
+}
+
+void RoutingTable::remove_endpoint(Endpoint *e)
+{
+    if (e->_routing_table != this)
+        return;
+
+    const unsigned slot = e->_routing_slot;
+
+    e->_sys_comp_ids.for_each([&](uint16_t id) {
+        _by_sysid[id >> 8].clear(slot);
+
+        auto it = _by_sys_comp_id.find(id);
+        if (it != _by_sys_comp_id.end()) {
+            it->second.clear(slot);
+            if (it->second.empty())
+                _by_sys_comp_id.erase(it);
+        }
+    });
+
+    _all.clear(slot);
+    _endpoints[slot] = nullptr;
+    _free_slots.push_back(slot);
+
+    e->_routing_table = nullptr;
+}
+
+void RoutingTable::add_sys_comp_id(Endpoint *e, uint16_t sys_comp_id)
+{
+    assert(e->_routing_table == this);
+
+    EndpointSet &endpoints = _by_sys_comp_id[sys_comp_id];
+
+    if (endpoints.empty() && _new_sys_comp_id_cb)
+        _new_sys_comp_id_cb(sys_comp_id);
+
+    _by_sysid[sys_comp_id >> 8].set(e->_routing_slot);
+    endpoints.set(e->_routing_slot);
+}
+
+const EndpointSet *RoutingTable::_find_sys_comp_id(unsigned sysid, unsigned compid) const
+{
+    uint16_t sys_comp_id = ((sysid & 0xff) << 8) | (compid & 0xff);
+
+    auto it = _by_sys_comp_id.find(sys_comp_id);
+    if (it == _by_sys_comp_id.end())
+        return nullptr;
+
+    return &it->second;
+}
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+class Endpoint;
+
+/*
+ * Set of endpoints registered on a RoutingTable, one bit per routing slot
+ */
+class EndpointSet {
+public:
+    void set(unsigned slot);
+    void clear(unsigned slot);
+    bool test(unsigned slot) const;
+    bool empty() const;
+
+    std::vector<uint64_t> words;
+};
+
+/*
+ * Central routing state: which endpoints have seen which sysid/compid.
+ *
+ * It's updated incrementally as endpoints learn new components, so routing a
+ * message is a couple of lookups plus a walk on the resulting bitmask, instead
+ * of asking every endpoint if it accepts the message.
+ */
+class RoutingTable {
+public:
+    /*
+     * Give @e a routing slot and add all components it already knows about.
+     */
+    void add_endpoint(Endpoint *e);
+    void remove_endpoint(Endpoint *e);
+
+    void add_sys_comp_id(Endpoint *e, uint16_t sys_comp_id);
+
+    /*
+     * Call @cb when an endpoint sees a sysid/compid none of the others had
+     */
+    void set_new_sys_comp_id_cb(std::function<void(uint16_t)> cb) { _new_sys_comp_id_cb = cb; }
+
+    /*
+     * Call @func for every endpoint that should receive a message to
+     * @target_sysid/@target_compid sent by @src_sysid/@src_compid. This
+     * applies the same rules as Endpoint::accept_msg(), except for the
+     * per-endpoint message filter.
+     */
+    template<typename Func>
+    void for_each_target(int target_sysid, int target_compid, uint8_t src_sysid,
+                         uint8_t src_compid, Func func) const;
+
+private:
+    const EndpointSet *_find_sys_comp_id(unsigned sysid, unsigned compid) const;
+
+    std::vector<Endpoint *> _endpoints;
+    std::vector<unsigned> _free_slots;
+
+    EndpointSet _all;
+    EndpointSet _by_sysid[256];
+    std::unordered_map<uint16_t, EndpointSet> _by_sys_comp_id;
+
+    std::function<void(uint16_t)> _new_sys_comp_id_cb;
+};
+
+template<typename Func>
+void RoutingTable::for_each_target(int target_sysid, int target_compid, uint8_t src_sysid,
+                                   uint8_t src_compid, Func func) const
+{
+    const EndpointSet *targets;
+
+    if (target_sysid == 0 || target_sysid == -1)
+        targets = &_all;
+    else if (target_compid > 0)
+        targets = _find_sys_comp_id(target_sysid, target_compid);
+    else
+        targets = &_by_sysid[target_sysid & 0xff];
+
+    if (!targets)
+        return;
+
+    // Never send a message back to the endpoint where its source lives
+    const EndpointSet *sources = _find_sys_comp_id(src_sysid, src_compid);
+    const size_t n_sources = sources ? sources->words.size() : 0;
+
+    for (size_t i = 0; i < targets->words.size(); i++) {
+        uint64_t word = targets->words[i];
+
+        if (i < n_sources)
+            word &= ~sources->words[i];
+
+        while (word) {
+            unsigned bit = __builtin_ctzll(word);
+            word &= word - 1;
+            func(_endpoints[i * 64 + bit]);
+        }
+    }
+}
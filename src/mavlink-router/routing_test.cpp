@@ -0,0 +1,155 @@
+#include "routing.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "endpoint.h"
+
+class TestEndpoint : public Endpoint {
+public:
+    TestEndpoint()
+        : Endpoint{"Test"}
+    {
+    }
+
+    int write_msg(const struct buffer *pbuf) override { return 0; }
+    int flush_pending_msgs() override { return 0; }
+
+    void add_sys_comp_id(uint8_t sysid, uint8_t compid) { _add_sys_comp_id((sysid << 8) | compid); }
+
+protected:
+    ssize_t _read_msg(uint8_t *buf, size_t len) override { return 0; }
+};
+
+static std::vector<Endpoint *> targets(RoutingTable &table, int target_sysid, int target_compid,
+                                       uint8_t src_sysid, uint8_t src_compid)
+{
+    std::vector<Endpoint *> v;
+
+    table.for_each_target(target_sysid, target_compid, src_sysid, src_compid,
+                          [&](Endpoint *e) { v.push_back(e); });
+
+    return v;
+}
+
+TEST(RoutingTableTest, broadcast_skips_source) {
+    RoutingTable table;
+    TestEndpoint vehicle, gcs1, gcs2;
+
+    table.add_endpoint(&vehicle);
+    table.add_endpoint(&gcs1);
+    table.add_endpoint(&gcs2);
+    vehicle.add_sys_comp_id(1, 1);
+    gcs1.add_sys_comp_id(255, 190);
+
+    EXPECT_EQ(targets(table, 0, 0, 1, 1), (std::vector<Endpoint *>{&gcs1, &gcs2}));
+    EXPECT_EQ(targets(table, -1, -1, 255, 190), (std::vector<Endpoint *>{&vehicle, &gcs2}));
+}
+
+TEST(RoutingTableTest, targeted) {
+    RoutingTable table;
+    TestEndpoint vehicle, camera, gcs;
+
+    // Components learned before registering must be picked up as well
+    vehicle.add_sys_comp_id(1, 1);
+    table.add_endpoint(&vehicle);
+    table.add_endpoint(&camera);
+    table.add_endpoint(&gcs);
+    camera.add_sys_comp_id(1, 100);
+    gcs.add_sys_comp_id(255, 190);
+
+    EXPECT_EQ(targets(table, 1, 1, 255, 190), (std::vector<Endpoint *>{&vehicle}));
+    EXPECT_EQ(targets(table, 1, 100, 255, 190), (std::vector<Endpoint *>{&camera}));
+    EXPECT_EQ(targets(table, 1, 0, 255, 190), (std::vector<Endpoint *>{&vehicle, &camera}));
+    EXPECT_EQ(targets(table, 1, -1, 1, 1), (std::vector<Endpoint *>{&camera}));
+    EXPECT_TRUE(targets(table, 2, 1, 255, 190).empty());
+    EXPECT_TRUE(targets(table, 1, 2, 255, 190).empty());
+}
+
+TEST(RoutingTableTest, remove_and_reuse_slot) {
+    RoutingTable table;
+    TestEndpoint vehicle, gcs;
+
+    table.add_endpoint(&vehicle);
+    table.add_endpoint(&gcs);
+    vehicle.add_sys_comp_id(1, 1);
+    gcs.add_sys_comp_id(255, 190);
+
+    table.remove_endpoint(&gcs);
+    EXPECT_TRUE(targets(table, 255, 190, 1, 1).empty());
+    EXPECT_TRUE(targets(table, 0, 0, 1, 1).empty());
+
+    {
+        TestEndpoint other;
+        table.add_endpoint(&other);
+        EXPECT_EQ(targets(table, 0, 0, 1, 1), (std::vector<Endpoint *>{&other}));
+        EXPECT_TRUE(targets(table, 255, 0, 1, 1).empty());
+    }
+
+    // Destroyed endpoints remove themselves
+    EXPECT_TRUE(targets(table, 0, 0, 1, 1).empty());
+
+    table.add_endpoint(&gcs);
+    EXPECT_EQ(targets(table, 255, 190, 1, 1), (std::vector<Endpoint *>{&gcs}));
+}
+
+TEST(RoutingTableTest, same_as_accept_msg) {
+    RoutingTable table;
+    std::vector<TestEndpoint> endpoints(70);
+    const int ids[] = {-1, 0, 1, 2, 3, 100, 190, 255};
+
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        table.add_endpoint(&endpoints[i]);
+        endpoints[i].add_sys_comp_id(1 + i % 3, 1 + i % 5);
+        if (i % 7 == 0)
+            endpoints[i].add_sys_comp_id(255, 190);
+    }
+
+    for (int target_sysid : ids) {
+        for (int target_compid : ids) {
+            for (int src : ids) {
+                if (src < 0)
+                    continue;
+
+                std::vector<Endpoint *> expected;
+                for (auto &e : endpoints) {
+                    if (e.accept_msg(target_sysid, target_compid, src, src, UINT32_MAX))
+                        expected.push_back(&e);
+                }
+
+                EXPECT_EQ(targets(table, target_sysid, target_compid, src, src), expected)
+                    << "target " << target_sysid << "/" << target_compid << " source " << src;
+            }
+        }
+    }
+}
+
+TEST(SysCompIdSetTest, membership) {
+    SysCompIdSet set;
+    const uint16_t ids[] = {0xff00, 0x01be, 0x0101, 0x8040, 0x0001, 0x01ff, 0x4000, 0xffff};
+    std::vector<uint16_t> all;
+
+    for (auto id : ids) {
+        EXPECT_TRUE(set.add(id >> 8, id & 0xff));
+        EXPECT_FALSE(set.add(id >> 8, id & 0xff));
+    }
+
+    for (unsigned sysid = 0; sysid < 256; sysid++) {
+        bool known_sysid = false;
+
+        for (unsigned compid = 0; compid < 256; compid++) {
+            bool known = false;
+            for (auto id : ids) {
+                known |= id == (sysid << 8 | compid);
+                known_sysid |= (id >> 8) == sysid;
+            }
+            EXPECT_EQ(set.has(sysid, compid), known) << sysid << "/" << compid;
+        }
+        EXPECT_EQ(set.has(sysid), known_sysid) << sysid;
+    }
+
+    set.for_each([&](uint16_t id) { all.push_back(id); });
+    EXPECT_EQ(all, (std::vector<uint16_t>{0x0001, 0x0101, 0x01be, 0x01ff, 0x4000, 0x8040, 0xff00,
+                                          0xffff}));
+}
@@ -0,0 +1,187 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "shard.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <common/log.h>
+
+#include "mainloop.h"
+#include "packet.h"
+
+ShardSet::ShardSet(unsigned n)
+    : _n{n}
+    , _rings{new ShardRing[n * n]}
+    , _routes{new ShardRoutes}
+{
+    for (unsigned i = 0; i < MAX_SHARDS; i++) {
+        _doorbells[i] = -1;
+        _quiescent[i].store(0);
+    }
+}
+
+ShardSet::~ShardSet()
+{
+    ShardMsg msg;
+
+    /* Messages still in flight hold a reference */
+    for (unsigned i = 0; i < _n * _n; i++) {
+        while (_rings[i].pop(&msg))
+            msg.pkt->unref();
+    }
+    delete[] _rings;
+
+    for (unsigned i = 0; i < _n; i++) {
+        if (_doorbells[i] >= 0)
+            close(_doorbells[i]);
+    }
+
+    for (auto &r : _retired)
+        delete r.first;
+    delete _routes.load();
+}
+
+int ShardSet::open()
+{
+    for (unsigned i = 0; i < _n; i++) {
+        _doorbells[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (_doorbells[i] < 0) {
+            log_error("Could not create eventfd for shard %u (%m)", i);
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+void ShardSet::ring_doorbell(unsigned shard)
+{
+    const uint64_t one = 1;
+
+    if (write(_doorbells[shard], &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_error("Could not wake up shard %u (%m)", shard);
+}
+
+void ShardSet::clear_doorbell(unsigned shard)
+{
+    uint64_t val;
+
+    (void)read(_doorbells[shard], &val, sizeof(val));
+}
+
+uint64_t ShardSet::targets(int target_sysid, int target_compid) const
+{
+    const ShardRoutes *routes;
+
+    if (target_sysid == 0 || target_sysid == -1)
+        return _n == 64 ? ~0ULL : (1ULL << _n) - 1;
+
+    routes = _routes.load(std::memory_order_acquire);
+
+    if (target_compid > 0) {
+        auto it = routes->by_sys_comp_id.find(((target_sysid & 0xff) << 8) | (target_compid & 0xff));
+        return it == routes->by_sys_comp_id.end() ? 0 : it->second;
+    }
+
+    return routes->by_sysid[target_sysid & 0xff];
+}
+
+void ShardSet::add_sys_comp_id(unsigned shard, uint16_t sys_comp_id)
+{
+    std::lock_guard<std::mutex> lock(_routes_lock);
+    ShardRoutes *routes = _routes.load(std::memory_order_relaxed);
+    const uint64_t bit = 1ULL << shard;
+
+    auto it = routes->by_sys_comp_id.find(sys_comp_id);
+    if (it != routes->by_sys_comp_id.end() && (it->second & bit))
+        return;
+
+    ShardRoutes *next = new ShardRoutes(*routes);
+    next->by_sysid[sys_comp_id >> 8] |= bit;
+    next->by_sys_comp_id[sys_comp_id] |= bit;
+    _routes.store(next);
+
+    /* Shards online with an older epoch may still be reading @routes */
+    _retired.emplace_back(routes, ++_epoch);
+    _reclaim();
+}
+
+void ShardSet::_reclaim()
+{
+    uint64_t oldest = UINT64_MAX;
+
+    for (unsigned i = 0; i < _n; i++) {
+        uint64_t epoch = _quiescent[i].load();
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    for (size_t i = 0; i < _retired.size();) {
+        if (_retired[i].second <= oldest) {
+            delete _retired[i].first;
+            _retired[i] = _retired.back();
+            _retired.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+static void *shard_thread(void *data)
+{
+    static_cast<Mainloop *>(data)->loop();
+    return nullptr;
+}
+
+int ShardSet::start()
+{
+    sigset_t mask, old_mask;
+    int r = 0;
+
+    /* Signals are handled by the main thread */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (unsigned i = 1; i < _n; i++) {
+        r = pthread_create(&_threads[_n_threads], nullptr, shard_thread, _loops[i]);
+        if (r != 0) {
+            log_error("Could not start thread for shard %u (%s)", i, strerror(r));
+            r = -r;
+            break;
+        }
+        _n_threads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+    return r;
+}
+
+void ShardSet::stop()
+{
+    for (unsigned i = 1; i < _n; i++)
+        ring_doorbell(i);
+
+    for (unsigned i = 0; i < _n_threads; i++)
+        pthread_join(_threads[i], nullptr);
+    _n_threads = 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Mainloop;
+class Packet;
+
+/*
+ * A message routed by a shard, to be routed to the endpoints of another one
+ */
+struct ShardMsg {
+    Packet *pkt;
+    int16_t target_sysid;
+    int16_t target_compid;
+    uint8_t sender_sysid;
+    uint8_t sender_compid;
+    uint32_t msg_id;
+};
+
+/*
+ * Lock-free ring of messages from one shard to another: only the thread of
+ * the first one pushes and only the thread of the second one pops
+ */
+class ShardRing {
+public:
+    static const unsigned SIZE = 1024;
+
+    bool push(const ShardMsg &msg)
+    {
+        const unsigned tail = _tail.load(std::memory_order_relaxed);
+
+        if (tail - _head.load(std::memory_order_acquire) == SIZE)
+            return false;
+
+        _msgs[tail % SIZE] = msg;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(ShardMsg *msg)
+    {
+        const unsigned head = _head.load(std::memory_order_relaxed);
+
+        if (head == _tail.load(std::memory_order_acquire))
+            return false;
+
+        *msg = _msgs[head % SIZE];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    /* Producer and consumer indexes on their own cache lines */
+    std::atomic<unsigned> _head{0};
+    char _pad0[64 - sizeof(std::atomic<unsigned>)];
+    std::atomic<unsigned> _tail{0};
+    char _pad1[64 - sizeof(std::atomic<unsigned>)];
+    ShardMsg _msgs[SIZE];
+};
+
+/*
+ * Shards having endpoints that saw each sysid/compid, one bit per shard
+ */
+struct ShardRoutes {
+    uint64_t by_sysid[256] = {};
+    std::unordered_map<uint16_t, uint64_t> by_sys_comp_id;
+};
+
+/*
+ * State shared by the Mainloops of a router running one of them per thread.
+ *
+ * Each endpoint belongs to one shard, which reads, routes and writes its
+ * messages. A message that can be of interest to another shard is handed
+ * over through the ring between them and the doorbell (an eventfd) of the
+ * destination is rung once per mainloop iteration.
+ *
+ * Which shards can be interested in a message is looked up in ShardRoutes,
+ * published RCU-style: readers load the current snapshot without locking,
+ * writers publish a modified copy. Old copies are freed once every shard
+ * went through a quiescent state, i.e. waited for events, since they were
+ * replaced.
+ */
+class ShardSet {
+public:
+    static const unsigned MAX_SHARDS = 64;
+
+    explicit ShardSet(unsigned n);
+    ~ShardSet();
+
+    int open();
+
+    unsigned size() const { return _n; }
+    Mainloop *&loop(unsigned shard) { return _loops[shard]; }
+    ShardRing &ring(unsigned from, unsigned to) { return _rings[from * _n + to]; }
+    int doorbell_fd(unsigned shard) const { return _doorbells[shard]; }
+
+    void ring_doorbell(unsigned shard);
+    void clear_doorbell(unsigned shard);
+
+    /*
+     * Shards that may route a message to @target_sysid/@target_compid, as a
+     * mask. Only valid while @shard is online.
+     */
+    uint64_t targets(int target_sysid, int target_compid) const;
+
+    /*
+     * Record that an endpoint of @shard saw @sys_comp_id
+     */
+    void add_sys_comp_id(unsigned shard, uint16_t sys_comp_id);
+
+    /*
+     * A shard is offline while waiting for events: it holds no reference to
+     * ShardRoutes, which is the quiescent state old copies wait for.
+     */
+    void offline(unsigned shard) { _quiescent[shard].store(0); }
+    void online(unsigned shard)
+    {
+        _quiescent[shard].store(_epoch.load());
+        /*
+         * The epoch must be visible before targets() loads _routes, which is
+         * only an acquire load: pairs with the seq_cst store of _routes and the
+         * loads of _quiescent in _reclaim(), so that either the writer sees
+         * this shard online or the shard sees the new copy.
+         */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /*
+     * Run the Mainloops of shards other than 0 in their own threads, until
+     * stop() is called after the exit was requested
+     */
+    int start();
+    void stop();
+
+private:
+    void _reclaim();
+
+    unsigned _n;
+    Mainloop *_loops[MAX_SHARDS] = {};
+    pthread_t _threads[MAX_SHARDS];
+    unsigned _n_threads = 0;
+    ShardRing *_rings;
+    int _doorbells[MAX_SHARDS];
+
+    std::atomic<ShardRoutes *> _routes;
+    std::atomic<uint64_t> _epoch{1};
+    std::atomic<uint64_t> _quiescent[MAX_SHARDS];
+
+    /* Serializes writers of _routes */
+    std::mutex _routes_lock;
+    std::vector<std::pair<ShardRoutes *, uint64_t>> _retired;
+};
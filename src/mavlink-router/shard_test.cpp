@@ -0,0 +1,70 @@
+#include "shard.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <thread>
+
+TEST(ShardTest, ring_order_and_full) {
+    std::unique_ptr<ShardRing> ring{new ShardRing};
+    ShardMsg msg = {};
+
+    for (unsigned i = 0; i < ShardRing::SIZE; i++) {
+        msg.msg_id = i;
+        ASSERT_TRUE(ring->push(msg));
+    }
+    EXPECT_FALSE(ring->push(msg));
+
+    for (unsigned i = 0; i < ShardRing::SIZE; i++) {
+        ASSERT_TRUE(ring->pop(&msg));
+        EXPECT_EQ(msg.msg_id, i);
+    }
+    EXPECT_FALSE(ring->pop(&msg));
+}
+
+TEST(ShardTest, ring_threads) {
+    std::unique_ptr<ShardRing> ring{new ShardRing};
+    const uint32_t n = 200000;
+
+    std::thread producer([&] {
+        ShardMsg msg = {};
+        for (uint32_t i = 0; i < n;) {
+            msg.msg_id = i;
+            if (ring->push(msg))
+                i++;
+        }
+    });
+
+    ShardMsg msg;
+    for (uint32_t i = 0; i < n;) {
+        if (!ring->pop(&msg))
+            continue;
+        ASSERT_EQ(msg.msg_id, i);
+        i++;
+    }
+
+    producer.join();
+}
+
+TEST(ShardTest, targets) {
+    ShardSet shards{3};
+
+    // Broadcasts go to every shard
+    EXPECT_EQ(shards.targets(0, 0), 0x7U);
+    EXPECT_EQ(shards.targets(-1, -1), 0x7U);
+
+    EXPECT_EQ(shards.targets(1, 1), 0U);
+    EXPECT_EQ(shards.targets(1, 0), 0U);
+
+    shards.online(2);
+    shards.add_sys_comp_id(2, 1 << 8 | 1);
+    shards.add_sys_comp_id(0, 1 << 8 | 2);
+    shards.add_sys_comp_id(2, 1 << 8 | 1);
+    shards.offline(2);
+
+    EXPECT_EQ(shards.targets(1, 1), 0x4U);
+    EXPECT_EQ(shards.targets(1, 2), 0x1U);
+    EXPECT_EQ(shards.targets(1, 3), 0U);
+    EXPECT_EQ(shards.targets(1, 0), 0x5U);
+    EXPECT_EQ(shards.targets(2, 0), 0U);
+}
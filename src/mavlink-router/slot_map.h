@@ -0,0 +1,149 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/*
+ * Container of values addressed by stable keys, for objects that come and
+ * go often such as TCP clients.
+ *
+ * Values are kept packed in an array so iterating over them is a plain loop,
+ * and a removed value is replaced by the last one: insert, remove and lookup
+ * are O(1). Keys hold a slot index plus the slot's generation, bumped
+ * whenever the slot is used or freed, so a stale key never matches the value
+ * that took its place.
+ */
+template<typename T>
+class SlotMap {
+public:
+    typedef uint64_t Key;
+
+    /* Never returned by insert() */
+    static const Key NONE = 0;
+
+    Key insert(const T &value);
+
+    /*
+     * Return false if @key was already removed
+     */
+    bool remove(Key key);
+
+    /*
+     * Value for @key, nullptr if it was removed
+     */
+    T *get(Key key);
+
+    void reserve(size_t n)
+    {
+        _slots.reserve(n);
+        _values.reserve(n);
+        _value_slots.reserve(n);
+    }
+
+    size_t size() const { return _values.size(); }
+    bool empty() const { return _values.empty(); }
+
+    /* In no particular order, invalidated by insert() and remove() */
+    typename std::vector<T>::iterator begin() { return _values.begin(); }
+    typename std::vector<T>::iterator end() { return _values.end(); }
+
+private:
+    struct Slot {
+        /* Odd if the slot is in use */
+        uint32_t generation;
+        /* Position in _values if in use, next free slot otherwise */
+        uint32_t index;
+    };
+
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+    Slot *_slot(Key key)
+    {
+        const uint32_t i = key & UINT32_MAX;
+
+        if (i >= _slots.size() || _slots[i].generation != key >> 32 || !((key >> 32) & 1))
+            return nullptr;
+
+        return &_slots[i];
+    }
+
+    std::vector<Slot> _slots;
+    std::vector<T> _values;
+    /* Slot of each value */
+    std::vector<uint32_t> _value_slots;
+    uint32_t _free_slot = NO_SLOT;
+};
+
+template<typename T>
+const typename SlotMap<T>::Key SlotMap<T>::NONE;
+
+template<typename T>
+typename SlotMap<T>::Key SlotMap<T>::insert(const T &value)
+{
+    uint32_t i = _free_slot;
+
+    if (i != NO_SLOT) {
+        _free_slot = _slots[i].index;
+    } else {
+        i = _slots.size();
+        _slots.push_back({0, 0});
+    }
+
+    Slot &slot = _slots[i];
+    slot.generation++;
+    slot.index = _values.size();
+    _values.push_back(value);
+    _value_slots.push_back(i);
+
+    return (Key)slot.generation << 32 | i;
+}
+
+template<typename T>
+bool SlotMap<T>::remove(Key key)
+{
+    Slot *slot = _slot(key);
+
+    if (!slot)
+        return false;
+
+    /* Move the last value into the hole */
+    const uint32_t last = _values.size() - 1;
+    _values[slot->index] = _values[last];
+    _value_slots[slot->index] = _value_slots[last];
+    _slots[_value_slots[slot->index]].index = slot->index;
+    _values.pop_back();
+    _value_slots.pop_back();
+
+    slot->generation++;
+    slot->index = _free_slot;
+    _free_slot = key & UINT32_MAX;
+
+    return true;
+}
+
+template<typename T>
+T *SlotMap<T>::get(Key key)
+{
+    Slot *slot = _slot(key);
+
+    return slot ? &_values[slot->index] : nullptr;
+}
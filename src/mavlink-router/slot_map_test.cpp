@@ -0,0 +1,78 @@
+#include "slot_map.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <map>
+
+TEST(SlotMapTest, insert_remove) {
+    SlotMap<int> map;
+    SlotMap<int>::Key keys[10];
+
+    EXPECT_EQ(map.get(SlotMap<int>::NONE), nullptr);
+
+    for (int i = 0; i < 10; i++) {
+        keys[i] = map.insert(i);
+        EXPECT_NE(keys[i], SlotMap<int>::NONE);
+    }
+    EXPECT_EQ(map.size(), 10U);
+
+    EXPECT_TRUE(map.remove(keys[3]));
+    EXPECT_FALSE(map.remove(keys[3]));
+    EXPECT_TRUE(map.remove(keys[9]));
+    EXPECT_TRUE(map.remove(keys[0]));
+    EXPECT_EQ(map.size(), 7U);
+
+    for (int i = 0; i < 10; i++) {
+        if (i == 0 || i == 3 || i == 9) {
+            EXPECT_EQ(map.get(keys[i]), nullptr);
+        } else {
+            ASSERT_NE(map.get(keys[i]), nullptr);
+            EXPECT_EQ(*map.get(keys[i]), i);
+        }
+    }
+
+    int sum = 0;
+    for (int v : map)
+        sum += v;
+    EXPECT_EQ(sum, 45 - 0 - 3 - 9);
+}
+
+TEST(SlotMapTest, stale_keys) {
+    SlotMap<int> map;
+    SlotMap<int>::Key old = map.insert(1);
+
+    map.remove(old);
+
+    // The slot is reused but the old key doesn't match the new value
+    SlotMap<int>::Key key = map.insert(2);
+    EXPECT_NE(key, old);
+    EXPECT_EQ(map.get(old), nullptr);
+    EXPECT_FALSE(map.remove(old));
+    ASSERT_NE(map.get(key), nullptr);
+    EXPECT_EQ(*map.get(key), 2);
+}
+
+TEST(SlotMapTest, random) {
+    SlotMap<unsigned> map;
+    std::map<SlotMap<unsigned>::Key, unsigned> expected;
+
+    srand(42);
+    for (unsigned i = 0; i < 10000; i++) {
+        if (expected.empty() || rand() % 3) {
+            expected[map.insert(i)] = i;
+            continue;
+        }
+
+        auto it = expected.begin();
+        std::advance(it, rand() % expected.size());
+        EXPECT_TRUE(map.remove(it->first));
+        expected.erase(it);
+    }
+
+    ASSERT_EQ(map.size(), expected.size());
+    for (auto &e : expected) {
+        ASSERT_NE(map.get(e.first), nullptr);
+        EXPECT_EQ(*map.get(e.first), e.second);
+    }
+}
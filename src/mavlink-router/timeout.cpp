@@ -18,8 +18,8 @@
 #include "timeout.h"
 
 #include <assert.h>
-#include <stdint.h>
-#include <unistd.h>
+
+Pool Timeout::pool{"Timeout", sizeof(Timeout)};
 
 Timeout::Timeout(std::function<bool(void*)> cb, const void *data)
 {
@@ -28,21 +28,171 @@ Timeout::Timeout(std::function<bool(void*)> cb, const void *data)
     _data = data;
 }
 
-int Timeout::handle_read()
+void *Timeout::operator new(size_t size) noexcept
+{
+    assert(size <= sizeof(Timeout));
+    return pool.alloc();
+}
+
+void Timeout::operator delete(void *p)
+{
+    pool.free(p);
+}
+
+void TimerWheel::add(Timeout *t, uint32_t period_msec, uint64_t now_msec)
+{
+    /* Nothing to catch up with if the wheel was idle */
+    if (_idle())
+        _tick = now_msec;
+
+    t->_period_msec = period_msec ? period_msec : 1;
+    t->_expires_msec = now_msec + t->_period_msec;
+    _insert(t);
+}
+
+void TimerWheel::rearm(Timeout *t, uint64_t now_msec)
+{
+    /* Like a periodic timerfd, missed expirations are merged into one */
+    t->_expires_msec += t->_period_msec;
+    if (t->_expires_msec <= now_msec)
+        t->_expires_msec += ((now_msec - t->_expires_msec) / t->_period_msec + 1) * t->_period_msec;
+
+    _insert(t);
+}
+
+bool TimerWheel::_idle() const
+{
+    if (!_expired.empty())
+        return false;
+
+    for (unsigned level = 0; level < LEVELS; level++) {
+        if (_pending[level])
+            return false;
+    }
+
+    return true;
+}
+
+void TimerWheel::_insert(Timeout *t)
 {
-    uint64_t val = 0;
-    int ret = read(fd, &val, sizeof(val));
+    const uint64_t max_delta = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+    uint64_t expires = t->_expires_msec > _tick ? t->_expires_msec : _tick;
+    unsigned level = 0;
 
-    if (ret < 1 || val == 0 || remove_me)
-        return 0;
+    if (expires - _tick > max_delta)
+        expires = _tick + max_delta;
 
-    if (!_cb((void *)_data))
-        remove_me = true;
+    while (level < LEVELS - 1 && expires - _tick >= 1ULL << (SLOT_BITS * (level + 1)))
+        level++;
 
-    return 0;
+    const unsigned slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+    _slots[level][slot].push_back(t);
+    _pending[level] |= 1ULL << slot;
 }
 
-bool Timeout::handle_canwrite()
+void TimerWheel::_process_tick()
 {
-    return false;
+    /* Move timeouts of slots starting now to lower levels */
+    for (unsigned level = LEVELS - 1; level > 0; level--) {
+        const unsigned shift = SLOT_BITS * level;
+
+        if (_tick & ((1ULL << shift) - 1))
+            continue;
+
+        const unsigned slot = (_tick >> shift) & (SLOTS - 1);
+        TimerList &list = _slots[level][slot];
+
+        _pending[level] &= ~(1ULL << slot);
+        while (!list.empty()) {
+            Timeout *t = static_cast<Timeout *>(list.next);
+            t->unlink();
+            _insert(t);
+        }
+    }
+
+    const unsigned slot = _tick & (SLOTS - 1);
+    TimerList &list = _slots[0][slot];
+
+    _pending[0] &= ~(1ULL << slot);
+    while (!list.empty()) {
+        TimerLink *l = list.next;
+        l->unlink();
+        _expired.push_back(l);
+    }
+
+    _tick++;
+}
+
+Timeout *TimerWheel::pop_expired(uint64_t now_msec)
+{
+    while (_expired.empty()) {
+        const uint64_t next = next_expiration();
+
+        if (next > now_msec) {
+            /* Nothing happens until then, skip the idle ticks */
+            if (now_msec + 1 > _tick)
+                _tick = now_msec + 1;
+            return nullptr;
+        }
+
+        _tick = next;
+        _process_tick();
+    }
+
+    Timeout *t = static_cast<Timeout *>(_expired.next);
+    t->unlink();
+    return t;
+}
+
+uint64_t TimerWheel::next_expiration()
+{
+    uint64_t next = UINT64_MAX;
+
+    if (!_expired.empty())
+        return _tick;
+
+    for (unsigned level = 0; level < LEVELS; level++) {
+        const unsigned shift = SLOT_BITS * level;
+        const uint64_t pos = _tick >> shift;
+        /*
+         * The slot at the current position is due now on level 0 or if a
+         * cascade is pending. On other levels it was already cascaded, and
+         * its index is the one of the slot a whole turn ahead, which
+         * timeouts added since then may be in.
+         */
+        const unsigned start = level == 0 || !(_tick & ((1ULL << shift) - 1)) ? 0 : 1;
+
+        for (unsigned i = start; i < start + SLOTS && _pending[level]; i++) {
+            const unsigned slot = (pos + i) & (SLOTS - 1);
+
+            if (!(_pending[level] & (1ULL << slot)))
+                continue;
+
+            if (_slots[level][slot].empty()) {
+                _pending[level] &= ~(1ULL << slot);
+                continue;
+            }
+
+            if (((pos + i) << shift) < next)
+                next = (pos + i) << shift;
+            break;
+        }
+    }
+
+    return next;
+}
+
+Timeout *TimerWheel::first()
+{
+    if (!_expired.empty())
+        return static_cast<Timeout *>(_expired.next);
+
+    for (unsigned level = 0; level < LEVELS; level++) {
+        for (unsigned slot = 0; slot < SLOTS && _pending[level]; slot++) {
+            if (!_slots[level][slot].empty())
+                return static_cast<Timeout *>(_slots[level][slot].next);
+        }
+    }
+
+    return nullptr;
 }
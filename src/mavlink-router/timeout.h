@@ -17,20 +17,122 @@
  */
 #pragma once
 
+#include <stdint.h>
+
 #include <functional>
 
-#include "pollable.h"
+#include "pool.h"
+
+/*
+ * Node of the intrusive, circular lists used by TimerWheel
+ */
+struct TimerLink {
+    TimerLink *prev = nullptr;
+    TimerLink *next = nullptr;
+
+    void unlink()
+    {
+        if (!next)
+            return;
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+};
+
+struct TimerList : TimerLink {
+    TimerList() { prev = next = this; }
 
-class Timeout : public Pollable {
+    TimerList(const TimerList &) = delete;
+    TimerList &operator=(const TimerList &) = delete;
+
+    bool empty() const { return next == this; }
+
+    void push_back(TimerLink *l)
+    {
+        l->prev = prev;
+        l->next = this;
+        prev->next = l;
+        prev = l;
+    }
+};
+
+class Timeout : public TimerLink {
 public:
     Timeout(std::function<bool(void*)> cb, const void *data);
     bool remove_me = false;
-    Timeout *next = nullptr;
 
-    int handle_read() override;
-    bool handle_canwrite() override;
+    /*
+     * Call the callback, returns false if the timeout should be removed
+     */
+    bool fire() { return _cb((void *)_data); }
+
+    /*
+     * Allocated from a pool, returning nullptr if it's exhausted
+     */
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *p);
+    static Pool pool;
 
 private:
+    friend class TimerWheel;
+
     std::function<bool(void*)> _cb;
     const void *_data;
+    uint64_t _expires_msec = 0;
+    uint32_t _period_msec = 0;
+};
+
+/*
+ * Hierarchical timer wheel with a 1ms tick: level n has 64 slots of 64^n
+ * ticks each. A Timeout sits on the lowest level whose range covers its
+ * expiration and moves down ("cascades") when time reaches its slot, so
+ * adding and removing is O(1) whatever the number of timeouts. Timeouts
+ * beyond the last level (~4.6 hours) are parked on it and cascaded again.
+ *
+ * Removing is just unlinking the Timeout: bitmaps of non-empty slots are
+ * cleaned up lazily when looking for the next expiration.
+ */
+class TimerWheel {
+public:
+    /*
+     * Schedule @t every @period_msec, starting from @now_msec
+     */
+    void add(Timeout *t, uint32_t period_msec, uint64_t now_msec);
+
+    /*
+     * Schedule @t for its next period after it fired at @now_msec
+     */
+    void rearm(Timeout *t, uint64_t now_msec);
+
+    /*
+     * Unlink and return a timeout expired at @now_msec, nullptr if none
+     */
+    Timeout *pop_expired(uint64_t now_msec);
+
+    /*
+     * Time the wheel needs to be run again, in msec, UINT64_MAX if empty
+     */
+    uint64_t next_expiration();
+
+    /*
+     * Any timeout still in the wheel, nullptr if empty
+     */
+    Timeout *first();
+
+private:
+    static const unsigned LEVELS = 4;
+    static const unsigned SLOT_BITS = 6;
+    static const unsigned SLOTS = 1 << SLOT_BITS;
+
+    bool _idle() const;
+    void _insert(Timeout *t);
+    void _process_tick();
+
+    TimerList _slots[LEVELS][SLOTS];
+    uint64_t _pending[LEVELS] = {};
+    TimerList _expired;
+
+    /* Next tick to process */
+    uint64_t _tick = 0;
 };
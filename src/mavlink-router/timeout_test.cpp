@@ -0,0 +1,134 @@
+#include "timeout.h"
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+
+#include <vector>
+
+static bool record_cb(void *data)
+{
+    (void)data;
+    return true;
+}
+
+/* Run the wheel until @end_msec as a mainloop would, returning (time, timeout) pairs */
+static std::vector<std::pair<uint64_t, Timeout *>> run_until(TimerWheel &wheel, uint64_t now_msec,
+                                                             uint64_t end_msec)
+{
+    std::vector<std::pair<uint64_t, Timeout *>> fired;
+    Timeout *t;
+
+    while ((now_msec = wheel.next_expiration()) <= end_msec) {
+        while ((t = wheel.pop_expired(now_msec))) {
+            fired.emplace_back(now_msec, t);
+            wheel.rearm(t, now_msec);
+        }
+    }
+
+    return fired;
+}
+
+TEST(TimerWheelTest, order) {
+    TimerWheel wheel;
+    Timeout a{record_cb, nullptr}, b{record_cb, nullptr}, c{record_cb, nullptr};
+
+    EXPECT_EQ(wheel.next_expiration(), UINT64_MAX);
+    EXPECT_EQ(wheel.first(), nullptr);
+
+    wheel.add(&c, 5000, 1000);
+    wheel.add(&a, 10, 1000);
+    wheel.add(&b, 70, 1000);
+
+    EXPECT_EQ(wheel.next_expiration(), 1010U);
+
+    auto fired = run_until(wheel, 1000, 6000);
+    unsigned n_a = 0, n_b = 0, n_c = 0;
+
+    for (auto &f : fired) {
+        if (f.second == &a) {
+            EXPECT_EQ(f.first, 1000 + 10 * ++n_a);
+        } else if (f.second == &b) {
+            EXPECT_EQ(f.first, 1000 + 70 * ++n_b);
+        } else {
+            EXPECT_EQ(f.first, 1000 + 5000 * ++n_c);
+        }
+    }
+    EXPECT_EQ(n_a, 500U);
+    EXPECT_EQ(n_b, 71U);
+    EXPECT_EQ(n_c, 1U);
+
+    a.unlink();
+    b.unlink();
+    c.unlink();
+    EXPECT_EQ(wheel.next_expiration(), UINT64_MAX);
+}
+
+TEST(TimerWheelTest, cancel) {
+    TimerWheel wheel;
+    Timeout a{record_cb, nullptr}, b{record_cb, nullptr};
+
+    wheel.add(&a, 100, 0);
+    wheel.add(&b, 200, 0);
+    a.unlink();
+
+    EXPECT_EQ(wheel.first(), &b);
+    EXPECT_EQ(wheel.pop_expired(150), nullptr);
+    // May be earlier than b: the wheel needs to run to cascade it
+    EXPECT_LE(wheel.next_expiration(), 200U);
+    EXPECT_EQ(wheel.pop_expired(199), nullptr);
+    EXPECT_EQ(wheel.pop_expired(200), &b);
+    EXPECT_EQ(wheel.first(), nullptr);
+}
+
+TEST(TimerWheelTest, late) {
+    TimerWheel wheel;
+    Timeout a{record_cb, nullptr};
+
+    wheel.add(&a, 100, 0);
+
+    // Missed expirations are merged into one, like a periodic timerfd
+    EXPECT_EQ(wheel.pop_expired(1050), &a);
+    EXPECT_EQ(wheel.pop_expired(1050), nullptr);
+    wheel.rearm(&a, 1050);
+    EXPECT_EQ(wheel.pop_expired(1099), nullptr);
+    EXPECT_EQ(wheel.pop_expired(1100), &a);
+    a.unlink();
+}
+
+TEST(TimerWheelTest, long_delay) {
+    TimerWheel wheel;
+    Timeout a{record_cb, nullptr}, b{record_cb, nullptr};
+    // Beyond the last level of the wheel
+    const uint64_t day = 24ULL * 3600 * 1000;
+
+    wheel.add(&a, day, 5);
+    wheel.add(&b, 700001, 5);
+
+    auto fired = run_until(wheel, 5, 5 + day);
+    ASSERT_FALSE(fired.empty());
+    EXPECT_EQ(fired.back().second, &a);
+    EXPECT_EQ(fired.back().first, 5 + day);
+
+    a.unlink();
+    b.unlink();
+}
+
+TEST(TimerWheelTest, whole_turn_ahead) {
+    TimerWheel wheel;
+    Timeout a{record_cb, nullptr}, b{record_cb, nullptr};
+
+    // In the slot of level 1 with the same index as the current one
+    wheel.add(&a, 4095, 100001);
+    EXPECT_LE(wheel.next_expiration(), 104096U);
+
+    auto fired = run_until(wheel, 100001, 104096);
+    ASSERT_EQ(fired.size(), 1U);
+    EXPECT_EQ(fired[0].first, 104096U);
+    a.unlink();
+
+    // Same on the last level, where long delays are clamped
+    wheel.add(&b, 0xffffffff, 100001);
+    EXPECT_LE(wheel.next_expiration(), 100001U + (1U << 24));
+    b.unlink();
+}
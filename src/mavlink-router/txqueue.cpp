@@ -0,0 +1,203 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "txqueue.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+TxQueue::TxQueue(unsigned max_msgs, size_t max_bytes, Pool *ring_pool)
+    : _ring_pool{ring_pool}
+    , _max_msgs{max_msgs}
+    , _max_bytes{max_bytes}
+{
+}
+
+TxQueue::~TxQueue()
+{
+    clear();
+    release_ring();
+}
+
+void TxQueue::release_ring()
+{
+    if (_count > 0)
+        return;
+
+    if (_ring_pool)
+        _ring_pool->free(_msgs);
+    else
+        free(_msgs);
+    _msgs = nullptr;
+}
+
+bool TxQueue::push(Packet *pkt, unsigned offset, uint64_t rank)
+{
+    const unsigned len = pkt->len - offset;
+    const unsigned first = _head_offset ? 1 : 0;
+    unsigned i;
+
+    assert(offset == 0 || _count == 0);
+
+    if (_count == _max_msgs || _bytes + len > _max_bytes)
+        return false;
+
+    /* Most endpoints never block: only allocate the ring when needed */
+    if (!_msgs) {
+        if (_ring_pool)
+            _msgs = (Entry *)_ring_pool->alloc();
+        else
+            _msgs = (Entry *)malloc(ring_size(_max_msgs));
+        if (!_msgs)
+            return false;
+    }
+
+    /* Usually appended: only ranked messages may need to go further */
+    for (i = _count; i > first && _at(i - 1).rank > rank; i--)
+        _at(i) = _at(i - 1);
+
+    _at(i) = {pkt->ref(), rank};
+    if (_count == 0)
+        _head_offset = offset;
+
+    _count++;
+    _bytes += len;
+
+    return true;
+}
+
+int TxQueue::fill_iovec(struct iovec *iov, int max) const
+{
+    int n = 0;
+
+    for (unsigned i = 0; i < _count && n < max; i++, n++) {
+        const Packet *pkt = _msgs[(_head + i) % _max_msgs].pkt;
+        const unsigned offset = i == 0 ? _head_offset : 0;
+
+        iov[n].iov_base = (void *)(pkt->data + offset);
+        iov[n].iov_len = pkt->len - offset;
+    }
+
+    return n;
+}
+
+unsigned TxQueue::consume(size_t len)
+{
+    unsigned done = 0;
+
+    _bytes -= len;
+
+    while (len > 0 && _count > 0) {
+        Packet *pkt = _msgs[_head].pkt;
+        const size_t left = pkt->len - _head_offset;
+
+        if (len < left) {
+            _head_offset += len;
+            break;
+        }
+
+        len -= left;
+        pkt->unref();
+        _msgs[_head].pkt = nullptr;
+
+        _head = (_head + 1) % _max_msgs;
+        _head_offset = 0;
+        _count--;
+        done++;
+    }
+
+    return done;
+}
+
+bool TxQueue::drop(bool (*can_drop)(const Packet *pkt))
+{
+    for (unsigned i = _head_offset ? 1 : 0; i < _count; i++) {
+        if (can_drop && !can_drop(_at(i).pkt))
+            continue;
+
+        _remove(i);
+        return true;
+    }
+
+    return false;
+}
+
+bool TxQueue::replace(Packet *pkt)
+{
+    const uint32_t msg_id = pkt->msg_id();
+    const uint16_t sys_comp_id = pkt->sys_comp_id();
+
+    for (unsigned i = _head_offset ? 1 : 0; i < _count; i++) {
+        Packet *old = _at(i).pkt;
+
+        if (old->msg_id() != msg_id || old->sys_comp_id() != sys_comp_id)
+            continue;
+
+        if (_bytes - old->len + pkt->len > _max_bytes)
+            return false;
+
+        _bytes = _bytes - old->len + pkt->len;
+        _at(i).pkt = pkt->ref();
+        old->unref();
+
+        return true;
+    }
+
+    return false;
+}
+
+bool TxQueue::drop_after(uint64_t rank)
+{
+    if (_count == 0 || (_count == 1 && _head_offset) || _at(_count - 1).rank <= rank)
+        return false;
+
+    _remove(_count - 1);
+    return true;
+}
+
+void TxQueue::_remove(unsigned i)
+{
+    Packet *pkt = _at(i).pkt;
+
+    if (i == 0) {
+        _at(0).pkt = nullptr;
+        _head = (_head + 1) % _max_msgs;
+    } else {
+        /* Close the gap: only done when the queue is full, so not often */
+        for (unsigned j = i; j + 1 < _count; j++)
+            _at(j) = _at(j + 1);
+        _at(_count - 1).pkt = nullptr;
+    }
+
+    _count--;
+    _bytes -= pkt->len;
+    pkt->unref();
+}
+
+void TxQueue::clear()
+{
+    while (_count > 0) {
+        _msgs[_head].pkt->unref();
+        _msgs[_head].pkt = nullptr;
+        _head = (_head + 1) % _max_msgs;
+        _count--;
+    }
+
+    _head = 0;
+    _head_offset = 0;
+    _bytes = 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "packet.h"
+#include "pool.h"
+
+/*
+ * Bounded FIFO of messages waiting to be written to an endpoint.
+ *
+ * The queue holds a reference to each message's Packet and releases it once
+ * the message is completely written, which may take several partial writes
+ * on stream endpoints: the head of the queue remembers how much of it was
+ * already written.
+ *
+ * Messages can be given a rank to be written in a different order than they
+ * were queued, see EgressScheduler.
+ */
+class TxQueue {
+public:
+    /* Rank of messages written in the order they were queued */
+    static const uint64_t RANK_LAST = UINT64_MAX;
+
+    /*
+     * If @ring_pool is given, the ring holding the messages is allocated from
+     * it: its blocks must be ring_size(@max_msgs) bytes.
+     */
+    TxQueue(unsigned max_msgs, size_t max_bytes, Pool *ring_pool = nullptr);
+    ~TxQueue();
+
+    TxQueue(const TxQueue &) = delete;
+    TxQueue &operator=(const TxQueue &) = delete;
+
+    bool empty() const { return _count == 0; }
+    unsigned count() const { return _count; }
+    size_t bytes() const { return _bytes; }
+    size_t max_bytes() const { return _max_bytes; }
+    void set_max_bytes(size_t max_bytes) { _max_bytes = max_bytes; }
+    /* Whether a message of @len bytes can be pushed without dropping another */
+    bool fits(size_t len) const { return _count < _max_msgs && _bytes + len <= _max_bytes; }
+
+    static size_t ring_size(unsigned max_msgs) { return max_msgs * sizeof(Entry); }
+
+    /* Next message to be written, the queue must not be empty */
+    const Packet *front() const { return _msgs[_head].pkt; }
+    uint64_t front_rank() const { return _msgs[_head].rank; }
+
+    /*
+     * Add @pkt to the queue, taking a reference: after all messages with a
+     * lower or equal @rank, but never before a partially written message. If
+     * the queue is empty, @offset bytes of it may have already been written.
+     * Returns false if the queue is full.
+     */
+    bool push(Packet *pkt, unsigned offset = 0, uint64_t rank = RANK_LAST);
+
+    /*
+     * Point @iov to up to @max messages from the head of the queue and
+     * return how many were added.
+     */
+    int fill_iovec(struct iovec *iov, int max) const;
+
+    /*
+     * Remove @len written bytes from the head of the queue. Returns how many
+     * messages were completely written.
+     */
+    unsigned consume(size_t len);
+
+    /*
+     * Remove the oldest message for which @can_drop returns true, or the
+     * oldest one if @can_drop is nullptr, to make room for new ones. A
+     * partially written message is never removed. Returns false if there
+     * was none to remove.
+     */
+    bool drop(bool (*can_drop)(const Packet *pkt) = nullptr);
+
+    /*
+     * Replace the queued message with the same id and from the same sender
+     * as @pkt by it, in place, unless it's partially written or @pkt doesn't
+     * fit. Returns false if there was none to replace.
+     */
+    bool replace(Packet *pkt);
+
+    /*
+     * Remove the last message if its rank is higher than @rank and it isn't
+     * partially written. Returns false if there was none to remove.
+     */
+    bool drop_after(uint64_t rank);
+
+    void clear();
+
+    /*
+     * Give the ring back if the queue is empty, it's allocated again on the
+     * next push()
+     */
+    void release_ring();
+
+private:
+    struct Entry {
+        Packet *pkt;
+        uint64_t rank;
+    };
+
+    Entry &_at(unsigned i) { return _msgs[(_head + i) % _max_msgs]; }
+    void _remove(unsigned i);
+
+    Entry *_msgs = nullptr;
+    Pool *_ring_pool;
+    unsigned _max_msgs;
+    unsigned _head = 0;
+    unsigned _count = 0;
+    unsigned _head_offset = 0;
+
+    size_t _max_bytes;
+    size_t _bytes = 0;
+};
@@ -0,0 +1,142 @@
+#include "txqueue.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <string>
+
+static std::string pending(const TxQueue &q)
+{
+    struct iovec iov[16];
+    std::string s;
+    int n = q.fill_iovec(iov, 16);
+
+    for (int i = 0; i < n; i++)
+        s.append((const char *)iov[i].iov_base, iov[i].iov_len);
+
+    return s;
+}
+
+static bool push(TxQueue &q, const char *str, unsigned offset = 0)
+{
+    struct buffer buf = {(unsigned)strlen(str), (uint8_t *)str, nullptr};
+    bool r = q.push(Packet::get(&buf), offset);
+
+    Packet::release(&buf);
+
+    return r;
+}
+
+TEST(TxQueueTest, partial_writes) {
+    TxQueue q{8, 1024};
+
+    EXPECT_TRUE(q.empty());
+    EXPECT_TRUE(push(q, "xxabc", 2));
+    EXPECT_TRUE(push(q, "defg"));
+    EXPECT_TRUE(push(q, "hi"));
+    EXPECT_EQ(q.count(), 3U);
+    EXPECT_EQ(q.bytes(), 9U);
+    EXPECT_EQ(pending(q), "abcdefghi");
+
+    // Finish first message and write part of the second
+    EXPECT_EQ(q.consume(5), 1U);
+    EXPECT_EQ(pending(q), "fghi");
+    EXPECT_EQ(q.bytes(), 4U);
+
+    EXPECT_EQ(q.consume(4), 2U);
+    EXPECT_TRUE(q.empty());
+    EXPECT_EQ(q.bytes(), 0U);
+}
+
+TEST(TxQueueTest, bounded) {
+    TxQueue q{2, 8};
+
+    EXPECT_TRUE(push(q, "12345"));
+    EXPECT_FALSE(push(q, "6789")); // too many bytes
+    EXPECT_TRUE(push(q, "678"));
+    EXPECT_FALSE(push(q, "")); // too many messages
+
+    // Wrap around the ring
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(q.consume(5), 1U);
+        EXPECT_TRUE(push(q, "abcde"));
+        EXPECT_EQ(q.consume(3), 1U);
+        EXPECT_TRUE(push(q, "fgh"));
+        EXPECT_EQ(pending(q), "abcdefgh");
+
+        EXPECT_EQ(q.consume(5), 1U);
+        EXPECT_TRUE(push(q, "12345"));
+        EXPECT_EQ(q.consume(3), 1U);
+        EXPECT_TRUE(push(q, "678"));
+    }
+
+    q.clear();
+    EXPECT_TRUE(q.empty());
+    EXPECT_TRUE(push(q, "12345678"));
+}
+
+TEST(TxQueueTest, shared_packet) {
+    TxQueue q1{8, 1024}, q2{8, 1024};
+    const char *str = "shared";
+    struct buffer buf = {(unsigned)strlen(str), (uint8_t *)str, nullptr};
+
+    Packet *pkt = Packet::get(&buf);
+    ASSERT_NE(pkt, nullptr);
+    EXPECT_EQ(Packet::get(&buf), pkt);
+
+    EXPECT_TRUE(q1.push(pkt));
+    EXPECT_TRUE(q2.push(pkt));
+    Packet::release(&buf);
+    EXPECT_EQ(buf.pkt, nullptr);
+
+    EXPECT_EQ(pending(q1), "shared");
+    q1.consume(6);
+    EXPECT_EQ(pending(q2), "shared");
+    q2.clear();
+
+    // Last reference is gone, it's recycled for the next message
+    buf.data = (uint8_t *)"other";
+    buf.len = 5;
+    EXPECT_EQ(Packet::get(&buf), pkt);
+    Packet::release(&buf);
+}
+
+static bool starts_with_x(const Packet *pkt)
+{
+    return pkt->data[0] == 'x';
+}
+
+TEST(TxQueueTest, drop) {
+    TxQueue q{4, 1024};
+
+    EXPECT_FALSE(q.drop());
+
+    EXPECT_TRUE(push(q, "..ab", 2));
+    EXPECT_TRUE(push(q, "cd"));
+    EXPECT_TRUE(push(q, "xe"));
+    EXPECT_TRUE(push(q, "fg"));
+    EXPECT_FALSE(push(q, "xh"));
+
+    // Partially written head is kept
+    EXPECT_TRUE(q.drop());
+    EXPECT_EQ(pending(q), "abxefg");
+    EXPECT_EQ(q.bytes(), 6U);
+
+    EXPECT_TRUE(q.drop(starts_with_x));
+    EXPECT_EQ(pending(q), "abfg");
+    EXPECT_FALSE(q.drop(starts_with_x));
+
+    EXPECT_TRUE(push(q, "xi"));
+    EXPECT_TRUE(push(q, "jk"));
+    EXPECT_EQ(q.consume(2), 1U);
+    EXPECT_EQ(pending(q), "fgxijk");
+
+    // Head can be dropped once nothing of it was written
+    EXPECT_TRUE(q.drop());
+    EXPECT_EQ(pending(q), "xijk");
+    EXPECT_TRUE(q.drop(starts_with_x));
+    EXPECT_EQ(pending(q), "jk");
+    EXPECT_EQ(q.count(), 1U);
+    EXPECT_EQ(q.bytes(), 2U);
+}
@@ -0,0 +1,695 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "uring_poller.h"
+
+#ifdef ENABLE_IO_URING
+
+#include <endian.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <common/log.h>
+
+/* Buffer group of the datagrams received, the only one */
+#define RX_BGID 0
+/* Set in the user_data of recvmsg requests, next to their Poll */
+#define RECV_TAG 1
+
+Pool UringPoller::poll_pool{"io_uring poll", sizeof(UringPoller::Poll)};
+
+UringPoller::~UringPoller()
+{
+    /* Rings are all set up once _sqes is */
+    if (_sqes)
+        _cancel_all();
+
+    for (Poll *poll : _polls) {
+        if (poll)
+            poll_pool.free(poll);
+    }
+
+    if (_sqes)
+        munmap(_sqes, _sqes_size);
+    if (_cq_ring && _cq_ring != _sq_ring)
+        munmap(_cq_ring, _cq_ring_size);
+    if (_sq_ring)
+        munmap(_sq_ring, _sq_ring_size);
+    if (_fd >= 0)
+        ::close(_fd);
+    /* The kernel is done with the buffers once the ring is closed */
+    if (_rx_mem)
+        munmap(_rx_mem, _rx_mem_size);
+}
+
+int UringPoller::open(unsigned entries)
+{
+    struct io_uring_params params = {};
+    uint8_t *sq, *cq;
+
+    _fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd < 0)
+        return -errno;
+
+    /* Without it, completions are lost if the CQ ring overflows */
+    if (!(params.features & IORING_FEAT_NODROP))
+        return -ENOTSUP;
+
+    _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (_cq_ring_size > _sq_ring_size)
+            _sq_ring_size = _cq_ring_size;
+        _cq_ring_size = _sq_ring_size;
+    }
+
+    _sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                    IORING_OFF_SQ_RING);
+    if (_sq_ring == MAP_FAILED) {
+        _sq_ring = nullptr;
+        return -errno;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _cq_ring = _sq_ring;
+    } else {
+        _cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        _fd, IORING_OFF_CQ_RING);
+        if (_cq_ring == MAP_FAILED) {
+            _cq_ring = nullptr;
+            return -errno;
+        }
+    }
+
+    _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe *)mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) {
+        _sqes = nullptr;
+        return -errno;
+    }
+
+    sq = (uint8_t *)_sq_ring;
+    _sq_head = (unsigned *)(sq + params.sq_off.head);
+    _sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    _sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    _sq_entries = params.sq_entries;
+    _sq_array = (unsigned *)(sq + params.sq_off.array);
+    _sqe_tail = *_sq_tail;
+
+    cq = (uint8_t *)_cq_ring;
+    _cq_head = (unsigned *)(cq + params.cq_off.head);
+    _cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    _cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+struct io_uring_sqe *UringPoller::_get_sqe()
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) == _sq_entries) {
+        int r = _submit(0);
+        if (r < 0) {
+            log_error("Could not submit io_uring requests (%s)", strerror(-r));
+            return nullptr;
+        }
+        if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) == _sq_entries)
+            return nullptr;
+    }
+
+    idx = _sqe_tail & _sq_mask;
+    sqe = &_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[idx] = idx;
+    _sqe_tail++;
+    _to_submit++;
+
+    return sqe;
+}
+
+int UringPoller::_submit(unsigned min_complete)
+{
+    int r;
+
+    __atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+    r = syscall(__NR_io_uring_enter, _fd, _to_submit, min_complete,
+                min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (r < 0)
+        return -errno;
+
+    _to_submit -= r;
+
+    return r;
+}
+
+int UringPoller::_arm(Poll *poll)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t events = poll->recv ? poll->events & ~EPOLLIN : poll->events;
+
+    if (poll->recv && !poll->recv_armed) {
+        int r = _arm_recv(poll);
+        if (r < 0)
+            return r;
+    }
+
+    /* Received fds are only polled for other events, if any */
+    if (poll->armed || !events)
+        return 0;
+
+    sqe = _get_sqe();
+    if (!sqe)
+        return -EBUSY;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = events << 16 | events >> 16;
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = poll->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uintptr_t)poll;
+    poll->armed = true;
+    _armed++;
+
+    return 0;
+}
+
+int UringPoller::_arm_recv(Poll *poll)
+{
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_sqe *sqe = _get_sqe();
+
+    if (!sqe)
+        return -EBUSY;
+
+    /* Datagrams go to a buffer of the group each, after their sender */
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = poll->fd;
+    sqe->addr = (uintptr_t)&_rx_msghdr;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RX_BGID;
+    sqe->user_data = (uintptr_t)poll | RECV_TAG;
+    poll->recv_armed = true;
+    _armed++;
+
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int UringPoller::_cancel(Poll *poll)
+{
+    struct io_uring_sqe *sqe = _get_sqe();
+
+    if (!sqe)
+        return -EBUSY;
+
+    /* Completion of the removal itself is ignored, the poll gets its own */
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)poll;
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+int UringPoller::_cancel_recv(Poll *poll)
+{
+    struct io_uring_sqe *sqe = _get_sqe();
+
+    if (!sqe)
+        return -EBUSY;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)poll | RECV_TAG;
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+/*
+ * A poll holds a reference to its fd until it completes. Cancel them all
+ * and wait for their completions: otherwise the kernel only drops them when
+ * it tears the ring down in the background, and sockets stay bound for a
+ * while after the router exits.
+ */
+void UringPoller::_cancel_all()
+{
+    for (Poll *poll : _polls) {
+        if (poll && poll->armed && _cancel(poll) < 0)
+            return;
+        if (poll && poll->recv_armed && _cancel_recv(poll) < 0)
+            return;
+    }
+
+    while (_armed > 0) {
+        unsigned head = *_cq_head;
+        unsigned tail;
+
+        if (_submit(1) < 0)
+            return;
+
+        tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &_cqes[head & _cq_mask];
+            Poll *poll = (Poll *)(uintptr_t)(cqe->user_data & ~(uint64_t)RECV_TAG);
+
+            if (!poll)
+                continue;
+
+            if (cqe->user_data & RECV_TAG) {
+                /* Datagrams received meanwhile are just dropped */
+                if (cqe->flags & IORING_CQE_F_MORE)
+                    continue;
+                poll->recv_armed = false;
+            } else {
+                poll->armed = false;
+            }
+
+            _armed--;
+            if (!poll->active)
+                _release(poll);
+        }
+
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+void UringPoller::_queue_arm(Poll *poll)
+{
+    if (poll->queued)
+        return;
+
+    poll->next = _to_arm;
+    poll->queued = true;
+    _to_arm = poll;
+}
+
+/* Free a removed poll once the kernel is done with it */
+void UringPoller::_release(Poll *poll)
+{
+    if (!poll->active && !poll->armed && !poll->recv_armed && !poll->queued)
+        poll_pool.free(poll);
+}
+
+int UringPoller::add_fd(int fd, void *data, int events)
+{
+    Poll *poll;
+
+    if (fd < 0)
+        return -EBADF;
+
+    if ((size_t)fd >= _polls.size())
+        _polls.resize(fd + 1, nullptr);
+    if (_polls[fd])
+        return -EEXIST;
+
+    poll = (Poll *)poll_pool.alloc();
+    if (!poll)
+        return -ENOMEM;
+
+    poll->data = data;
+    poll->fd = fd;
+    poll->events = events;
+    poll->active = true;
+    poll->armed = false;
+    poll->queued = false;
+    poll->recv = false;
+    poll->recv_armed = false;
+    poll->rx_head = -1;
+    poll->rx_tail = -1;
+    poll->rx_taken = -1;
+    _polls[fd] = poll;
+    _queue_arm(poll);
+
+    return 0;
+}
+
+int UringPoller::mod_fd(int fd, void *data, int events)
+{
+    Poll *poll = fd >= 0 && (size_t)fd < _polls.size() ? _polls[fd] : nullptr;
+
+    if (!poll)
+        return -ENOENT;
+
+    poll->data = data;
+    if (poll->events == (uint32_t)events && (poll->armed || poll->queued))
+        return 0;
+
+    poll->events = events;
+
+    /* Polls not armed yet just take the new events, others are armed again on cancellation */
+    if (poll->armed)
+        return _cancel(poll);
+    if (!poll->queued)
+        _queue_arm(poll);
+
+    return 0;
+}
+
+int UringPoller::remove_fd(int fd)
+{
+    Poll *poll = fd >= 0 && (size_t)fd < _polls.size() ? _polls[fd] : nullptr;
+    int r;
+
+    if (!poll)
+        return -ENOENT;
+
+    _polls[fd] = nullptr;
+    poll->active = false;
+    _drop_datagrams(poll);
+    auto it = std::find(_rx_ready.begin(), _rx_ready.end(), poll);
+    if (it != _rx_ready.end())
+        _rx_ready.erase(it);
+
+    if (poll->armed && (r = _cancel(poll)) < 0)
+        return r;
+    if (poll->recv_armed && (r = _cancel_recv(poll)) < 0)
+        return r;
+    _release(poll);
+
+    return 0;
+}
+
+int UringPoller::_setup_rx()
+{
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_buf_reg reg = {};
+    const size_t ring_size = RX_BUFS * sizeof(struct io_uring_buf);
+
+    /* The ring must be page aligned, buffers follow it */
+    _rx_mem_size = ring_size + RX_BUFS * RX_BUF_SIZE;
+    _rx_mem = mmap(nullptr, _rx_mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (_rx_mem == MAP_FAILED) {
+        _rx_mem = nullptr;
+        return -errno;
+    }
+
+    reg.ring_addr = (uintptr_t)_rx_mem;
+    reg.ring_entries = RX_BUFS;
+    reg.bgid = RX_BGID;
+    if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+
+        munmap(_rx_mem, _rx_mem_size);
+        _rx_mem = nullptr;
+        return -err;
+    }
+
+    _buf_ring = (struct io_uring_buf_ring *)_rx_mem;
+    _rx_bufs = (uint8_t *)_rx_mem + ring_size;
+    for (unsigned bid = 0; bid < RX_BUFS; bid++)
+        _recycle(bid);
+
+    /* The sender is all we need to know of datagrams */
+    _rx_msghdr.msg_namelen = sizeof(struct sockaddr_storage);
+    /* At most one per fd with datagrams, each one holding a buffer */
+    _rx_ready.reserve(RX_BUFS);
+
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int UringPoller::add_recv_fd(int fd, void *data, int events)
+{
+    int r;
+
+    if (!_buf_ring && !_recv_unsupported) {
+        r = _setup_rx();
+        if (r < 0) {
+            log_info("io_uring can't receive datagrams (%s), polling sockets instead", strerror(-r));
+            _recv_unsupported = true;
+        }
+    }
+
+    if (_recv_unsupported)
+        return -ENOTSUP;
+
+    r = add_fd(fd, data, events);
+    if (r < 0)
+        return r;
+
+    _polls[fd]->recv = true;
+
+    return 0;
+}
+
+/* Give buffer @bid back to the kernel, to receive datagrams in */
+void UringPoller::_recycle(unsigned bid)
+{
+    /* Not _buf_ring->bufs: C++ moves that flexible array past the tail */
+    struct io_uring_buf *buf = (struct io_uring_buf *)_buf_ring + (_buf_tail & (RX_BUFS - 1));
+
+    buf->addr = (uintptr_t)(_rx_bufs + bid * RX_BUF_SIZE);
+    buf->len = RX_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&_buf_ring->tail, ++_buf_tail, __ATOMIC_RELEASE);
+}
+
+void UringPoller::_drop_datagrams(Poll *poll)
+{
+    if (poll->rx_taken >= 0)
+        _recycle(poll->rx_taken);
+
+    for (int bid = poll->rx_head; bid >= 0; bid = _rx[bid].next)
+        _recycle(bid);
+
+    poll->rx_taken = poll->rx_head = poll->rx_tail = -1;
+}
+
+int UringPoller::next_datagram(int fd, Datagram *dgram)
+{
+    Poll *poll = fd >= 0 && (size_t)fd < _polls.size() ? _polls[fd] : nullptr;
+    struct io_uring_recvmsg_out *out;
+    uint8_t *buf;
+    int bid;
+
+    if (!poll)
+        return -ENOENT;
+
+    /* The previous one was handled: its buffer can be used again */
+    if (poll->rx_taken >= 0) {
+        _recycle(poll->rx_taken);
+        poll->rx_taken = -1;
+    }
+
+    bid = poll->rx_head;
+    if (bid < 0)
+        return poll->recv ? 0 : -ENOTSUP;
+
+    poll->rx_head = _rx[bid].next;
+    if (poll->rx_head < 0)
+        poll->rx_tail = -1;
+    poll->rx_taken = bid;
+
+    /* Laid out as struct io_uring_recvmsg_out, the sender and the payload */
+    buf = _rx_bufs + bid * RX_BUF_SIZE;
+    out = (struct io_uring_recvmsg_out *)buf;
+    dgram->addr = (const struct sockaddr_storage *)(out + 1);
+    dgram->data = buf + sizeof(*out) + _rx_msghdr.msg_namelen;
+    dgram->len = _rx[bid].len - (dgram->data - buf);
+    dgram->truncated = out->flags & MSG_TRUNC;
+
+    return 1;
+}
+
+/*
+ * Handle a completion of the recvmsg of @poll: queue the datagram received,
+ * if any, and arm the recvmsg again once it's done. Returns the events to
+ * report, only EPOLLIN when the first datagram is queued or EPOLLERR.
+ */
+uint32_t UringPoller::_complete_recv(Poll *poll, const struct io_uring_cqe *cqe)
+{
+    uint32_t events = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (!poll->active || cqe->res < 0) {
+            _recycle(bid);
+        } else {
+            _rx[bid].len = cqe->res;
+            _rx[bid].next = -1;
+            if (poll->rx_tail >= 0) {
+                _rx[poll->rx_tail].next = bid;
+            } else {
+                poll->rx_head = bid;
+                _rx_ready.push_back(poll);
+                events = EPOLLIN;
+            }
+            poll->rx_tail = bid;
+        }
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return events;
+
+    poll->recv_armed = false;
+    _armed--;
+
+    if (!poll->active) {
+        _release(poll);
+        return 0;
+    }
+
+    switch (cqe->res) {
+    case -EINVAL:
+        /* Multishot recvmsg isn't supported, poll the fd like others */
+        if (!_recv_unsupported)
+            log_info("io_uring can't receive datagrams, polling sockets instead");
+        _recv_unsupported = true;
+        poll->recv = false;
+        break;
+    case -ENOBUFS:
+        /* Armed again once handled datagrams gave their buffers back */
+        log_debug("io_uring out of buffers to receive datagrams of fd %d", poll->fd);
+        break;
+    default:
+        if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            /* Not armed again: it would just fail over and over */
+            log_error("Could not receive from fd %d (%s)", poll->fd, strerror(-cqe->res));
+            return EPOLLERR;
+        }
+    }
+
+    _queue_arm(poll);
+
+    return events;
+}
+
+int UringPoller::wait(struct epoll_event *events, int max_events)
+{
+    unsigned head, tail;
+    int n = 0, r;
+
+    /* Arm polls added or completed since the last call */
+    while (_to_arm) {
+        Poll *poll = _to_arm;
+
+        if (poll->active && _arm(poll) < 0)
+            break;
+
+        _to_arm = poll->next;
+        poll->queued = false;
+        if (!poll->active)
+            _release(poll);
+    }
+
+    /* Datagrams left since the last call are reported again, without waiting */
+    for (size_t i = 0; i < _rx_ready.size();) {
+        Poll *poll = _rx_ready[i];
+
+        if (poll->rx_taken >= 0) {
+            _recycle(poll->rx_taken);
+            poll->rx_taken = -1;
+        }
+
+        if (poll->rx_head < 0) {
+            _rx_ready[i] = _rx_ready.back();
+            _rx_ready.pop_back();
+            continue;
+        }
+
+        if (n < max_events) {
+            events[n].events = EPOLLIN;
+            events[n].data.ptr = poll->data;
+            n++;
+        }
+        i++;
+    }
+
+    head = *_cq_head;
+    tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+    if ((head == tail && n == 0) || _to_submit) {
+        r = _submit(head == tail && n == 0 ? 1 : 0);
+        if (r < 0) {
+            errno = -r;
+            return -1;
+        }
+        tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; head != tail && n < max_events; head++) {
+        struct io_uring_cqe *cqe = &_cqes[head & _cq_mask];
+        Poll *poll = (Poll *)(uintptr_t)(cqe->user_data & ~(uint64_t)RECV_TAG);
+
+        if (!poll)
+            continue;
+
+        if (cqe->user_data & RECV_TAG) {
+            uint32_t ev = _complete_recv(poll, cqe);
+
+            if (ev) {
+                events[n].events = ev;
+                events[n].data.ptr = poll->data;
+                n++;
+            }
+            continue;
+        }
+
+        poll->armed = false;
+        _armed--;
+
+        if (!poll->active) {
+            _release(poll);
+            continue;
+        }
+
+        if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            /* Not armed again: it would just fail over and over */
+            log_error("Could not poll fd %d (%s)", poll->fd, strerror(-cqe->res));
+            events[n].events = EPOLLERR;
+            events[n].data.ptr = poll->data;
+            n++;
+            continue;
+        }
+
+        if (cqe->res > 0) {
+            events[n].events = cqe->res;
+            events[n].data.ptr = poll->data;
+            n++;
+        }
+
+        _queue_arm(poll);
+    }
+
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+#endif
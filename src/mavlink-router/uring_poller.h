@@ -0,0 +1,184 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "pool.h"
+
+/*
+ * Alternative to epoll for the Mainloop, built with --enable-io-uring and
+ * selected with EventBackend=io_uring.
+ *
+ * Each fd has a one-shot poll request in the ring that is armed again after
+ * its completion is handled, so readiness is level-triggered like with epoll.
+ * Arming, changing and removing polls only queue submissions: they're passed
+ * to the kernel together with the wait for completions, in a single syscall
+ * per mainloop iteration.
+ *
+ * Datagram sockets can instead have their datagrams received by the ring: a
+ * multishot recvmsg puts each one in a buffer it picks from a ring of
+ * provided buffers, so reading them takes no syscall at all.
+ */
+class UringPoller {
+public:
+    /* Buffers datagrams are received in, shared by all fds of the ring */
+    static const unsigned RX_BUFS = 128;
+    static const size_t RX_BUF_SIZE = 4096;
+
+    /* A datagram received by the ring, see next_datagram() */
+    struct Datagram {
+        uint8_t *data;
+        size_t len;
+        const struct sockaddr_storage *addr;
+        /* Didn't fit in a buffer, only its beginning was received */
+        bool truncated;
+    };
+
+    UringPoller() { }
+    ~UringPoller();
+
+    UringPoller(const UringPoller &) = delete;
+    UringPoller &operator=(const UringPoller &) = delete;
+
+    int open(unsigned entries);
+    int add_fd(int fd, void *data, int events);
+    int mod_fd(int fd, void *data, int events);
+    int remove_fd(int fd);
+
+    /*
+     * Like add_fd() for a datagram socket, but the ring receives its
+     * datagrams instead of polling it for EPOLLIN: once EPOLLIN is reported,
+     * they're taken with next_datagram(). Like with level-triggered epoll,
+     * EPOLLIN is reported again as long as some are left. Returns -ENOTSUP if
+     * the kernel can't receive into provided buffers, the fd should then be
+     * added with add_fd().
+     */
+    int add_recv_fd(int fd, void *data, int events);
+
+    /*
+     * Take the next datagram received for @fd, valid until the next call or
+     * wait(). Returns 1, 0 once there is none left or -ENOTSUP if the ring
+     * doesn't receive for @fd (anymore): it's polled for EPOLLIN then.
+     */
+    int next_datagram(int fd, Datagram *dgram);
+
+    /*
+     * Submit queued requests and wait for events. Like epoll_wait(), returns
+     * the number of events filled in @events or -1 with errno set.
+     */
+    int wait(struct epoll_event *events, int max_events);
+
+    /* Poll requests of all rings, see Mainloop::_reserve_pools() */
+    static Pool poll_pool;
+
+private:
+    /*
+     * A poll request. It's freed only after the kernel is done with it, so
+     * completions of polls removed meanwhile can be recognized and dropped.
+     */
+    struct Poll {
+        void *data;
+        Poll *next;
+        int fd;
+        uint32_t events;
+        /* Still in _polls, i.e. not removed */
+        bool active;
+        /* Waiting for a completion from the kernel */
+        bool armed;
+        /* In the _to_arm list */
+        bool queued;
+        /* Received by a multishot recvmsg rather than polled for EPOLLIN */
+        bool recv;
+        /* The recvmsg is waiting for completions from the kernel */
+        bool recv_armed;
+        /* Buffers of datagrams received, first and last, and of the one taken */
+        int rx_head;
+        int rx_tail;
+        int rx_taken;
+    };
+
+    /* A received datagram, by buffer id */
+    struct RxBuf {
+        /* Bytes of the buffer used, see struct io_uring_recvmsg_out */
+        unsigned len;
+        /* Next one received for the same fd, or -1 */
+        int next;
+    };
+
+    struct io_uring_sqe *_get_sqe();
+    int _submit(unsigned min_complete);
+    int _arm(Poll *poll);
+    int _arm_recv(Poll *poll);
+    int _cancel(Poll *poll);
+    int _cancel_recv(Poll *poll);
+    void _cancel_all();
+    void _queue_arm(Poll *poll);
+    void _release(Poll *poll);
+    int _setup_rx();
+    uint32_t _complete_recv(Poll *poll, const struct io_uring_cqe *cqe);
+    void _recycle(unsigned bid);
+    void _drop_datagrams(Poll *poll);
+
+    int _fd = -1;
+
+    void *_sq_ring = nullptr;
+    size_t _sq_ring_size = 0;
+    void *_cq_ring = nullptr;
+    size_t _cq_ring_size = 0;
+    struct io_uring_sqe *_sqes = nullptr;
+    size_t _sqes_size = 0;
+
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned *_sq_array;
+    /* Tail including requests not passed to the kernel yet */
+    unsigned _sqe_tail;
+    unsigned _to_submit = 0;
+
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned _cq_mask;
+    struct io_uring_cqe *_cqes;
+
+    /* Active poll of each fd */
+    std::vector<Poll *> _polls;
+    /* Polls and recvmsgs, active or not, waiting for a completion */
+    unsigned _armed = 0;
+    Poll *_to_arm = nullptr;
+
+    /* Polls with datagrams received, reported with EPOLLIN */
+    std::vector<Poll *> _rx_ready;
+
+    /* Set up with the first fd added with add_recv_fd() */
+    void *_rx_mem = nullptr;
+    size_t _rx_mem_size = 0;
+    struct io_uring_buf_ring *_buf_ring = nullptr;
+    uint16_t _buf_tail = 0;
+    uint8_t *_rx_bufs = nullptr;
+    RxBuf _rx[RX_BUFS];
+    struct msghdr _rx_msghdr = {};
+    /* The kernel doesn't support it: fds are polled for EPOLLIN instead */
+    bool _recv_unsupported = false;
+};
@@ -0,0 +1,131 @@
+#include "uring_poller.h"
+
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef ENABLE_IO_URING
+
+static int udp_socket(struct sockaddr_in *addr)
+{
+    socklen_t addrlen = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    *addr = {};
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0
+        || getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0)
+        return -1;
+
+    return fd;
+}
+
+TEST(UringPollerTest, receive_datagrams) {
+    UringPoller uring;
+    struct sockaddr_in rx_addr, tx_addr;
+    struct epoll_event events[8];
+    UringPoller::Datagram dgram;
+    char data[32];
+    int rx_fd, tx_fd, r;
+
+    if (uring.open(16) < 0)
+        return;
+
+    rx_fd = udp_socket(&rx_addr);
+    tx_fd = udp_socket(&tx_addr);
+    ASSERT_GE(rx_fd, 0);
+    ASSERT_GE(tx_fd, 0);
+
+    r = uring.add_recv_fd(rx_fd, &rx_fd, EPOLLIN);
+    if (r == -ENOTSUP)
+        return;
+    ASSERT_EQ(r, 0);
+
+    // Arm the recvmsg before anything is sent
+    ASSERT_EQ(uring.add_fd(tx_fd, &tx_fd, EPOLLOUT), 0);
+    ASSERT_EQ(uring.wait(events, 8), 1);
+    ASSERT_EQ(uring.remove_fd(tx_fd), 0);
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(data, sizeof(data), "datagram %d", i);
+        ASSERT_EQ(sendto(tx_fd, data, strlen(data), 0, (struct sockaddr *)&rx_addr, sizeof(rx_addr)),
+                  (ssize_t)strlen(data));
+    }
+
+    // Reported once, then taken in order
+    ASSERT_EQ(uring.wait(events, 8), 1);
+    EXPECT_EQ(events[0].events, (uint32_t)EPOLLIN);
+    EXPECT_EQ(events[0].data.ptr, &rx_fd);
+
+    for (int i = 0; i < 3; i++) {
+        const struct sockaddr_in *from;
+
+        // Reported again while some are left, without waiting
+        if (i == 1) {
+            ASSERT_EQ(uring.wait(events, 8), 1);
+            EXPECT_EQ(events[0].data.ptr, &rx_fd);
+        }
+
+        ASSERT_EQ(uring.next_datagram(rx_fd, &dgram), 1);
+        snprintf(data, sizeof(data), "datagram %d", i);
+        ASSERT_EQ(dgram.len, strlen(data));
+        EXPECT_EQ(memcmp(dgram.data, data, dgram.len), 0);
+        EXPECT_FALSE(dgram.truncated);
+
+        from = (const struct sockaddr_in *)dgram.addr;
+        EXPECT_EQ(from->sin_port, tx_addr.sin_port);
+    }
+    EXPECT_EQ(uring.next_datagram(rx_fd, &dgram), 0);
+
+    close(tx_fd);
+    close(rx_fd);
+}
+
+TEST(UringPollerTest, more_datagrams_than_buffers) {
+    UringPoller uring;
+    struct sockaddr_in rx_addr, tx_addr;
+    struct epoll_event events[8];
+    UringPoller::Datagram dgram;
+    const unsigned n = UringPoller::RX_BUFS * 2;
+    unsigned received = 0;
+    int rx_fd, tx_fd, r;
+
+    if (uring.open(16) < 0)
+        return;
+
+    rx_fd = udp_socket(&rx_addr);
+    tx_fd = udp_socket(&tx_addr);
+    ASSERT_GE(rx_fd, 0);
+    ASSERT_GE(tx_fd, 0);
+
+    r = uring.add_recv_fd(rx_fd, &rx_fd, EPOLLIN);
+    if (r == -ENOTSUP)
+        return;
+    ASSERT_EQ(r, 0);
+
+    for (unsigned i = 0; i < n; i++)
+        ASSERT_EQ(sendto(tx_fd, &i, sizeof(i), 0, (struct sockaddr *)&rx_addr, sizeof(rx_addr)),
+                  (ssize_t)sizeof(i));
+
+    // Out of buffers, the rest waits in the socket until they are given back
+    while (received < n) {
+        ASSERT_EQ(uring.wait(events, 8), 1);
+        while (uring.next_datagram(rx_fd, &dgram) > 0) {
+            unsigned i;
+
+            ASSERT_EQ(dgram.len, sizeof(i));
+            memcpy(&i, dgram.data, sizeof(i));
+            EXPECT_EQ(i, received);
+            received++;
+        }
+    }
+
+    close(tx_fd);
+    close(rx_fd);
+}
+
+#endif
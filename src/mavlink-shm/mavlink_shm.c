@@ -0,0 +1,260 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mavlink_shm.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <common/shm_ring.h>
+
+struct mavlink_shm {
+    int sock;
+    /* Rung by the router, and the one we ring */
+    int doorbell_fd;
+    int router_doorbell_fd;
+    void *region;
+    size_t region_size;
+    struct shm_ring tx;
+    struct shm_ring rx;
+    bool armed;
+};
+
+/* Receive the region and the doorbells sent by the router once connected */
+static int recv_hello(struct mavlink_shm *shm)
+{
+    struct shm_header hello;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int fds[3];
+    ssize_t r;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    r = recvmsg(shm->sock, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0)
+        return -errno;
+    if (r == 0)
+        return -EPIPE;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return -EPROTO;
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    shm->doorbell_fd = fds[1];
+    shm->router_doorbell_fd = fds[2];
+
+    if (r != sizeof(hello) || (msg.msg_flags & MSG_CTRUNC) || hello.magic != SHM_MAGIC
+        || hello.version != SHM_VERSION || !shm_ring_size_valid(hello.ring_size)) {
+        close(fds[0]);
+        return -EPROTO;
+    }
+
+    shm->region_size = shm_region_size(hello.ring_size);
+    if (fstat(fds[0], &st) < 0 || (size_t)st.st_size < shm->region_size) {
+        close(fds[0]);
+        return -EPROTO;
+    }
+
+    shm->region = mmap(NULL, shm->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (shm->region == MAP_FAILED) {
+        shm->region = NULL;
+        return -errno;
+    }
+
+    shm_ring_attach(&shm->tx, shm->region, hello.ring_size, SHM_TO_ROUTER, true);
+    shm_ring_attach(&shm->rx, shm->region, hello.ring_size, SHM_TO_CLIENT, false);
+
+    return 0;
+}
+
+struct mavlink_shm *mavlink_shm_connect(const char *path)
+{
+    struct sockaddr_un addr = {};
+    const size_t len = strlen(path);
+    socklen_t addrlen = sizeof(addr);
+    struct mavlink_shm *shm;
+    int r;
+
+    if (len < 2 || len >= sizeof(addr.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    shm = (struct mavlink_shm *)calloc(1, sizeof(*shm));
+    if (!shm)
+        return NULL;
+    shm->doorbell_fd = -1;
+    shm->router_doorbell_fd = -1;
+
+    shm->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (shm->sock < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    if (connect(shm->sock, (struct sockaddr *)&addr, addrlen) < 0) {
+        r = -errno;
+        goto fail;
+    }
+
+    r = recv_hello(shm);
+    if (r < 0)
+        goto fail;
+
+    return shm;
+
+fail:
+    mavlink_shm_close(shm);
+    errno = -r;
+    return NULL;
+}
+
+void mavlink_shm_close(struct mavlink_shm *shm)
+{
+    if (!shm)
+        return;
+
+    if (shm->region)
+        munmap(shm->region, shm->region_size);
+    if (shm->doorbell_fd > -1)
+        close(shm->doorbell_fd);
+    if (shm->router_doorbell_fd > -1)
+        close(shm->router_doorbell_fd);
+    if (shm->sock > -1)
+        close(shm->sock);
+
+    free(shm);
+}
+
+int mavlink_shm_send(struct mavlink_shm *shm, const void *data, size_t len)
+{
+    const uint64_t one = 1;
+    int r;
+
+    r = shm_ring_push(&shm->tx, data, len);
+    if (r < 0)
+        return r;
+
+    /* The router asks for it only when it has nothing else to do */
+    if (shm_ring_needs_wakeup(&shm->tx) && write(shm->router_doorbell_fd, &one, sizeof(one)) < 0
+        && errno != EAGAIN)
+        return -errno;
+
+    return 0;
+}
+
+int mavlink_shm_peek(struct mavlink_shm *shm, const uint8_t **data, size_t *len)
+{
+    if (shm->armed) {
+        shm_ring_disarm(&shm->rx);
+        shm->armed = false;
+    }
+
+    return shm_ring_peek(&shm->rx, data, len);
+}
+
+void mavlink_shm_consume(struct mavlink_shm *shm)
+{
+    shm_ring_consume(&shm->rx);
+}
+
+ssize_t mavlink_shm_recv(struct mavlink_shm *shm, void *buf, size_t len)
+{
+    const uint8_t *data;
+    size_t data_len;
+    int r;
+
+    r = mavlink_shm_peek(shm, &data, &data_len);
+    if (r <= 0)
+        return r;
+
+    if (data_len > len) {
+        mavlink_shm_consume(shm);
+        return -EMSGSIZE;
+    }
+
+    memcpy(buf, data, data_len);
+    mavlink_shm_consume(shm);
+
+    return data_len;
+}
+
+int mavlink_shm_fd(struct mavlink_shm *shm)
+{
+    return shm->doorbell_fd;
+}
+
+bool mavlink_shm_prepare_wait(struct mavlink_shm *shm)
+{
+    uint64_t n;
+
+    /* Doorbells of records already received, the eventfd is non-blocking */
+    if (read(shm->doorbell_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        return false;
+
+    shm->armed = true;
+    return shm_ring_arm(&shm->rx);
+}
+
+int mavlink_shm_wait(struct mavlink_shm *shm, int timeout_msec)
+{
+    /* The router never writes to the socket, it's readable once closed */
+    struct pollfd fds[2] = {
+        {shm->doorbell_fd, POLLIN, 0},
+        {shm->sock, POLLIN, 0},
+    };
+    int r;
+
+    if (!mavlink_shm_prepare_wait(shm))
+        return 1;
+
+    r = poll(fds, 2, timeout_msec);
+    if (r < 0)
+        return -errno;
+
+    if (fds[1].revents)
+        return -EPIPE;
+
+    return fds[0].revents ? 1 : 0;
+}
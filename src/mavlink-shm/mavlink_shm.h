@@ -0,0 +1,80 @@
+/*
+ * This file is part of the MAVLink Router project
+ *
+ * Copyright (C) 2021  Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Client of a ShmEndpoint of mavlink-routerd: messages are exchanged
+ * through shared memory, see common/shm_ring.h. None of the functions is
+ * thread safe, but one thread may send while another one receives.
+ *
+ * Functions return a negative errno on error. -EPIPE means the router
+ * closed the connection, then only mavlink_shm_close() is left to do.
+ */
+struct mavlink_shm;
+
+/* @path of the socket of the ShmEndpoint, abstract if it starts with '@' */
+struct mavlink_shm *mavlink_shm_connect(const char *path);
+void mavlink_shm_close(struct mavlink_shm *shm);
+
+/*
+ * Send whole MAVLink messages, @len bytes at most SHM_RECORD_MAX. Returns
+ * -ENOBUFS if the ring is full, in which case nothing was sent.
+ */
+int mavlink_shm_send(struct mavlink_shm *shm, const void *data, size_t len);
+
+/*
+ * Point @data to the next received record, one or more whole MAVLink
+ * messages, without copying it. It stays valid until mavlink_shm_consume().
+ * Returns 1, 0 if there's nothing to receive or -EBADMSG.
+ */
+int mavlink_shm_peek(struct mavlink_shm *shm, const uint8_t **data, size_t *len);
+void mavlink_shm_consume(struct mavlink_shm *shm);
+
+/*
+ * Copy the next record to @buf. Returns its length, 0 if there's nothing to
+ * receive or -EMSGSIZE if it's larger than @len, in which case it's dropped.
+ */
+ssize_t mavlink_shm_recv(struct mavlink_shm *shm, void *buf, size_t len);
+
+/*
+ * Wait up to @timeout_msec, -1 for ever, for something to receive. Returns
+ * 1 if there is, 0 on timeout.
+ */
+int mavlink_shm_wait(struct mavlink_shm *shm, int timeout_msec);
+
+/*
+ * To wait with one's own poll() or epoll: the fd becomes readable when
+ * there's something to receive, once mavlink_shm_prepare_wait() returned
+ * true. If it returned false, there's something to receive already.
+ * Unlike with mavlink_shm_wait(), the router going away isn't noticed.
+ */
+int mavlink_shm_fd(struct mavlink_shm *shm);
+bool mavlink_shm_prepare_wait(struct mavlink_shm *shm);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+# This file is part of the MAVLink Router project
+#
+# Copyright (C) 2021  Intel Corporation. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+'''
+Load test of the TCP server: connect 100, 1000 and 2000 clients, stream
+heartbeats to them and report the router's memory and CPU use per client.
+
+Usage: tcp_load_test.py [path to mavlink-routerd]
+'''
+
+import os
+import resource
+import selectors
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+TCP_PORT = 25760
+UDP_PORT = 24550
+RATE_HZ = 50
+DURATION_SEC = 5
+CLIENTS = [100, 1000, 2000]
+
+
+def x25crc(data, extra):
+    crc = 0xffff
+    for b in bytearray(data) + bytearray([extra]):
+        tmp = b ^ (crc & 0xff)
+        tmp = (tmp ^ (tmp << 4)) & 0xff
+        crc = ((crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4)) & 0xffff
+    return crc
+
+
+def heartbeat(seq):
+    payload = struct.pack('<IBBBBB', 0, 2, 3, 0x51, 4, 3)
+    header = struct.pack('<BBBBBBBHB', 0xfd, len(payload), 0, 0, seq & 0xff, 1, 1, 0, 0)
+    return header + payload + struct.pack('<H', x25crc(header[1:] + payload, 50))
+
+
+def proc_stat(pid):
+    '''Return (RSS in KiB, CPU time in seconds) of pid'''
+    with open('/proc/%d/status' % pid) as f:
+        rss = [int(l.split()[1]) for l in f if l.startswith('VmRSS:')][0]
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    cpu = (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+    return rss, cpu
+
+
+def connect_clients(sel, n):
+    clients = []
+    for _ in range(n):
+        c = socket.create_connection(('127.0.0.1', TCP_PORT))
+        c.setblocking(False)
+        sel.register(c, selectors.EVENT_READ)
+        clients.append(c)
+    return clients
+
+
+def drain(sel, received, timeout):
+    for key, _ in sel.select(timeout):
+        try:
+            data = key.fileobj.recv(65536)
+        except BlockingIOError:
+            continue
+        received[key.fileobj] = received.get(key.fileobj, 0) + len(data)
+
+
+def run(router, n):
+    p = subprocess.Popen([router, '-t', str(TCP_PORT), '0.0.0.0:%d' % UDP_PORT],
+                         stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+    sel = selectors.DefaultSelector()
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    received = {}
+
+    try:
+        rss_idle, _ = proc_stat(p.pid)
+        clients = connect_clients(sel, n)
+        time.sleep(0.5)
+        rss_connected, cpu_start = proc_stat(p.pid)
+
+        start = time.time()
+        seq = 0
+        while time.time() - start < DURATION_SEC:
+            tx.sendto(heartbeat(seq), ('127.0.0.1', UDP_PORT))
+            seq += 1
+            deadline = start + float(seq) / RATE_HZ
+            while time.time() < deadline:
+                drain(sel, received, max(deadline - time.time(), 0))
+        drain(sel, received, 0.5)
+
+        rss_busy, cpu_end = proc_stat(p.pid)
+        expected = seq * len(heartbeat(0))
+        complete = sum(1 for c in clients if received.get(c, 0) == expected)
+        cpu = cpu_end - cpu_start
+
+        print('%5d clients: %6d KiB idle, %6d KiB connected (%.1f KiB/client), '
+              '%6d KiB streaming (%.1f KiB/client), CPU %.1f%% (%.2f us/message/client), '
+              '%d/%d clients got all %d messages'
+              % (n, rss_idle, rss_connected, float(rss_connected - rss_idle) / n, rss_busy,
+                 float(rss_busy - rss_idle) / n, 100 * cpu / DURATION_SEC,
+                 1e6 * cpu / (seq * n), complete, n, seq))
+
+        for c in clients:
+            c.close()
+    finally:
+        p.terminate()
+        p.wait()
+
+
+if __name__ == '__main__':
+    router = sys.argv[1] if len(sys.argv) > 1 else './mavlink-routerd'
+
+    # One fd per client on each side
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < 2 * max(CLIENTS) + 64:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, 2 * max(CLIENTS) + 64), hard))
+
+    for n in CLIENTS:
+        run(router, n)
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+
+# This file is part of the MAVLink Router project
+#
+# Copyright (C) 2021  Intel Corporation. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+'''
+Load test of UDP routing on the loopback interface: ENDPOINTS clients each
+send heartbeats to their own UDP endpoint of the router, which routes them
+to every other client. Reports the router's CPU use per routed message, its
+syscalls to read and write and its wakeups per routed message, and the share
+of messages delivered, with each event backend and with 1 to 4 threads.
+
+Usage: udp_load_test.py [path to mavlink-routerd] [rate in messages/s per client]...
+'''
+
+import os
+import re
+import selectors
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+UDP_PORT = 24600
+ENDPOINTS = 4
+RATES_HZ = [500, 2000, 5000]
+BACKENDS = ['epoll', 'io_uring']
+THREADS = [2, 3, 4]
+DURATION_SEC = 5
+# Messages are sent in bursts, once per tick
+TICK_SEC = 0.005
+
+
+def x25crc(data, extra):
+    crc = 0xffff
+    for b in bytearray(data) + bytearray([extra]):
+        tmp = b ^ (crc & 0xff)
+        tmp = (tmp ^ (tmp << 4)) & 0xff
+        crc = ((crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4)) & 0xffff
+    return crc
+
+
+def heartbeat(seq, sysid):
+    payload = struct.pack('<IBBBBB', 0, 2, 3, 0x51, 4, 3)
+    header = struct.pack('<BBBBBBBHB', 0xfd, len(payload), 0, 0, seq & 0xff, sysid, 1, 0, 0)
+    return header + payload + struct.pack('<H', x25crc(header[1:] + payload, 50))
+
+
+def proc_stat(pid):
+    '''Return (CPU time in seconds, voluntary context switches) of pid and its threads'''
+    cpu = 0.0
+    switches = 0
+    for tid in os.listdir('/proc/%d/task' % pid):
+        with open('/proc/%d/task/%s/stat' % (pid, tid)) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        cpu += (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+        with open('/proc/%d/task/%s/status' % (pid, tid)) as f:
+            switches += [int(l.split()[1]) for l in f if l.startswith('voluntary_ctxt_switches:')][0]
+    return cpu, switches
+
+
+def reads_writes(stats):
+    '''Return the number of reads and writes of all endpoints in the last statistics'''
+    last = {}
+    for m in re.finditer(r'Endpoint .*?\[(\d+)\] .*?Reads: (\d+) .*?Writes: (\d+) ', stats, re.S):
+        last[m.group(1)] = int(m.group(2)) + int(m.group(3))
+    return sum(last.values())
+
+
+def write_conf(f, general):
+    f.write('[General]\nTcpServerPort = 0\nReportStats = true\n')
+    for key, value in general.items():
+        f.write('%s = %s\n' % (key, value))
+    for i in range(ENDPOINTS):
+        f.write('\n[UdpEndpoint client%d]\nMode = Eavesdropping\nAddress = 127.0.0.1\nPort = %d\n'
+                % (i, UDP_PORT + i))
+    f.flush()
+
+
+def drain(sel, received, timeout):
+    for key, _ in sel.select(timeout):
+        while True:
+            try:
+                key.fileobj.recv(65536)
+            except (BlockingIOError, ConnectionRefusedError):
+                break
+            received[0] += 1
+
+
+def run(router, label, general, rate):
+    with tempfile.NamedTemporaryFile('w', suffix='.conf') as conf:
+        write_conf(conf, general)
+        p = subprocess.Popen([router, '-c', conf.name], stdout=subprocess.PIPE,
+                             stderr=subprocess.DEVNULL, universal_newlines=True)
+        time.sleep(1)
+
+    sel = selectors.DefaultSelector()
+    clients = []
+    received = [0]
+
+    try:
+        for i in range(ENDPOINTS):
+            c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            c.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+            c.connect(('127.0.0.1', UDP_PORT + i))
+            c.setblocking(False)
+            sel.register(c, selectors.EVENT_READ)
+            clients.append(c)
+
+        # Let the router learn where the clients are
+        for i, c in enumerate(clients):
+            c.send(heartbeat(0, i + 1))
+        time.sleep(0.2)
+        drain(sel, received, 0.1)
+        received[0] = 0
+
+        cpu_start, switches_start = proc_stat(p.pid)
+        start = time.time()
+        sent = 0
+        per_tick = max(int(rate * TICK_SEC), 1)
+        tick = 0
+        while time.time() - start < DURATION_SEC:
+            for _ in range(per_tick):
+                for i, c in enumerate(clients):
+                    try:
+                        c.send(heartbeat(sent, i + 1))
+                    except (BlockingIOError, ConnectionRefusedError):
+                        pass
+                sent += 1
+            tick += 1
+            deadline = start + tick * TICK_SEC
+            while time.time() < deadline:
+                drain(sel, received, max(deadline - time.time(), 0))
+        drain(sel, received, 0.5)
+        cpu_end, switches_end = proc_stat(p.pid)
+        elapsed = time.time() - start
+        # Statistics are printed every second
+        time.sleep(1)
+    finally:
+        p.terminate()
+        stats = p.communicate()[0]
+        for c in clients:
+            c.close()
+
+    routed = sent * ENDPOINTS * (ENDPOINTS - 1)
+    cpu = cpu_end - cpu_start
+    print('%-10s %6d msg/s in: CPU %5.1f%% (%.2f us/routed message), per routed message '
+          '%.3f reads+writes and %.3f wakeups, %.1f%% of %d messages delivered'
+          % (label, rate * ENDPOINTS, 100 * cpu / elapsed, 1e6 * cpu / routed,
+             float(reads_writes(stats)) / routed, float(switches_end - switches_start) / routed,
+             100.0 * received[0] / routed, routed))
+
+
+if __name__ == '__main__':
+    router = sys.argv[1] if len(sys.argv) > 1 else './mavlink-routerd'
+    rates = [int(r) for r in sys.argv[2:]] or RATES_HZ
+
+    for rate in rates:
+        for backend in BACKENDS:
+            run(router, backend, {'EventBackend': backend}, rate)
+        for threads in THREADS:
+            run(router, '%d threads' % threads, {'Threads': threads}, rate)